@@ -0,0 +1,532 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// runs a GattClient against an in-process ATT client over a socketpair so
+// the GATT path can be measured without a radio. a relay between the two
+// ends counts every PDU in each direction
+#include "gattserver.h"
+#include "../defs.h"
+#include "../logger.h"
+#include "../jsonwrapper.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <cJSON.h>
+
+extern "C" {
+#include <lib/uuid.h>
+#include <src/shared/mainloop.h>
+#include <src/shared/gatt-client.h>
+}
+
+namespace
+{
+  char const kUuidRpcService[] = "503553ca-eb90-11e8-ac5b-bb7e434023e8";
+  char const kUuidRpcInbox[] = "510c87c8-eb90-11e8-b3dc-17292c2ecc2d";
+  char const kUuidRpcEPoll[] = "5140f882-eb90-11e8-a835-13d2bd922d3f";
+  char const kUuidRpcOutbox[] = "5177f6de-eb90-11e8-9ad4-3b5c0e4f4a2b";
+
+  struct PduCounter
+  {
+    uint64_t Pdus;
+    uint64_t Bytes;
+  };
+
+  struct Bench
+  {
+    int         Count;
+    int         RequestSize;
+    int         ResponseSize;
+    int         Mtu;
+    bool        ReadMode;
+
+    int         Relay[2];
+    PduCounter  ToClient;
+    PduCounter  ToServer;
+    PduCounter  DiscoveryToClient;
+    PduCounter  DiscoveryToServer;
+
+    std::shared_ptr<GattClient>  Server;
+    bt_att*                      Att;
+    bt_gatt_client*              Client;
+    uint16_t    InboxHandle;
+    uint16_t    EPollHandle;
+    uint16_t    OutboxHandle;
+
+    std::chrono::steady_clock::time_point Started;
+    std::chrono::steady_clock::time_point Ready;
+    std::chrono::steady_clock::time_point Finished;
+    std::chrono::steady_clock::time_point Sent;
+
+    int         Done;
+    bool        ReadInFlight;
+    bool        ReadPending;
+    std::vector<char>   Incoming;
+    std::vector<double> Latencies;
+    uint64_t    ResponseBytes;
+    bool        Failed;
+  };
+
+  void
+  printHelp()
+  {
+    printf("\n");
+    printf("attbench [args]\n");
+    printf("\t-n  --count    <n>     Requests to send (default 1000)\n");
+    printf("\t-q  --request  <bytes> Request size (default 64)\n");
+    printf("\t-s  --response <bytes> Response size (default 512)\n");
+    printf("\t-m  --mtu      <bytes> ATT MTU the client asks for (default 247)\n");
+    printf("\t-r  --read             Pull responses with Read Blob instead of notifications\n");
+    printf("\t-d  --debug            Enable debug logging\n");
+    printf("\t-h  --help             Print this help and exit\n");
+    exit(0);
+  }
+
+  void
+  fail(Bench* bench, char const* what)
+  {
+    fprintf(stderr, "attbench: %s\n", what);
+    bench->Failed = true;
+    mainloop_quit();
+  }
+
+  // one SEQPACKET read is one PDU
+  void
+  relay(int from, int to, PduCounter& counter, Bench* bench)
+  {
+    uint8_t buff[BT_ATT_MAX_LE_MTU + 1];
+    ssize_t n = recv(from, buff, sizeof(buff), 0);
+    if (n <= 0)
+    {
+      if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+      mainloop_remove_fd(from);
+      if (!bench->Finished.time_since_epoch().count())
+        fail(bench, "connection closed");
+      return;
+    }
+
+    counter.Pdus++;
+    counter.Bytes += n;
+    if (send(to, buff, n, 0) != n)
+      fail(bench, "relay send failed");
+  }
+
+  void Bench_onServerSide(int UNUSED_PARAM(fd), uint32_t UNUSED_PARAM(events), void* argp)
+  {
+    Bench* bench = reinterpret_cast<Bench *>(argp);
+    relay(bench->Relay[0], bench->Relay[1], bench->ToClient, bench);
+  }
+
+  void Bench_onClientSide(int UNUSED_PARAM(fd), uint32_t UNUSED_PARAM(events), void* argp)
+  {
+    Bench* bench = reinterpret_cast<Bench *>(argp);
+    relay(bench->Relay[1], bench->Relay[0], bench->ToServer, bench);
+  }
+
+  void
+  sendRequest(Bench* bench)
+  {
+    std::vector<uint8_t> request(bench->RequestSize, 'q');
+    request.push_back(kRecordDelimiter);
+
+    bench->Sent = std::chrono::steady_clock::now();
+
+    int chunk = bt_gatt_client_get_mtu(bench->Client) - 3;
+    for (size_t offset = 0; offset < request.size(); offset += chunk)
+    {
+      uint16_t n = static_cast<uint16_t>(std::min(request.size() - offset, static_cast<size_t>(chunk)));
+      if (!bt_gatt_client_write_without_response(bench->Client, bench->InboxHandle, false,
+        request.data() + offset, n))
+      {
+        fail(bench, "inbox write failed");
+        return;
+      }
+    }
+  }
+
+  void
+  onBytes(Bench* bench, uint8_t const* value, uint16_t length)
+  {
+    bench->ResponseBytes += length;
+    for (uint16_t i = 0; i < length; ++i)
+    {
+      if (value[i] != kRecordDelimiter)
+      {
+        bench->Incoming.push_back(value[i]);
+        continue;
+      }
+
+      auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - bench->Sent);
+      bench->Latencies.push_back(static_cast<double>(elapsed.count()));
+
+      if (static_cast<int>(bench->Incoming.size()) != bench->ResponseSize)
+      {
+        fail(bench, "response truncated");
+        return;
+      }
+      bench->Incoming.clear();
+
+      if (++bench->Done == bench->Count)
+      {
+        bench->Finished = std::chrono::steady_clock::now();
+        mainloop_quit();
+        return;
+      }
+      sendRequest(bench);
+    }
+  }
+
+  void readOutbox(Bench* bench);
+
+  void Bench_onOutboxRead(bool success, uint8_t att_ecode, uint8_t const* value, uint16_t length, void* argp)
+  {
+    Bench* bench = reinterpret_cast<Bench *>(argp);
+    bench->ReadInFlight = false;
+    if (!success)
+    {
+      fprintf(stderr, "attbench: outbox read failed:0x%02x\n", att_ecode);
+      fail(bench, "outbox read failed");
+      return;
+    }
+
+    onBytes(bench, value, length);
+
+    // the epoll notification for the next response can land while this
+    // read was still going
+    if (bench->ReadPending && !bench->Failed)
+      readOutbox(bench);
+  }
+
+  void
+  readOutbox(Bench* bench)
+  {
+    if (bench->ReadInFlight)
+    {
+      bench->ReadPending = true;
+      return;
+    }
+
+    bench->ReadPending = false;
+    bench->ReadInFlight = true;
+    if (!bt_gatt_client_read_long_value(bench->Client, bench->OutboxHandle, 0, &Bench_onOutboxRead, bench,
+      nullptr))
+      fail(bench, "outbox read failed");
+  }
+
+  void Bench_onNotify(uint16_t value_handle, uint8_t const* value, uint16_t length, void* argp)
+  {
+    Bench* bench = reinterpret_cast<Bench *>(argp);
+    if (value_handle == bench->OutboxHandle)
+      onBytes(bench, value, length);
+    else if (value_handle == bench->EPollHandle)
+      readOutbox(bench);
+  }
+
+  void Bench_onRegistered(uint16_t att_ecode, void* argp)
+  {
+    Bench* bench = reinterpret_cast<Bench *>(argp);
+    if (att_ecode)
+    {
+      fail(bench, "failed to subscribe");
+      return;
+    }
+
+    bench->Ready = std::chrono::steady_clock::now();
+    bench->DiscoveryToClient = bench->ToClient;
+    bench->DiscoveryToServer = bench->ToServer;
+    sendRequest(bench);
+  }
+
+  void Bench_onCharacteristic(gatt_db_attribute* attr, void* argp)
+  {
+    Bench* bench = reinterpret_cast<Bench *>(argp);
+
+    uint16_t handle = 0;
+    uint16_t valueHandle = 0;
+    uint8_t properties = 0;
+    bt_uuid_t uuid;
+    if (!gatt_db_attribute_get_char_data(attr, &handle, &valueHandle, &properties, &uuid))
+      return;
+
+    bt_uuid_t want;
+    bt_string_to_uuid(&want, kUuidRpcInbox);
+    if (bt_uuid_cmp(&uuid, &want) == 0)
+      bench->InboxHandle = valueHandle;
+    bt_string_to_uuid(&want, kUuidRpcEPoll);
+    if (bt_uuid_cmp(&uuid, &want) == 0)
+      bench->EPollHandle = valueHandle;
+    bt_string_to_uuid(&want, kUuidRpcOutbox);
+    if (bt_uuid_cmp(&uuid, &want) == 0)
+      bench->OutboxHandle = valueHandle;
+  }
+
+  void Bench_onService(gatt_db_attribute* attr, void* argp)
+  {
+    gatt_db_service_foreach_char(attr, &Bench_onCharacteristic, argp);
+  }
+
+  void Bench_onReady(bool success, uint8_t att_ecode, void* argp)
+  {
+    Bench* bench = reinterpret_cast<Bench *>(argp);
+    if (!success)
+    {
+      fprintf(stderr, "attbench: discovery failed:0x%02x\n", att_ecode);
+      fail(bench, "discovery failed");
+      return;
+    }
+
+    bt_uuid_t uuid;
+    bt_string_to_uuid(&uuid, kUuidRpcService);
+    gatt_db_foreach_service(bt_gatt_client_get_db(bench->Client), &uuid, &Bench_onService, bench);
+    if (!bench->InboxHandle || !bench->EPollHandle || !bench->OutboxHandle)
+    {
+      fail(bench, "rpc service not found");
+      return;
+    }
+
+    // notifications on the outbox put the server in push mode, on the
+    // epoll it only announces what's waiting to be read
+    uint16_t handle = bench->ReadMode ? bench->EPollHandle : bench->OutboxHandle;
+    if (!bt_gatt_client_register_notify(bench->Client, handle, &Bench_onRegistered, &Bench_onNotify, bench,
+      nullptr))
+      fail(bench, "failed to subscribe");
+  }
+
+  void Bench_onTimeout(int UNUSED_PARAM(id), void* argp)
+  {
+    Bench* bench = reinterpret_cast<Bench *>(argp);
+    fprintf(stderr, "attbench: timed out after %d of %d responses\n", bench->Done, bench->Count);
+    fail(bench, "timed out");
+  }
+
+  double
+  percentile(std::vector<double> const& sorted, double p)
+  {
+    if (sorted.empty())
+      return 0.0;
+    size_t i = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+  }
+
+  void
+  report(Bench const& bench)
+  {
+    std::vector<double> sorted(bench.Latencies);
+    std::sort(sorted.begin(), sorted.end());
+
+    double sum = 0.0;
+    for (double d : sorted)
+      sum += d;
+
+    double discovery = std::chrono::duration<double, std::milli>(bench.Ready - bench.Started).count();
+    double elapsed = std::chrono::duration<double>(bench.Finished - bench.Ready).count();
+    double n = static_cast<double>(bench.Done);
+
+    printf("mode:%s mtu:%u request:%d response:%d count:%d\n", bench.ReadMode ? "read" : "notify",
+      bt_gatt_client_get_mtu(bench.Client), bench.RequestSize, bench.ResponseSize, bench.Done);
+    printf("discovery: %.3f ms, %llu pdus to client, %llu pdus to server\n", discovery,
+      static_cast<unsigned long long>(bench.DiscoveryToClient.Pdus),
+      static_cast<unsigned long long>(bench.DiscoveryToServer.Pdus));
+    printf("latency us: min %.0f avg %.1f p50 %.0f p95 %.0f p99 %.0f max %.0f\n",
+      sorted.empty() ? 0.0 : sorted.front(), sorted.empty() ? 0.0 : sum / sorted.size(),
+      percentile(sorted, 0.50), percentile(sorted, 0.95), percentile(sorted, 0.99),
+      sorted.empty() ? 0.0 : sorted.back());
+    printf("pdus per response: %.2f to client, %.2f to server\n",
+      (bench.ToClient.Pdus - bench.DiscoveryToClient.Pdus) / n,
+      (bench.ToServer.Pdus - bench.DiscoveryToServer.Pdus) / n);
+    printf("throughput: %.0f response bytes/s, %.0f ATT bytes/s to client, %.1f responses/s\n",
+      bench.ResponseBytes / elapsed, (bench.ToClient.Bytes - bench.DiscoveryToClient.Bytes) / elapsed,
+      n / elapsed);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  Bench bench;
+  memset(&bench.ToClient, 0, sizeof(bench.ToClient));
+  memset(&bench.ToServer, 0, sizeof(bench.ToServer));
+  bench.DiscoveryToClient = bench.ToClient;
+  bench.DiscoveryToServer = bench.ToServer;
+  bench.Count = 1000;
+  bench.RequestSize = 64;
+  bench.ResponseSize = 512;
+  bench.Mtu = 247;
+  bench.ReadMode = false;
+  bench.Att = nullptr;
+  bench.Client = nullptr;
+  bench.InboxHandle = 0;
+  bench.EPollHandle = 0;
+  bench.OutboxHandle = 0;
+  bench.Done = 0;
+  bench.ReadInFlight = false;
+  bench.ReadPending = false;
+  bench.ResponseBytes = 0;
+  bench.Failed = false;
+
+  Logger::logger().setLevel(LogLevel::Error);
+
+  while (true)
+  {
+    static struct option longOptions[] =
+    {
+      { "count",    required_argument, 0, 'n' },
+      { "request",  required_argument, 0, 'q' },
+      { "response", required_argument, 0, 's' },
+      { "mtu",      required_argument, 0, 'm' },
+      { "read",     no_argument, 0, 'r' },
+      { "debug",    no_argument, 0, 'd' },
+      { "help",     no_argument, 0, 'h' },
+      { 0, 0, 0, 0 }
+    };
+
+    int optionIndex = 0;
+    int c = getopt_long(argc, argv, "n:q:s:m:rdh", longOptions, &optionIndex);
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+      case 'n':
+        bench.Count = std::max(atoi(optarg), 1);
+        break;
+      case 'q':
+        bench.RequestSize = std::max(atoi(optarg), 0);
+        break;
+      case 's':
+        bench.ResponseSize = std::max(atoi(optarg), 1);
+        break;
+      case 'm':
+        bench.Mtu = std::min(std::max(atoi(optarg), BT_ATT_DEFAULT_LE_MTU), BT_ATT_MAX_LE_MTU);
+        break;
+      case 'r':
+        bench.ReadMode = true;
+        break;
+      case 'd':
+        Logger::logger().setLevel(LogLevel::Debug);
+        break;
+      case 'h':
+        printHelp();
+        break;
+      default:
+        break;
+    }
+  }
+
+  // the server side gets the same defaults as a real listener, without
+  // the link management that needs an adapter
+  cJSON* conf = cJSON_CreateObject();
+  cJSON_AddNumberToObject(conf, "att-mtu", BT_ATT_MAX_LE_MTU);
+  cJSON_AddNumberToObject(conf, "outgoing-max-bytes", std::max(65536, bench.ResponseSize * 2));
+  cJSON_AddNumberToObject(conf, "max-request-size", std::max(kDefaultMaxRequestSize, bench.RequestSize + 1));
+  cJSON* link = cJSON_AddObjectToObject(conf, "connection-parameters");
+  cJSON_AddNumberToObject(link, "idle-ms", 0);
+
+  DeviceInfoProvider deviceInfo;
+  deviceInfo.GetSystemId = [] { return std::string("attbench"); };
+  deviceInfo.GetModelNumber = deviceInfo.GetSystemId;
+  deviceInfo.GetSerialNumber = deviceInfo.GetSystemId;
+  deviceInfo.GetFirmwareRevision = deviceInfo.GetSystemId;
+  deviceInfo.GetHardwareRevision = deviceInfo.GetSystemId;
+  deviceInfo.GetSoftwareRevision = deviceInfo.GetSystemId;
+  deviceInfo.GetManufacturerName = deviceInfo.GetSystemId;
+
+  RdkDiagProvider rdkDiag;
+  rdkDiag.rdkDiagUuid = 0xfdb9;
+  rdkDiag.GetDeviceStatus = [] { return std::string("READY"); };
+  rdkDiag.GetFirmwareDownloadStatus = rdkDiag.GetDeviceStatus;
+  rdkDiag.GetWebPAStatus = rdkDiag.GetDeviceStatus;
+  rdkDiag.GetWiFiRadio1Status = rdkDiag.GetDeviceStatus;
+  rdkDiag.GetWiFiRadio2Status = rdkDiag.GetDeviceStatus;
+  rdkDiag.GetRFStatus = rdkDiag.GetDeviceStatus;
+
+  mainloop_init();
+
+  // server <-> Relay[0] ... Relay[1] <-> client
+  int serverPair[2];
+  int clientPair[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, serverPair) < 0
+    || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, clientPair) < 0)
+  {
+    fprintf(stderr, "attbench: socketpair failed. %s\n", strerror(errno));
+    return 1;
+  }
+  bench.Relay[0] = serverPair[1];
+  bench.Relay[1] = clientPair[0];
+  mainloop_add_fd(bench.Relay[0], EPOLLIN, &Bench_onServerSide, &bench, nullptr);
+  mainloop_add_fd(bench.Relay[1], EPOLLIN, &Bench_onClientSide, &bench, nullptr);
+
+  std::shared_ptr<GattServer> server(new GattServer());
+  server->initLoopback(conf, deviceInfo, rdkDiag);
+  cJSON_Delete(conf);
+
+  bench.Started = std::chrono::steady_clock::now();
+
+  // answered right on the mainloop, there's no rpc server in the way
+  std::shared_ptr<char> response(new char[bench.ResponseSize], std::default_delete<char[]>());
+  memset(response.get(), 'r', bench.ResponseSize);
+  bench.Server = server->attach(serverPair[0], "loopback", -1);
+  GattClient* clnt = bench.Server.get();
+  int responseSize = bench.ResponseSize;
+  bench.Server->setDataHandler([clnt, response, responseSize](char const* UNUSED_PARAM(buff), int UNUSED_PARAM(n),
+    RecordCheck UNUSED_PARAM(check))
+  {
+    clnt->enqueueForSend(std::shared_ptr<char const>(response), responseSize);
+  });
+
+  // the client holds what it's sent until it's run, as it would until
+  // accept() hands it to the rpc server
+  bench.Server->run();
+
+  bench.Att = bt_att_new(clientPair[1], false);
+  bt_att_set_close_on_unref(bench.Att, true);
+  gatt_db* clientDb = gatt_db_new();
+  bench.Client = bt_gatt_client_new(clientDb, bench.Att, static_cast<uint16_t>(bench.Mtu), 0);
+  gatt_db_unref(clientDb);
+  if (!bench.Client)
+  {
+    fprintf(stderr, "attbench: failed to create gatt client\n");
+    return 1;
+  }
+  bt_gatt_client_set_ready_handler(bench.Client, &Bench_onReady, &bench, nullptr);
+
+  int timeout = mainloop_add_timeout(60000, &Bench_onTimeout, &bench, nullptr);
+  mainloop_run();
+  mainloop_remove_timeout(timeout);
+
+  if (!bench.Failed)
+    report(bench);
+
+  bt_gatt_client_unref(bench.Client);
+  bt_att_unref(bench.Att);
+  bench.Server.reset();
+  server.reset();
+  close(bench.Relay[0]);
+  close(bench.Relay[1]);
+
+  return bench.Failed ? 1 : 0;
+}
@@ -0,0 +1,1152 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// runs the rpc server behind loopback GattClients and talks raw ATT to
+// them over socketpairs, the same way attbench does, then checks what comes
+// back. every check that fails is printed and the exit status is non-zero,
+// make check runs it
+#include "gattserver.h"
+#include "../defs.h"
+#include "../jsonwrapper.h"
+#include "../logger.h"
+#include "../recordscan.h"
+#include "../rpcserver.h"
+#include "../util.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <cJSON.h>
+
+extern "C" {
+#include <src/shared/att-types.h>
+#include <src/shared/mainloop.h>
+}
+
+namespace
+{
+  char const kUuidRpcInbox[] = "510c87c8-eb90-11e8-b3dc-17292c2ecc2d";
+  char const kUuidRpcEPoll[] = "5140f882-eb90-11e8-a835-13d2bd922d3f";
+  char const kUuidRpcOutbox[] = "5177f6de-eb90-11e8-9ad4-3b5c0e4f4a2b";
+
+  uint16_t const kHandleRpcService = 0x0050;
+  uint16_t const kUuidCharacteristic = 0x2803;
+  uint16_t const kUuidClientConfig = 0x2902;
+
+  // no MTU exchange, so every record takes several PDUs
+  size_t const kMtu = BT_ATT_DEFAULT_LE_MTU;
+  int const kMaxRequestSize = 1024;
+  int const kTimeoutMs = 2000;
+
+  using JsonPtr = std::shared_ptr<cJSON>;
+
+  int checks = 0;
+  int failures = 0;
+  char const* section = "";
+
+  bool
+  expect(bool ok, char const* what)
+  {
+    checks++;
+    if (!ok)
+    {
+      failures++;
+      fprintf(stderr, "attcheck: %s: %s\n", section, what);
+    }
+    return ok;
+  }
+
+  void
+  printHelp()
+  {
+    printf("\n");
+    printf("attcheck [args]\n");
+    printf("\t-d  --debug            Enable debug logging\n");
+    printf("\t-h  --help             Print this help and exit\n");
+    exit(0);
+  }
+
+  void
+  putLe16(std::vector<uint8_t>& pdu, uint16_t value)
+  {
+    pdu.push_back(static_cast<uint8_t>(value));
+    pdu.push_back(static_cast<uint8_t>(value >> 8));
+  }
+
+  uint16_t
+  getLe16(uint8_t const* p)
+  {
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+  }
+
+  // a 128 bit uuid the way ATT carries it, least significant byte first
+  std::vector<uint8_t>
+  uuidBytes(char const* s)
+  {
+    std::vector<uint8_t> bytes;
+    for (char const* p = s; p[0] && p[1]; )
+    {
+      if (*p == '-')
+      {
+        p++;
+        continue;
+      }
+      bytes.push_back(static_cast<uint8_t>(strtoul(std::string(p, 2).c_str(), nullptr, 16)));
+      p += 2;
+    }
+    std::reverse(bytes.begin(), bytes.end());
+    return bytes;
+  }
+
+  JsonPtr
+  makeJson(cJSON* json)
+  {
+    return JsonPtr(json, [](cJSON* p) { if (p) cJSON_Delete(p); });
+  }
+
+  std::string
+  printJson(cJSON const* json)
+  {
+    char* s = json ? cJSON_PrintUnformatted(json) : nullptr;
+    std::string printed(s ? s : "");
+    free(s);
+    return printed;
+  }
+
+  // id is put in as is, so it can be a number or a quoted string
+  std::string
+  request(char const* method, char const* id, std::string const& params = "{}")
+  {
+    return std::string("{\"jsonrpc\":\"2.0\",\"method\":\"") + method + "\",\"id\":" + id
+      + ",\"params\":" + params + "}";
+  }
+
+  // a record as the server sent it, cbor or json
+  JsonPtr
+  parseRecord(std::string const& record)
+  {
+    if (!record.empty() && record[0] == kCborRecordMarker)
+    {
+      std::vector<uint8_t> decoded;
+      if (!unescapeRecord(record.data(), record.size(), decoded))
+        return JsonPtr();
+      return makeJson(JsonWrapper::fromCbor(decoded.data(), decoded.size()));
+    }
+    return makeJson(cJSON_Parse(record.c_str()));
+  }
+
+  // -1 for a response without an id, like the errors for requests that
+  // were refused before they were parsed
+  int
+  responseId(JsonPtr const& res)
+  {
+    cJSON const* id = res ? cJSON_GetObjectItem(res.get(), "id") : nullptr;
+    return cJSON_IsNumber(id) ? id->valueint : -1;
+  }
+
+  int
+  errorCode(JsonPtr const& res)
+  {
+    cJSON const* error = res ? cJSON_GetObjectItem(res.get(), "error") : nullptr;
+    return error ? JsonWrapper::getInt(error, "code", false, 0) : 0;
+  }
+
+  std::string
+  resultString(JsonPtr const& res, char const* name)
+  {
+    cJSON const* result = res ? cJSON_GetObjectItem(res.get(), "result") : nullptr;
+    char const* s = result ? JsonWrapper::getString(result, name, false, nullptr) : nullptr;
+    return s ? s : "";
+  }
+
+  // the central's end of a loopback connection. requests go out one at a
+  // time, notifications and indications that come in while waiting for a
+  // response are kept for nextPush()
+  class Central
+  {
+  public:
+    Central(int fd)
+      : Inbox(0)
+      , EPoll(0)
+      , Outbox(0)
+      , Notifications(0)
+      , Indications(0)
+      , m_fd(fd)
+      , m_length_prefixed(false) { }
+
+    ~Central()
+      { disconnect(); }
+
+    void
+    disconnect()
+    {
+      if (m_fd != -1)
+        close(m_fd);
+      m_fd = -1;
+    }
+
+    // sends a request and waits for its response, or an error response
+    bool
+    request(std::vector<uint8_t> const& pdu, std::vector<uint8_t>& rsp)
+    {
+      if (!send(pdu))
+        return false;
+      while (receive(rsp, kTimeoutMs))
+      {
+        if (!isPush(rsp))
+          return true;
+        m_pushes.push_back(rsp);
+      }
+      return false;
+    }
+
+    // the next notification or indication, false if none came in time
+    bool
+    nextPush(std::vector<uint8_t>& pdu, int timeoutMs)
+    {
+      if (!m_pushes.empty())
+      {
+        pdu = m_pushes.front();
+        m_pushes.pop_front();
+        return true;
+      }
+      while (receive(pdu, timeoutMs))
+      {
+        if (isPush(pdu))
+          return true;
+      }
+      return false;
+    }
+
+    bool
+    discover()
+    {
+      std::vector<uint8_t> const inbox = uuidBytes(kUuidRpcInbox);
+      std::vector<uint8_t> const epoll = uuidBytes(kUuidRpcEPoll);
+      std::vector<uint8_t> const outbox = uuidBytes(kUuidRpcOutbox);
+
+      // the rpc service is the last one, read characteristic declarations
+      // until there are none left
+      uint16_t start = kHandleRpcService;
+      while (true)
+      {
+        std::vector<uint8_t> pdu{ BT_ATT_OP_READ_BY_TYPE_REQ };
+        putLe16(pdu, start);
+        putLe16(pdu, 0xffff);
+        putLe16(pdu, kUuidCharacteristic);
+
+        std::vector<uint8_t> rsp;
+        if (!request(pdu, rsp))
+          return false;
+        if (rsp[0] == BT_ATT_OP_ERROR_RSP)
+          break;
+        if (rsp[0] != BT_ATT_OP_READ_BY_TYPE_RSP || rsp.size() < 2 || rsp[1] != 21)
+          return false;
+
+        uint16_t last = start;
+        for (size_t i = 2; i + 21 <= rsp.size(); i += 21)
+        {
+          last = getLe16(&rsp[i]);
+          uint16_t value = getLe16(&rsp[i + 3]);
+          std::vector<uint8_t> uuid(rsp.begin() + i + 5, rsp.begin() + i + 21);
+          if (uuid == inbox)
+            Inbox = value;
+          else if (uuid == epoll)
+            EPoll = value;
+          else if (uuid == outbox)
+            Outbox = value;
+        }
+        if (last == 0xffff)
+          break;
+        start = last + 1;
+      }
+      return Inbox && EPoll && Outbox;
+    }
+
+    // the client configuration descriptor is the one right after a value
+    bool
+    writeConfig(uint16_t handle, uint16_t value)
+    {
+      std::vector<uint8_t> pdu{ BT_ATT_OP_FIND_INFO_REQ };
+      putLe16(pdu, handle + 1);
+      putLe16(pdu, handle + 1);
+
+      std::vector<uint8_t> rsp;
+      if (!request(pdu, rsp) || rsp[0] != BT_ATT_OP_FIND_INFO_RSP || rsp.size() != 6
+        || getLe16(&rsp[4]) != kUuidClientConfig)
+        return false;
+
+      pdu = { BT_ATT_OP_WRITE_REQ };
+      putLe16(pdu, handle + 1);
+      putLe16(pdu, value);
+      return request(pdu, rsp) && rsp[0] == BT_ATT_OP_WRITE_RSP;
+    }
+
+    // Read at offset 0, Read Blob past it. ecode is set on an error response
+    bool
+    read(uint16_t handle, size_t offset, std::string& value, uint8_t& ecode)
+    {
+      std::vector<uint8_t> pdu{ static_cast<uint8_t>(offset ? BT_ATT_OP_READ_BLOB_REQ : BT_ATT_OP_READ_REQ) };
+      putLe16(pdu, handle);
+      if (offset)
+        putLe16(pdu, static_cast<uint16_t>(offset));
+
+      std::vector<uint8_t> rsp;
+      if (!request(pdu, rsp))
+        return false;
+
+      value.clear();
+      ecode = 0;
+      if (rsp[0] == BT_ATT_OP_ERROR_RSP && rsp.size() == 5)
+      {
+        ecode = rsp[4];
+        return true;
+      }
+      if (rsp[0] != pdu[0] + 1)
+        return false;
+      value.assign(rsp.begin() + 1, rsp.end());
+      return true;
+    }
+
+    // the bytes as they'd be streamed into the inbox, in the current framing
+    std::string
+    frame(std::string const& record) const
+    {
+      if (!m_length_prefixed)
+        return record + kRecordDelimiter;
+
+      char header[kMaxVarintSize];
+      return std::string(header, putVarint(static_cast<uint32_t>(record.size()), header)) + record;
+    }
+
+    // write commands of up to chunk bytes, or write requests
+    bool
+    writeInbox(std::string const& bytes, size_t chunk, bool withResponse = false)
+    {
+      chunk = std::min(chunk, kMtu - 3);
+      for (size_t offset = 0; offset < bytes.size(); offset += chunk)
+      {
+        std::vector<uint8_t> pdu{ static_cast<uint8_t>(withResponse ? BT_ATT_OP_WRITE_REQ : BT_ATT_OP_WRITE_CMD) };
+        putLe16(pdu, Inbox);
+        size_t n = std::min(chunk, bytes.size() - offset);
+        pdu.insert(pdu.end(), bytes.begin() + offset, bytes.begin() + offset + n);
+
+        std::vector<uint8_t> rsp;
+        if (withResponse ? !(request(pdu, rsp) && rsp[0] == BT_ATT_OP_WRITE_RSP) : !send(pdu))
+          return false;
+      }
+      return true;
+    }
+
+    bool
+    sendRecord(std::string const& record, size_t chunk = kMtu - 3)
+      { return writeInbox(frame(record), chunk); }
+
+    // the next record pushed to the outbox. indications are confirmed as
+    // they come in
+    bool
+    nextRecord(std::string& record)
+    {
+      while (!takeRecord(record))
+      {
+        std::vector<uint8_t> pdu;
+        if (!nextPush(pdu, kTimeoutMs))
+          return false;
+        if (pdu.size() < 3 || getLe16(&pdu[1]) != Outbox)
+          continue;
+
+        take(pdu);
+        if (pdu[0] == BT_ATT_OP_HANDLE_VAL_IND && !confirm())
+          return false;
+      }
+      return true;
+    }
+
+    // adds what an outbox notification or indication carries to the stream
+    // of records. an indication still has to be confirmed
+    void
+    take(std::vector<uint8_t> const& pdu)
+    {
+      if (pdu[0] == BT_ATT_OP_HANDLE_VAL_IND)
+        Indications++;
+      else
+        Notifications++;
+      m_stream.append(reinterpret_cast<char const *>(pdu.data()) + 3, pdu.size() - 3);
+    }
+
+    bool
+    confirm()
+    {
+      std::vector<uint8_t> pdu{ BT_ATT_OP_HANDLE_VAL_CONF };
+      return send(pdu);
+    }
+
+    // the value of the outbox, pulled with Read and Read Blob. while it's
+    // empty, waits for the epoll notification
+    bool
+    readValue(std::string& bytes)
+    {
+      std::string value;
+      uint8_t ecode = 0;
+      while (true)
+      {
+        if (!read(Outbox, 0, value, ecode) || ecode)
+          return false;
+        if (!value.empty())
+          break;
+
+        std::vector<uint8_t> pdu;
+        if (!nextPush(pdu, kTimeoutMs))
+          return false;
+      }
+
+      bytes = value;
+      while (value.size() == kMtu - 1)
+      {
+        if (!read(Outbox, bytes.size(), value, ecode) || ecode)
+          return false;
+        bytes += value;
+      }
+      return true;
+    }
+
+    // the next record, a long one comes in more than one value
+    bool
+    readRecord(std::string& record)
+    {
+      while (!takeRecord(record))
+      {
+        std::string bytes;
+        if (!readValue(bytes))
+          return false;
+        m_stream += bytes;
+      }
+      return true;
+    }
+
+    bool
+    exchange(std::string const& req, std::string& record)
+      { return sendRecord(req) && nextRecord(record); }
+
+    JsonPtr
+    call(std::string const& req, size_t chunk = kMtu - 3)
+    {
+      std::string record;
+      if (!sendRecord(req, chunk) || !nextRecord(record))
+        return JsonPtr();
+      return parseRecord(record);
+    }
+
+    // how records from the server are split from here on
+    void
+    setLengthPrefixed(bool lengthPrefixed)
+      { m_length_prefixed = lengthPrefixed; }
+
+  public:
+    uint16_t  Inbox;
+    uint16_t  EPoll;
+    uint16_t  Outbox;
+    int       Notifications;
+    int       Indications;
+
+  private:
+    static bool
+    isPush(std::vector<uint8_t> const& pdu)
+      { return pdu[0] == BT_ATT_OP_HANDLE_VAL_NOT || pdu[0] == BT_ATT_OP_HANDLE_VAL_IND; }
+
+    bool
+    send(std::vector<uint8_t> const& pdu)
+    {
+      return m_fd != -1 && ::send(m_fd, pdu.data(), pdu.size(), 0) == static_cast<ssize_t>(pdu.size());
+    }
+
+    // one SEQPACKET read is one PDU
+    bool
+    receive(std::vector<uint8_t>& pdu, int timeoutMs)
+    {
+      pollfd p;
+      p.fd = m_fd;
+      p.events = POLLIN;
+      p.revents = 0;
+      if (m_fd == -1 || poll(&p, 1, timeoutMs) <= 0)
+        return false;
+
+      pdu.resize(BT_ATT_MAX_LE_MTU + 1);
+      ssize_t n = recv(m_fd, pdu.data(), pdu.size(), 0);
+      if (n <= 0)
+        return false;
+      pdu.resize(n);
+      return true;
+    }
+
+    bool
+    takeRecord(std::string& record)
+    {
+      if (m_length_prefixed)
+      {
+        uint32_t n = 0;
+        int header = getVarint(m_stream.data(), m_stream.size(), n);
+        if (header <= 0 || m_stream.size() < header + n)
+          return false;
+        record.assign(m_stream, header, n);
+        m_stream.erase(0, header + n);
+        return true;
+      }
+
+      size_t i = m_stream.find(kRecordDelimiter);
+      if (i == std::string::npos)
+        return false;
+      record.assign(m_stream, 0, i);
+      m_stream.erase(0, i + 1);
+      return true;
+    }
+
+  private:
+    int                               m_fd;
+    bool                              m_length_prefixed;
+    std::string                       m_stream;
+    std::deque< std::vector<uint8_t> > m_pushes;
+  };
+
+  // the peripheral's side. GattClient has to be set up on the mainloop
+  // thread, so connections are handed over to it through a pipe
+  struct Harness
+  {
+    std::shared_ptr<GattServer>   Gatt;
+    std::shared_ptr<RpcServer>    Rpc;
+    int                           Pipe[2];
+    std::thread                   Thread;
+    std::mutex                    Mutex;
+    std::condition_variable       Cond;
+    bool                          Attached;
+    std::weak_ptr<GattClient>     Client;
+  };
+
+  void Harness_onConnect(int UNUSED_PARAM(fd), uint32_t UNUSED_PARAM(events), void* argp)
+  {
+    Harness* h = reinterpret_cast<Harness *>(argp);
+    int soc = -1;
+    if (read(h->Pipe[0], &soc, sizeof(soc)) != sizeof(soc))
+      return;
+    if (soc < 0)
+    {
+      mainloop_quit();
+      return;
+    }
+
+    std::shared_ptr<GattClient> clnt = h->Gatt->attach(soc, "attcheck", -1);
+    h->Rpc->addClient(clnt);
+    h->Rpc->run(clnt);
+    {
+      std::lock_guard<std::mutex> guard(h->Mutex);
+      h->Client = clnt;
+      h->Attached = true;
+    }
+    h->Cond.notify_all();
+  }
+
+  // a new connection, returns the central's end of it
+  int
+  connect(Harness& h, std::weak_ptr<GattClient>& client)
+  {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+    {
+      fprintf(stderr, "attcheck: socketpair failed. %s\n", strerror(errno));
+      return -1;
+    }
+
+    std::unique_lock<std::mutex> guard(h.Mutex);
+    h.Attached = false;
+    if (write(h.Pipe[1], &fds[0], sizeof(fds[0])) != sizeof(fds[0]))
+    {
+      close(fds[0]);
+      close(fds[1]);
+      return -1;
+    }
+    h.Cond.wait(guard, [&h] { return h.Attached; });
+    client = h.Client;
+    return fds[1];
+  }
+
+  // the server lets go of a connection once bt_att sees it hang up
+  bool
+  waitForRelease(std::weak_ptr<GattClient> const& client)
+  {
+    for (int i = 0; i < kTimeoutMs / 10 && !client.expired(); ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return client.expired();
+  }
+
+  void
+  checkUtf8()
+  {
+    section = "utf-8";
+
+    struct
+    {
+      char const* Text;
+      bool        Valid;
+    } const cases[] =
+    {
+      { "plain ascii", true },
+      { "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x93\xb6", true },
+      { "\xc0\xaf", false },
+      { "\xe0\x80\xaf", false },
+      { "\xed\xa0\x80", false },
+      { "\xf4\x90\x80\x80", false },
+      { "\xc3", false },
+      { "\xff", false }
+    };
+
+    // the padding moves each case across the vector block boundaries
+    size_t const pads[] = { 0, 15, 31, 63, 64, 100 };
+    for (auto const& c : cases)
+    {
+      for (size_t pad : pads)
+      {
+        std::string s = std::string(pad, 'a') + c.Text;
+        expect(isValidUtf8(s.data(), s.size()) == c.Valid, "isValidUtf8");
+
+        // the scanner has to come to the same answer one byte at a time
+        std::string record = "{\"s\":\"" + s + "\"}" + kRecordDelimiter;
+        RecordScanner whole;
+        RecordScanner bytes;
+        size_t found = whole.scan(record.data(), record.size());
+        size_t i = 0;
+        while (i < record.size() && bytes.scan(record.data() + i, 1) == 1)
+          i++;
+        expect(found == record.size() - 1 && i == found, "delimiter found");
+        expect((whole.check() == RecordCheck::Valid) == c.Valid, "scanned record");
+        expect((bytes.check() == RecordCheck::Valid) == c.Valid, "scanned record a byte at a time");
+      }
+    }
+  }
+
+  void
+  checkVarint()
+  {
+    section = "varint";
+
+    uint32_t const values[] = { 0, 1, 127, 128, 16383, 16384, 0x0fffffff, 0xffffffff };
+    for (uint32_t v : values)
+    {
+      char buff[kMaxVarintSize];
+      int n = putVarint(v, buff);
+      uint32_t out = 0;
+      expect(getVarint(buff, n, out) == n && out == v, "round trip");
+      expect(getVarint(buff, n - 1, out) == 0, "cut short");
+    }
+
+    uint32_t out = 0;
+    expect(getVarint("\x80\x80\x80\x80\x10", 5, out) == -1, "more than 32 bits");
+    expect(getVarint("\x80\x80\x80\x80\x80\x01", 6, out) == -1, "too long");
+  }
+
+  void
+  checkCbor()
+  {
+    section = "cbor";
+
+    // everything toCbor makes has to come back the same
+    JsonPtr original = makeJson(cJSON_Parse("{\"jsonrpc\":\"2.0\",\"id\":12,\"method\":\"wifi-connect\","
+      "\"params\":{\"ssid\":\"caf\xc3\xa9\",\"channels\":[1,6,11],\"hidden\":false,\"open\":true,"
+      "\"rssi\":-67,\"ratio\":0.25,\"third\":0.3333,\"big\":1e19,\"small\":-9.3e18,\"huge\":1e300,"
+      "\"key\":null,\"empty\":{},\"none\":[]}}"));
+    std::vector<uint8_t> encoded;
+    JsonWrapper::toCbor(original.get(), encoded);
+    JsonPtr decoded = makeJson(JsonWrapper::fromCbor(encoded.data(), encoded.size()));
+    expect(decoded && printJson(decoded.get()) == printJson(original.get()), "round trip");
+
+    struct
+    {
+      double                Value;
+      std::vector<uint8_t>  Cbor;
+    } const numbers[] =
+    {
+      { 12, { 0x0c } },
+      { 500, { 0x19, 0x01, 0xf4 } },
+      { -67, { 0x38, 0x42 } },
+      { 0.25, { 0xfa, 0x3e, 0x80, 0x00, 0x00 } },
+      { 1e19, { 0xfb, 0x43, 0xe1, 0x58, 0xe4, 0x60, 0x91, 0x3d, 0x00 } }
+    };
+    for (auto const& n : numbers)
+    {
+      JsonPtr number = makeJson(cJSON_CreateNumber(n.Value));
+      std::vector<uint8_t> out;
+      JsonWrapper::toCbor(number.get(), out);
+      expect(out == n.Cbor, "number encoding");
+    }
+
+    double const special[] = { NAN, INFINITY, -INFINITY };
+    for (double d : special)
+    {
+      JsonPtr number = makeJson(cJSON_CreateNumber(d));
+      std::vector<uint8_t> out;
+      JsonWrapper::toCbor(number.get(), out);
+      JsonPtr back = makeJson(JsonWrapper::fromCbor(out.data(), out.size()));
+      expect(cJSON_IsNumber(back.get()) && (isnan(d) ? isnan(back->valuedouble) : back->valuedouble == d),
+        "non-finite number");
+    }
+
+    // indefinite length map, array and text, and a half float
+    uint8_t const indefinite[] =
+    {
+      0xbf, 0x61, 'a', 0x9f, 0x01, 0x02, 0xff, 0x61, 'b', 0x7f, 0x61, 'x', 0x62, 'y', 'z', 0xff,
+      0x61, 'c', 0xf9, 0x3c, 0x00, 0xff
+    };
+    decoded = makeJson(JsonWrapper::fromCbor(indefinite, sizeof(indefinite)));
+    expect(printJson(decoded.get()) == "{\"a\":[1,2],\"b\":\"xyz\",\"c\":1}", "indefinite lengths");
+
+    std::vector<uint8_t> const invalid[] =
+    {
+      { 0x1f },
+      { 0x3f },
+      { 0xdf, 0x01 },
+      { 0xff },
+      { 0x5f, 0x41, 'a', 0xff },
+      { 0x7f, 0x41, 'a', 0xff },
+      { 0x7f, 0x7f, 0xff, 0xff },
+      { 0xbf, 0x01, 0x02, 0xff },
+      { 0x9f, 0x01 },
+      { 0x19, 0x01 },
+      { 0x62, 'a' },
+      { 0x01, 0x02 },
+      { 0xfc }
+    };
+    for (auto const& bytes : invalid)
+    {
+      JsonPtr json = makeJson(JsonWrapper::fromCbor(bytes.data(), bytes.size()));
+      expect(!json, "invalid cbor refused");
+    }
+  }
+
+  void
+  checkInbox(Harness& h)
+  {
+    section = "inbox";
+
+    std::weak_ptr<GattClient> client;
+    Central c(connect(h, client));
+    if (!expect(c.discover(), "discovery") || !expect(c.writeConfig(c.Outbox, 0x0001), "subscribe"))
+      return;
+
+    JsonPtr res = c.call(request("rpc-get-session", "1"), 1);
+    expect(responseId(res) == 1 && !resultString(res, "token").empty(), "request written a byte at a time");
+
+    // two records sharing writes
+    std::string record;
+    c.writeInbox(c.frame(request("rpc-get-session", "2")) + c.frame(request("rpc-get-session", "3")), 20);
+    expect(c.nextRecord(record) && responseId(parseRecord(record)) == 2, "first of two records");
+    expect(c.nextRecord(record) && responseId(parseRecord(record)) == 3, "second of two records");
+
+    c.writeInbox(c.frame(request("rpc-get-session", "4")), 20, true);
+    expect(c.nextRecord(record) && responseId(parseRecord(record)) == 4, "record written with write requests");
+
+    // the too big record is refused once max-request-size is buffered, the
+    // rest of it is dropped up to its delimiter
+    c.writeInbox(std::string(kMaxRequestSize + 100, 'a') + kRecordDelimiter
+      + c.frame(request("rpc-get-session", "5")), 20);
+    res.reset();
+    if (c.nextRecord(record))
+      res = parseRecord(record);
+    expect(responseId(res) == -1 && errorCode(res) == E2BIG, "oversized record refused");
+    expect(c.nextRecord(record) && responseId(parseRecord(record)) == 5, "record after an oversized one");
+
+    res = c.call(request("rpc-get-session", "6", "{\"ssid\":\"\xc0\xaf\"}"));
+    expect(responseId(res) == -1 && errorCode(res) == EILSEQ, "request that isn't utf-8 refused");
+
+    // there's nothing to write into the middle of, a prepared write at an
+    // offset is refused when it's executed, or as soon as it's prepared
+    std::vector<uint8_t> pdu{ BT_ATT_OP_PREP_WRITE_REQ };
+    putLe16(pdu, c.Inbox);
+    putLe16(pdu, 4);
+    pdu.push_back('x');
+    std::vector<uint8_t> rsp;
+    bool answered = c.request(pdu, rsp);
+    if (answered && rsp[0] == BT_ATT_OP_PREP_WRITE_RSP)
+    {
+      pdu = { BT_ATT_OP_EXEC_WRITE_REQ, 0x01 };
+      answered = c.request(pdu, rsp);
+    }
+    expect(answered && rsp[0] == BT_ATT_OP_ERROR_RSP && rsp.size() == 5 && rsp[4] == BT_ATT_ERROR_INVALID_OFFSET,
+      "write at an offset refused");
+
+    res = c.call(request("rpc-get-session", "7"));
+    expect(responseId(res) == 7, "stream intact after refused requests");
+  }
+
+  void
+  checkOutboxRead(Harness& h)
+  {
+    section = "outbox read";
+
+    std::weak_ptr<GattClient> client;
+    Central c(connect(h, client));
+    if (!expect(c.discover(), "discovery") || !expect(c.writeConfig(c.EPoll, 0x0001), "subscribe to epoll"))
+      return;
+
+    c.sendRecord(request("rpc-get-session", "10"));
+
+    // the epoll notification carries the bytes waiting, big endian
+    std::vector<uint8_t> pdu;
+    uint32_t available = 0;
+    if (expect(c.nextPush(pdu, kTimeoutMs) && pdu[0] == BT_ATT_OP_HANDLE_VAL_NOT && pdu.size() == 7
+      && getLe16(&pdu[1]) == c.EPoll, "epoll notification"))
+      available = (pdu[3] << 24) | (pdu[4] << 16) | (pdu[5] << 8) | pdu[6];
+    expect(available > kMtu, "response longer than a slice");
+
+    std::string value;
+    uint8_t ecode = 0;
+    expect(c.read(c.Outbox, available + 1, value, ecode) && ecode == BT_ATT_ERROR_INVALID_OFFSET,
+      "read blob past the record refused");
+
+    expect(c.read(c.Outbox, 0, value, ecode) && ecode == 0 && value.size() == kMtu - 1, "read a full slice");
+    std::string bytes(value);
+    while (value.size() == kMtu - 1)
+    {
+      if (!expect(c.read(c.Outbox, bytes.size(), value, ecode) && ecode == 0, "read blob at the next offset"))
+        return;
+      bytes += value;
+    }
+
+    expect(bytes.size() == available, "record as long as announced");
+    expect(!bytes.empty() && bytes.back() == kRecordDelimiter, "record ends in its delimiter");
+    if (!bytes.empty())
+      bytes.pop_back();
+    expect(responseId(parseRecord(bytes)) == 10, "response read in slices");
+
+    expect(c.read(c.Outbox, 0, value, ecode) && ecode == 0 && value.empty(), "outbox empty once read");
+
+    // the error echoes the method, so the response is longer than the 512
+    // bytes a long read can get to
+    std::string method("rpc-" + std::string(700, 'x'));
+    c.sendRecord(request(method.c_str(), "11"));
+    std::string first;
+    std::string second;
+    expect(c.readValue(first) && first.size() == BT_ATT_MAX_VALUE_LEN, "first 512 bytes of a long response");
+    expect(c.read(c.Outbox, first.size() + 1, value, ecode) && ecode == BT_ATT_ERROR_INVALID_OFFSET,
+      "read blob past the value refused");
+    expect(c.readValue(second) && !second.empty() && second.size() < BT_ATT_MAX_VALUE_LEN, "the rest of it");
+
+    bytes = first + second;
+    expect(!bytes.empty() && bytes.back() == kRecordDelimiter, "long record ends in its delimiter");
+    if (!bytes.empty())
+      bytes.pop_back();
+    expect(responseId(parseRecord(bytes)) == 11, "long response read in two values");
+  }
+
+  void
+  checkOutboxPush(Harness& h)
+  {
+    section = "outbox push";
+
+    std::weak_ptr<GattClient> client;
+    Central c(connect(h, client));
+    if (!expect(c.discover(), "discovery") || !expect(c.writeConfig(c.Outbox, 0x0002), "subscribe to indications"))
+      return;
+
+    // one indication is outstanding until the client confirms it
+    c.sendRecord(request("rpc-get-session", "20"));
+    std::vector<uint8_t> pdu;
+    expect(c.nextPush(pdu, kTimeoutMs) && pdu[0] == BT_ATT_OP_HANDLE_VAL_IND && getLe16(&pdu[1]) == c.Outbox,
+      "indication");
+    std::vector<uint8_t> next;
+    expect(!c.nextPush(next, 200), "nothing more before the confirmation");
+
+    std::string record;
+    JsonPtr res;
+    if (pdu.size() > 3)
+    {
+      c.take(pdu);
+      if (c.confirm() && c.nextRecord(record))
+        res = parseRecord(record);
+    }
+    expect(responseId(res) == 20 && c.Notifications == 0 && c.Indications > 1, "response indicated");
+
+    expect(c.writeConfig(c.Outbox, 0x0001), "subscribe to notifications");
+    c.Indications = 0;
+    c.Notifications = 0;
+    res = c.call(request("rpc-get-session", "21"));
+    expect(responseId(res) == 21 && c.Notifications > 1 && c.Indications == 0, "response notified");
+
+    // off again, the epoll characteristic says when there's something to
+    // read
+    expect(c.writeConfig(c.Outbox, 0x0000) && c.writeConfig(c.EPoll, 0x0001), "back to reads");
+    c.sendRecord(request("rpc-get-session", "22"));
+    expect(c.nextPush(pdu, kTimeoutMs) && getLe16(&pdu[1]) == c.EPoll, "epoll notification, not the outbox");
+    std::string pulled;
+    expect(c.readRecord(pulled) && responseId(parseRecord(pulled)) == 22, "response read");
+  }
+
+  void
+  checkCborSession(Harness& h)
+  {
+    section = "cbor session";
+
+    std::weak_ptr<GattClient> client;
+    Central c(connect(h, client));
+    if (!expect(c.discover(), "discovery") || !expect(c.writeConfig(c.Outbox, 0x0001), "subscribe"))
+      return;
+
+    std::string record;
+    expect(c.exchange(request("rpc-set-encoding", "30", "{\"encoding\":\"cbor\"}"), record)
+      && !record.empty() && record[0] == '{' && resultString(parseRecord(record), "encoding") == "cbor",
+      "reply to rpc-set-encoding in json");
+
+    // escaped the same way the server escapes its records
+    JsonPtr req = makeJson(cJSON_Parse(request("rpc-get-session", "31").c_str()));
+    std::vector<uint8_t> cbor;
+    JsonWrapper::toCbor(req.get(), cbor);
+    std::vector<char> escaped;
+    escapeRecord(kCborRecordMarker, cbor.data(), cbor.size(), escaped);
+    expect(c.exchange(std::string(escaped.begin(), escaped.end()), record) && !record.empty()
+      && record[0] == kCborRecordMarker, "response in cbor");
+    JsonPtr res = parseRecord(record);
+    expect(responseId(res) == 31 && !resultString(res, "token").empty(), "cbor response decoded");
+
+    // what can't be decoded can't be answered in cbor either
+    std::string bad(1, kCborRecordMarker);
+    bad += '\x1f';
+    expect(c.exchange(bad, record) && !record.empty() && record[0] == '{'
+      && errorCode(parseRecord(record)) == EINVAL, "invalid cbor refused in json");
+
+    res = c.call(request("rpc-set-encoding", "32", "{\"encoding\":\"json\"}"));
+    expect(responseId(res) == 32, "reply to rpc-set-encoding in cbor");
+    expect(c.exchange(request("rpc-get-session", "33"), record) && !record.empty() && record[0] == '{'
+      && responseId(parseRecord(record)) == 33, "back to json");
+  }
+
+  void
+  checkFraming(Harness& h)
+  {
+    section = "framing";
+
+    std::weak_ptr<GattClient> client;
+    Central c(connect(h, client));
+    if (!expect(c.discover(), "discovery") || !expect(c.writeConfig(c.Outbox, 0x0001), "subscribe"))
+      return;
+
+    // the reply is the last delimited record in either direction
+    JsonPtr res = c.call(request("rpc-set-framing", "40", "{\"framing\":\"length-prefixed\"}"));
+    if (!expect(responseId(res) == 40 && resultString(res, "framing") == "length-prefixed",
+      "switch to length prefixed"))
+      return;
+    c.setLengthPrefixed(true);
+
+    // a two byte header cut across writes
+    res = c.call(request("rpc-get-session", "41", "{\"pad\":\"" + std::string(200, 'p') + "\"}"), 3);
+    expect(responseId(res) == 41, "length prefixed request and response");
+
+    // a header claiming more than max-request-size is refused as soon as
+    // it's seen, and its body skipped. delimiters in it are just bytes now
+    char header[kMaxVarintSize];
+    std::string big(header, putVarint(kMaxRequestSize * 2, header));
+    big += std::string(kMaxRequestSize, 'b') + std::string(kMaxRequestSize, kRecordDelimiter);
+    c.writeInbox(big + c.frame(request("rpc-get-session", "42")), 20);
+    std::string record;
+    res.reset();
+    if (c.nextRecord(record))
+      res = parseRecord(record);
+    expect(responseId(res) == -1 && errorCode(res) == E2BIG, "oversized record refused");
+    expect(c.nextRecord(record) && responseId(parseRecord(record)) == 42, "record after an oversized one");
+
+    res = c.call(request("rpc-set-framing", "43", "{\"framing\":\"delimited\"}"));
+    expect(responseId(res) == 43 && resultString(res, "framing") == "delimited", "switch back to delimited");
+    c.setLengthPrefixed(false);
+
+    res = c.call(request("rpc-get-session", "44"));
+    expect(responseId(res) == 44, "delimited again");
+  }
+
+  void
+  checkSessionResume(Harness& h)
+  {
+    section = "session resume";
+
+    std::weak_ptr<GattClient> first;
+    Central a(connect(h, first));
+    if (!expect(a.discover(), "discovery") || !expect(a.writeConfig(a.EPoll, 0x0001), "subscribe to epoll"))
+      return;
+
+    // responses are pulled, so they've all been handed to the transport by
+    // the time they're read
+    std::string record;
+    JsonPtr res;
+    a.sendRecord(request("rpc-get-session", "50"));
+    if (a.readRecord(record))
+      res = parseRecord(record);
+    std::string token = resultString(res, "token");
+    if (!expect(responseId(res) == 50 && !token.empty(), "session token"))
+      return;
+
+    // a string id and a number id that print the same
+    a.sendRecord(request("rpc-get-session", "\"7\""));
+    a.sendRecord(request("rpc-list-services", "7"));
+    expect(a.readRecord(record) && a.readRecord(record), "responses handed out");
+
+    a.disconnect();
+    expect(waitForRelease(first), "connection released");
+
+    // kept while the session is detached
+    JsonPtr event = makeJson(cJSON_Parse("{\"jsonrpc\":\"2.0\",\"method\":\"attcheck-event\",\"params\":{}}"));
+    h.Rpc->enqueueAsyncMessage(event.get());
+
+    std::weak_ptr<GattClient> second;
+    Central b(connect(h, second));
+    if (!expect(b.discover(), "discovery") || !expect(b.writeConfig(b.Outbox, 0x0001), "subscribe"))
+      return;
+
+    res = b.call(request("rpc-resume-session", "51", "{\"token\":\"" + token + "\",\"pending\":[\"7\"]}"));
+    cJSON const* result = res ? cJSON_GetObjectItem(res.get(), "result") : nullptr;
+    expect(responseId(res) == 51 && JsonWrapper::getInt(result, "replay", false, -1) == 2,
+      "one response and one notification to replay");
+
+    res.reset();
+    if (b.nextRecord(record))
+      res = parseRecord(record);
+    expect(resultString(res, "token") == token, "response to the string id replayed");
+
+    res.reset();
+    if (b.nextRecord(record))
+      res = parseRecord(record);
+    char const* method = res ? JsonWrapper::getString(res.get(), "method", false, "") : "";
+    expect(strcmp(method, "attcheck-event") == 0, "notification replayed");
+
+    std::vector<uint8_t> pdu;
+    expect(!b.nextPush(pdu, 200), "nothing else replayed");
+
+    res = b.call(request("rpc-get-session", "52"));
+    expect(resultString(res, "token") == token, "connection took over the session");
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  Logger::logger().setLevel(LogLevel::Error);
+
+  while (true)
+  {
+    static struct option longOptions[] =
+    {
+      { "debug",    no_argument, 0, 'd' },
+      { "help",     no_argument, 0, 'h' },
+      { 0, 0, 0, 0 }
+    };
+
+    int optionIndex = 0;
+    int c = getopt_long(argc, argv, "dh", longOptions, &optionIndex);
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+      case 'd':
+        Logger::logger().setLevel(LogLevel::Debug);
+        break;
+      case 'h':
+        printHelp();
+        break;
+      default:
+        break;
+    }
+  }
+
+  checkUtf8();
+  checkVarint();
+  checkCbor();
+
+  cJSON* conf = cJSON_CreateObject();
+  cJSON* listener = cJSON_AddObjectToObject(conf, "listener");
+  cJSON_AddNumberToObject(listener, "max-request-size", kMaxRequestSize);
+  cJSON_AddNumberToObject(listener, "session-grace-ms", 10000);
+  cJSON* link = cJSON_AddObjectToObject(listener, "connection-parameters");
+  cJSON_AddNumberToObject(link, "idle-ms", 0);
+
+  DeviceInfoProvider deviceInfo;
+  deviceInfo.GetSystemId = [] { return std::string("attcheck"); };
+  deviceInfo.GetModelNumber = deviceInfo.GetSystemId;
+  deviceInfo.GetSerialNumber = deviceInfo.GetSystemId;
+  deviceInfo.GetFirmwareRevision = deviceInfo.GetSystemId;
+  deviceInfo.GetHardwareRevision = deviceInfo.GetSystemId;
+  deviceInfo.GetSoftwareRevision = deviceInfo.GetSystemId;
+  deviceInfo.GetManufacturerName = deviceInfo.GetSystemId;
+
+  RdkDiagProvider rdkDiag;
+  rdkDiag.rdkDiagUuid = 0xfdb9;
+  rdkDiag.GetDeviceStatus = [] { return std::string("READY"); };
+  rdkDiag.GetFirmwareDownloadStatus = rdkDiag.GetDeviceStatus;
+  rdkDiag.GetWebPAStatus = rdkDiag.GetDeviceStatus;
+  rdkDiag.GetWiFiRadio1Status = rdkDiag.GetDeviceStatus;
+  rdkDiag.GetWiFiRadio2Status = rdkDiag.GetDeviceStatus;
+  rdkDiag.GetRFStatus = rdkDiag.GetDeviceStatus;
+
+  mainloop_init();
+
+  Harness h;
+  h.Attached = false;
+  if (pipe2(h.Pipe, O_CLOEXEC) < 0)
+  {
+    fprintf(stderr, "attcheck: pipe failed. %s\n", strerror(errno));
+    return 1;
+  }
+
+  h.Rpc.reset(new RpcServer("", conf));
+  h.Gatt.reset(new GattServer());
+  h.Gatt->initLoopback(listener, deviceInfo, rdkDiag);
+  cJSON_Delete(conf);
+
+  mainloop_add_fd(h.Pipe[0], EPOLLIN, &Harness_onConnect, &h, nullptr);
+  h.Thread = std::thread([] { mainloop_run(); });
+
+  checkInbox(h);
+  checkOutboxRead(h);
+  checkOutboxPush(h);
+  checkCborSession(h);
+  checkFraming(h);
+  checkSessionResume(h);
+
+  int quit = -1;
+  if (write(h.Pipe[1], &quit, sizeof(quit)) != sizeof(quit))
+    fprintf(stderr, "attcheck: failed to stop the mainloop. %s\n", strerror(errno));
+  h.Thread.join();
+
+  // the clients go with the gatt server, before the rpc server they call
+  h.Gatt.reset();
+  h.Rpc.reset();
+  close(h.Pipe[0]);
+  close(h.Pipe[1]);
+
+  printf("attcheck: %d checks, %d failed\n", checks, failures);
+  return failures ? 1 : 0;
+}
@@ -16,9 +16,13 @@
 #include <stdio.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
 #include <vector>
 #include <getopt.h>
 #include <sys/param.h>
@@ -39,6 +43,102 @@
 using std::string;
 using std::vector;
 
+namespace
+{
+  // HCI_ERROR_COMMAND_DISALLOWED, returned when advertising is already
+  // enabled or the controller has no room for another connection
+  uint8_t const kHciCommandDisallowed = 0x0C;
+
+  // newer than some of the BlueZ headers we build against
+  uint16_t const kOcfLeSetDataLength = 0x0022;
+  uint16_t const kOcfLeReadMaxDataLength = 0x002F;
+  uint16_t const kOcfLeSetPhy = 0x0032;
+  uint8_t const kEvtLeDataLengthChange = 0x07;
+  uint8_t const kEvtLePhyUpdateComplete = 0x0C;
+
+  // bits of the LE supported features mask
+  int const kLeFeatureDataLengthExtension = 5;
+  int const kLeFeature2MPhy = 8;
+
+  struct LeSetDataLengthCp
+  {
+    uint16_t  handle;
+    uint16_t  tx_octets;
+    uint16_t  tx_time;
+  } __attribute__ ((packed));
+
+  struct LeSetDataLengthRp
+  {
+    uint8_t   status;
+    uint16_t  handle;
+  } __attribute__ ((packed));
+
+  struct LeReadMaxDataLengthRp
+  {
+    uint8_t   status;
+    uint16_t  max_tx_octets;
+    uint16_t  max_tx_time;
+    uint16_t  max_rx_octets;
+    uint16_t  max_rx_time;
+  } __attribute__ ((packed));
+
+  struct LeSetPhyCp
+  {
+    uint16_t  handle;
+    uint8_t   all_phys;
+    uint8_t   tx_phys;
+    uint8_t   rx_phys;
+    uint16_t  phy_options;
+  } __attribute__ ((packed));
+
+  struct EvtLeDataLengthChange
+  {
+    uint16_t  handle;
+    uint16_t  max_tx_octets;
+    uint16_t  max_tx_time;
+    uint16_t  max_rx_octets;
+    uint16_t  max_rx_time;
+  } __attribute__ ((packed));
+
+  struct EvtLePhyUpdateComplete
+  {
+    uint8_t   status;
+    uint16_t  handle;
+    uint8_t   tx_phy;
+    uint8_t   rx_phy;
+  } __attribute__ ((packed));
+
+  bool
+  isLinkCommand(uint16_t opcode)
+  {
+    return opcode == cmd_opcode_pack(OGF_LE_CTL, OCF_LE_CONN_UPDATE)
+      || opcode == cmd_opcode_pack(OGF_LE_CTL, kOcfLeSetDataLength)
+      || opcode == cmd_opcode_pack(OGF_LE_CTL, kOcfLeSetPhy);
+  }
+
+  // advertising is re-enabled after every connect and disconnect, keep the
+  // HCI device open for the life of the process instead of reopening it
+  std::mutex          s_advertiser_lock;
+  std::map<int, int>  s_advertisers;
+
+  int
+  getAdvertiser(int hdev)
+  {
+    auto itr = s_advertisers.find(hdev);
+    if (itr != s_advertisers.end())
+      return itr->second;
+
+    int dd = hci_open_dev(hdev);
+    if (dd < 0)
+    {
+      XLOG_ERROR("Could not open device hci%d: %s (%d)", hdev, strerror(errno), errno);
+      return -1;
+    }
+
+    s_advertisers.insert(std::make_pair(hdev, dd));
+    return dd;
+  }
+}
 
 
 /**
@@ -385,15 +485,43 @@ parseArgs(string str)
   return args;
 }
 
+/**
+ * the controllers to serve, hci-device-ids or else the single
+ * hci-device-id
+ * @param listenerConfig listener/beacon configuration
+ */
+std::vector<int>
+listenerDeviceIds(cJSON const* listenerConfig)
+{
+  std::vector<int> ids;
+
+  cJSON const* list = listenerConfig ? cJSON_GetObjectItem(listenerConfig, "hci-device-ids") : nullptr;
+  for (int i = 0, n = cJSON_GetArraySize(list); i < n; ++i)
+  {
+    cJSON const* id = cJSON_GetArrayItem(list, i);
+    if (!cJSON_IsNumber(id) || id->valueint < 0)
+    {
+      XLOG_WARN("ignoring invalid entry in hci-device-ids");
+      continue;
+    }
+    if (std::find(ids.begin(), ids.end(), id->valueint) == ids.end())
+      ids.push_back(id->valueint);
+  }
+
+  if (ids.empty())
+    ids.push_back(JsonWrapper::getInt(listenerConfig, "hci-device-id", false, 0));
+  return ids;
+}
+
 /**
  * start up beacon
  * @param listenerConfig listener/beacon configuration
+ * @param deviceId HCI device to advertise on
  */
 void
-startBeacon(cJSON const* listenerConfig)
+startBeacon(cJSON const* listenerConfig, int deviceId)
 {
   char const* name = JsonWrapper::getString(listenerConfig, "ble-device-name", false, "XPI-SETUP");
-  int deviceId = JsonWrapper::getInt(listenerConfig, "hci-device-id", false, 0);
   int companyId = JsonWrapper::getInt(listenerConfig, "/beacon-config/company-id", false, 0xFFFF);
   int deviceInfoUUID = JsonWrapper::getInt(listenerConfig, "/beacon-config/device-info-uuid", false, 0x1000);
   int rdkDiagUUID = JsonWrapper::getInt(listenerConfig, "/beacon-config/rdk-diag-uuid", false, 0x2000);
@@ -437,17 +565,22 @@ startBeacon(cJSON const* listenerConfig)
 
   cmdDown(ctl, deviceInfo.dev_id);
   cmdUp(ctl, deviceInfo.dev_id);
+  close(ctl);
   cmdNoleadv(deviceInfo.dev_id);
 
-  // TODO: hardcoded for now to
-  // [antman]: sudo hciconfig hci0 class 3a0430
-  // [antman]: sudo hciconfig hci0 class
-  // hci0:   Type: Primary  Bus: UART
+  // same as: sudo hciconfig hciN class 3a0430
+  // hciN:   Type: Primary  Bus: UART
   //    BD Address: B8:27:EB:A0:DA:2C  ACL MTU: 1021:8  SCO MTU: 64:1
   //    Class: 0x3a0430
   //    Service Classes: Networking, Capturing, Object Transfer, Audio
   //    Device Class: Audio/Video, Video Camera
-  system("hciconfig hci0 class 3a0430");
+  {
+    int dd = hci_open_dev(deviceInfo.dev_id);
+    if (dd < 0 || hci_write_class_of_dev(dd, 0x3a0430, 2000) < 0)
+      XLOG_WARN("Can't write class of device on hci%d: %s (%d)", deviceInfo.dev_id, strerror(errno), errno);
+    if (dd >= 0)
+      hci_close_dev(dd);
+  }
 
   char buff[128];
 #if EDDYSTONE_BEACON
@@ -476,7 +609,7 @@ startBeacon(cJSON const* listenerConfig)
  
   hcitoolCmd(deviceInfo.dev_id, parseArgs(buff));
 
-  system("hcitool cmd 0x08 0x0006 A0 00 A0 00 00 00 00 00 00 00 00 00 00 07 00");
+  hcitoolCmd(deviceInfo.dev_id, parseArgs("0x08 0x0006 A0 00 A0 00 00 00 00 00 00 00 00 00 00 07 00"));
 
   #if 0
   std::string startUpCmd02(appSettings_get_ble_value("ble_init_cmd02"));
@@ -486,3 +619,338 @@ startBeacon(cJSON const* listenerConfig)
   cmdLeadv(deviceInfo.dev_id);
   cmdName(deviceInfo.dev_id, name);
 }
+
+/**
+ * turn advertising back on, the controller stops advertising once a
+ * central connects. only the enable command is sent, the parameters and
+ * advertising data set up by startBeacon are kept by the controller
+ * @param deviceId HCI device to advertise on
+ */
+void
+enableAdvertising(int deviceId)
+{
+  std::lock_guard<std::mutex> guard(s_advertiser_lock);
+
+  int dd = getAdvertiser(deviceId);
+  if (dd < 0)
+    return;
+
+  le_set_advertise_enable_cp advertise_cp;
+  memset(&advertise_cp, 0, sizeof(advertise_cp));
+  advertise_cp.enable = 0x01;
+
+  uint8_t status = 0;
+
+  hci_request req;
+  memset(&req, 0, sizeof(req));
+  req.ogf = OGF_LE_CTL;
+  req.ocf = OCF_LE_SET_ADVERTISE_ENABLE;
+  req.cparam = &advertise_cp;
+  req.clen = LE_SET_ADVERTISE_ENABLE_CP_SIZE;
+  req.rparam = &status;
+  req.rlen = 1;
+
+  if (hci_send_req(dd, &req, 1000) < 0)
+  {
+    XLOG_WARN("Can't enable advertising on hci%d: %s (%d)", deviceId, strerror(errno), errno);
+
+    // the cached handle may have gone bad, e.g. the device was reset
+    hci_close_dev(dd);
+    s_advertisers.erase(deviceId);
+    return;
+  }
+
+  if (status == kHciCommandDisallowed)
+    XLOG_DEBUG("advertising on hci%d already enabled or not allowed right now", deviceId);
+  else if (status)
+    XLOG_WARN("Enabling LE advertise on hci%d returned error status:%d", deviceId, status);
+}
+
+/**
+ * open a non-blocking HCI socket that receives the events for commands
+ * sent on LE links
+ * @param deviceId HCI device the links are on
+ */
+int
+openLinkEvents(int deviceId)
+{
+  int dd = hci_open_dev(deviceId);
+  if (dd < 0)
+  {
+    XLOG_ERROR("Could not open device hci%d: %s (%d)", deviceId, strerror(errno), errno);
+    return -1;
+  }
+
+  hci_filter flt;
+  hci_filter_clear(&flt);
+  hci_filter_set_ptype(HCI_EVENT_PKT, &flt);
+  hci_filter_set_event(EVT_CMD_STATUS, &flt);
+  hci_filter_set_event(EVT_CMD_COMPLETE, &flt);
+  hci_filter_set_event(EVT_LE_META_EVENT, &flt);
+  if (setsockopt(dd, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0)
+  {
+    XLOG_ERROR("HCI filter setup failed on hci%d: %s (%d)", deviceId, strerror(errno), errno);
+    hci_close_dev(dd);
+    return -1;
+  }
+
+  int flags = fcntl(dd, F_GETFL);
+  if (flags < 0 || fcntl(dd, F_SETFL, flags | O_NONBLOCK) < 0)
+  {
+    XLOG_ERROR("Can't make hci%d socket non-blocking: %s (%d)", deviceId, strerror(errno), errno);
+    hci_close_dev(dd);
+    return -1;
+  }
+
+  return dd;
+}
+
+/**
+ * ask for new parameters on an LE connection, the result comes back as a
+ * LinkEvent
+ * @param dd socket from openLinkEvents()
+ * @param handle HCI connection handle
+ * @param params what to ask for
+ */
+bool
+requestConnectionUpdate(int dd, uint16_t handle, ConnectionParameters const& params)
+{
+  le_connection_update_cp cp;
+  memset(&cp, 0, sizeof(cp));
+  cp.handle = htobs(handle);
+  cp.min_interval = htobs(params.MinInterval);
+  cp.max_interval = htobs(params.MaxInterval);
+  cp.latency = htobs(params.Latency);
+  cp.supervision_timeout = htobs(params.SupervisionTimeout);
+
+  // not hci_le_conn_update(), that waits for the central to agree
+  if (hci_send_cmd(dd, OGF_LE_CTL, OCF_LE_CONN_UPDATE, LE_CONN_UPDATE_CP_SIZE, &cp) < 0)
+  {
+    XLOG_WARN("Can't send LE connection update for handle %u: %s (%d)", handle, strerror(errno), errno);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * ask the controller which LE features it has and the largest data length
+ * it can send
+ * @param deviceId HCI device to ask
+ * @param caps filled in with what was read
+ */
+bool
+readLinkCapabilities(int deviceId, LinkCapabilities& caps)
+{
+  memset(&caps, 0, sizeof(caps));
+
+  int dd = hci_open_dev(deviceId);
+  if (dd < 0)
+  {
+    XLOG_ERROR("Could not open device hci%d: %s (%d)", deviceId, strerror(errno), errno);
+    return false;
+  }
+
+  le_read_local_supported_features_rp features;
+  memset(&features, 0, sizeof(features));
+
+  hci_request rq;
+  memset(&rq, 0, sizeof(rq));
+  rq.ogf = OGF_LE_CTL;
+  rq.ocf = OCF_LE_READ_LOCAL_SUPPORTED_FEATURES;
+  rq.rparam = &features;
+  rq.rlen = LE_READ_LOCAL_SUPPORTED_FEATURES_RP_SIZE;
+
+  if (hci_send_req(dd, &rq, 1000) < 0 || features.status)
+  {
+    XLOG_WARN("Can't read LE features of hci%d: %s (%d) status:%d", deviceId, strerror(errno), errno,
+      features.status);
+    hci_close_dev(dd);
+    return false;
+  }
+
+  caps.DataLengthExtension = features.features[kLeFeatureDataLengthExtension / 8]
+    & (1 << (kLeFeatureDataLengthExtension % 8));
+  caps.Phy2M = features.features[kLeFeature2MPhy / 8] & (1 << (kLeFeature2MPhy % 8));
+
+  if (caps.DataLengthExtension)
+  {
+    LeReadMaxDataLengthRp maxLength;
+    memset(&maxLength, 0, sizeof(maxLength));
+
+    memset(&rq, 0, sizeof(rq));
+    rq.ogf = OGF_LE_CTL;
+    rq.ocf = kOcfLeReadMaxDataLength;
+    rq.rparam = &maxLength;
+    rq.rlen = sizeof(maxLength);
+
+    if (hci_send_req(dd, &rq, 1000) < 0 || maxLength.status)
+    {
+      XLOG_WARN("Can't read LE maximum data length of hci%d: %s (%d) status:%d", deviceId,
+        strerror(errno), errno, maxLength.status);
+      caps.DataLengthExtension = false;
+    }
+    else
+    {
+      caps.MaxTxOctets = btohs(maxLength.max_tx_octets);
+      caps.MaxTxTime = btohs(maxLength.max_tx_time);
+    }
+  }
+
+  hci_close_dev(dd);
+  return true;
+}
+
+/**
+ * ask for longer link layer packets on an LE connection
+ * @param dd socket from openLinkEvents()
+ * @param handle HCI connection handle
+ * @param txOctets payload octets per packet
+ * @param txTime microseconds per packet
+ */
+bool
+requestDataLength(int dd, uint16_t handle, uint16_t txOctets, uint16_t txTime)
+{
+  LeSetDataLengthCp cp;
+  memset(&cp, 0, sizeof(cp));
+  cp.handle = htobs(handle);
+  cp.tx_octets = htobs(txOctets);
+  cp.tx_time = htobs(txTime);
+
+  if (hci_send_cmd(dd, OGF_LE_CTL, kOcfLeSetDataLength, sizeof(cp), &cp) < 0)
+  {
+    XLOG_WARN("Can't send LE set data length for handle %u: %s (%d)", handle, strerror(errno), errno);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * ask for the LE 2M PHY in both directions on an LE connection
+ * @param dd socket from openLinkEvents()
+ * @param handle HCI connection handle
+ */
+bool
+requestPhy2M(int dd, uint16_t handle)
+{
+  LeSetPhyCp cp;
+  memset(&cp, 0, sizeof(cp));
+  cp.handle = htobs(handle);
+  cp.all_phys = 0x00;
+  cp.tx_phys = 0x02;
+  cp.rx_phys = 0x02;
+
+  if (hci_send_cmd(dd, OGF_LE_CTL, kOcfLeSetPhy, sizeof(cp), &cp) < 0)
+  {
+    XLOG_WARN("Can't send LE set PHY for handle %u: %s (%d)", handle, strerror(errno), errno);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * the name of a command a CommandStatus LinkEvent is about
+ * @param opcode LinkEvent::Opcode
+ */
+char const*
+linkCommandName(uint16_t opcode)
+{
+  if (opcode == cmd_opcode_pack(OGF_LE_CTL, OCF_LE_CONN_UPDATE))
+    return "connection update";
+  if (opcode == cmd_opcode_pack(OGF_LE_CTL, kOcfLeSetDataLength))
+    return "set data length";
+  if (opcode == cmd_opcode_pack(OGF_LE_CTL, kOcfLeSetPhy))
+    return "set PHY";
+  return "unknown command";
+}
+
+/**
+ * read one event from a socket opened with openLinkEvents()
+ * @param dd socket from openLinkEvents()
+ * @param event filled in with what was read
+ */
+bool
+readLinkEvent(int dd, LinkEvent& event)
+{
+  unsigned char buf[HCI_MAX_EVENT_SIZE + 1];
+
+  ssize_t n = read(dd, buf, sizeof(buf));
+  if (n < 0)
+  {
+    if (errno == EINTR)
+      return readLinkEvent(dd, event);
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      XLOG_WARN("Can't read HCI event: %s (%d)", strerror(errno), errno);
+    return false;
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.Kind = LinkEvent::Type::Other;
+
+  if (n < 1 + HCI_EVENT_HDR_SIZE)
+    return true;
+
+  hci_event_hdr const* hdr = reinterpret_cast<hci_event_hdr const *>(buf + 1);
+  unsigned char const* ptr = buf + 1 + HCI_EVENT_HDR_SIZE;
+  size_t len = static_cast<size_t>(n) - 1 - HCI_EVENT_HDR_SIZE;
+
+  if (hdr->evt == EVT_CMD_STATUS && len >= sizeof(evt_cmd_status))
+  {
+    evt_cmd_status const* cs = reinterpret_cast<evt_cmd_status const *>(ptr);
+    event.Opcode = btohs(cs->opcode);
+    if (isLinkCommand(event.Opcode))
+    {
+      event.Kind = LinkEvent::Type::CommandStatus;
+      event.Status = cs->status;
+    }
+  }
+  else if (hdr->evt == EVT_CMD_COMPLETE && len >= EVT_CMD_COMPLETE_SIZE + 1)
+  {
+    // only LE Set Data Length completes rather than reporting a status
+    evt_cmd_complete const* cc = reinterpret_cast<evt_cmd_complete const *>(ptr);
+    event.Opcode = btohs(cc->opcode);
+    if (event.Opcode == cmd_opcode_pack(OGF_LE_CTL, kOcfLeSetDataLength)
+      && len >= EVT_CMD_COMPLETE_SIZE + sizeof(LeSetDataLengthRp))
+    {
+      LeSetDataLengthRp const* rp = reinterpret_cast<LeSetDataLengthRp const *>(ptr + EVT_CMD_COMPLETE_SIZE);
+      event.Kind = LinkEvent::Type::CommandStatus;
+      event.Status = rp->status;
+      event.Handle = btohs(rp->handle);
+    }
+  }
+  else if (hdr->evt == EVT_LE_META_EVENT && len >= 1)
+  {
+    evt_le_meta_event const* meta = reinterpret_cast<evt_le_meta_event const *>(ptr);
+    if (meta->subevent == EVT_LE_CONN_UPDATE_COMPLETE && len >= 1 + sizeof(evt_le_connection_update_complete))
+    {
+      evt_le_connection_update_complete const* evt =
+        reinterpret_cast<evt_le_connection_update_complete const *>(meta->data);
+      event.Kind = LinkEvent::Type::ConnectionUpdate;
+      event.Status = evt->status;
+      event.Handle = btohs(evt->handle);
+      event.Interval = btohs(evt->interval);
+      event.Latency = btohs(evt->latency);
+      event.SupervisionTimeout = btohs(evt->supervision_timeout);
+    }
+    else if (meta->subevent == kEvtLeDataLengthChange && len >= 1 + sizeof(EvtLeDataLengthChange))
+    {
+      EvtLeDataLengthChange const* evt = reinterpret_cast<EvtLeDataLengthChange const *>(meta->data);
+      event.Kind = LinkEvent::Type::DataLengthChange;
+      event.Handle = btohs(evt->handle);
+      event.TxOctets = btohs(evt->max_tx_octets);
+      event.TxTime = btohs(evt->max_tx_time);
+      event.RxOctets = btohs(evt->max_rx_octets);
+      event.RxTime = btohs(evt->max_rx_time);
+    }
+    else if (meta->subevent == kEvtLePhyUpdateComplete && len >= 1 + sizeof(EvtLePhyUpdateComplete))
+    {
+      EvtLePhyUpdateComplete const* evt = reinterpret_cast<EvtLePhyUpdateComplete const *>(meta->data);
+      event.Kind = LinkEvent::Type::PhyUpdate;
+      event.Status = evt->status;
+      event.Handle = btohs(evt->handle);
+      event.TxPhy = evt->tx_phy;
+      event.RxPhy = evt->rx_phy;
+    }
+  }
+
+  return true;
+}
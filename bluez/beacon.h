@@ -17,12 +17,151 @@
 #define __BEACON_H__
 
 #include <string>
+#include <vector>
+#include <stdint.h>
 struct cJSON;
 
+/**
+ * LE connection parameters in HCI units, intervals are in 1.25 ms and the
+ * supervision timeout in 10 ms
+ */
+struct ConnectionParameters
+{
+  uint16_t MinInterval;
+  uint16_t MaxInterval;
+  uint16_t Latency;
+  uint16_t SupervisionTimeout;
+};
+
+/**
+ * what the controller can do to speed up an LE link, see
+ * readLinkCapabilities()
+ */
+struct LinkCapabilities
+{
+  bool      DataLengthExtension;
+  bool      Phy2M;
+  uint16_t  MaxTxOctets;
+  uint16_t  MaxTxTime;
+};
+
+/**
+ * an HCI event about an LE link, see readLinkEvent()
+ */
+struct LinkEvent
+{
+  enum class Type
+  {
+    // anything we didn't ask about
+    Other,
+
+    // the controller accepted or refused one of our commands. there's
+    // only a handle for LE Set Data Length
+    CommandStatus,
+
+    // LE Connection Update Complete
+    ConnectionUpdate,
+
+    // LE Data Length Change, only sent when something changed
+    DataLengthChange,
+
+    // LE PHY Update Complete
+    PhyUpdate
+  };
+
+  Type      Kind;
+  uint8_t   Status;
+  uint16_t  Handle;
+  uint16_t  Opcode;
+  uint16_t  Interval;
+  uint16_t  Latency;
+  uint16_t  SupervisionTimeout;
+  uint16_t  TxOctets;
+  uint16_t  TxTime;
+  uint16_t  RxOctets;
+  uint16_t  RxTime;
+  uint8_t   TxPhy;
+  uint8_t   RxPhy;
+};
+
+/**
+ * the controllers to serve, hci-device-ids or else the single
+ * hci-device-id
+ * @param listenerConfig listener/beacon configuration
+ */
+std::vector<int> listenerDeviceIds(cJSON const* listenerConfig);
+
 /**
  * start up beacon
  * @param listenerConfig listener/beacon configuration
+ * @param deviceId HCI device to advertise on
+ */
+void startBeacon(cJSON const* listenerConfig, int deviceId);
+
+/**
+ * turn advertising back on, the controller stops advertising once a
+ * central connects
+ * @param deviceId HCI device to advertise on
+ */
+void enableAdvertising(int deviceId);
+
+/**
+ * open a non-blocking HCI socket that receives the events for commands
+ * sent on LE links, see requestConnectionUpdate() and readLinkEvent()
+ * @param deviceId HCI device the links are on
+ * @return the socket or -1
+ */
+int openLinkEvents(int deviceId);
+
+/**
+ * ask for new parameters on an LE connection. as the peripheral the
+ * controller negotiates them with the central, the outcome is reported as
+ * a LinkEvent
+ * @param dd socket from openLinkEvents()
+ * @param handle HCI connection handle
+ * @param params what to ask for
+ */
+bool requestConnectionUpdate(int dd, uint16_t handle, ConnectionParameters const& params);
+
+/**
+ * ask the controller which LE features it has and the largest data length
+ * it can send
+ * @param deviceId HCI device to ask
+ * @param caps filled in with what was read
+ * @return false if the controller couldn't be asked
+ */
+bool readLinkCapabilities(int deviceId, LinkCapabilities& caps);
+
+/**
+ * ask for longer link layer packets on an LE connection. the outcome is
+ * reported as a LinkEvent
+ * @param dd socket from openLinkEvents()
+ * @param handle HCI connection handle
+ * @param txOctets payload octets per packet
+ * @param txTime microseconds per packet
+ */
+bool requestDataLength(int dd, uint16_t handle, uint16_t txOctets, uint16_t txTime);
+
+/**
+ * ask for the LE 2M PHY in both directions on an LE connection. the
+ * outcome is reported as a LinkEvent
+ * @param dd socket from openLinkEvents()
+ * @param handle HCI connection handle
+ */
+bool requestPhy2M(int dd, uint16_t handle);
+
+/**
+ * the name of a command a CommandStatus LinkEvent is about, for logging
+ * @param opcode LinkEvent::Opcode
+ */
+char const* linkCommandName(uint16_t opcode);
+
+/**
+ * read one event from a socket opened with openLinkEvents()
+ * @param dd socket from openLinkEvents()
+ * @param event filled in with what was read
+ * @return false once there's nothing left to read
  */
-void startBeacon(cJSON const* listenerConfig);
+bool readLinkEvent(int dd, LinkEvent& event);
 
 #endif
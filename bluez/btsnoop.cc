@@ -0,0 +1,242 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "btsnoop.h"
+#include "../logger.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace
+{
+  // HCI UART (H4), each packet starts with its type
+  uint32_t const kDatalinkH4 = 1002;
+  uint8_t const kH4AclData = 0x02;
+
+  // microseconds from midnight January 1st, 0 AD to the unix epoch
+  uint64_t const kEpochOffsetUs = 0x00dcddb30f2f8000ULL;
+
+  uint16_t const kAttCid = 0x0004;
+
+  // ACL packet boundary flag for the first, automatically flushable,
+  // fragment of an L2CAP frame
+  uint16_t const kAclStart = 0x2000;
+
+  // record header, H4 type, ACL header and L2CAP header
+  size_t const kRecordOverhead = 24 + 1 + 4 + 4;
+
+  std::chrono::milliseconds const kWriterInterval(100);
+
+  void
+  putBe32(uint8_t* p, uint32_t value)
+  {
+    p[0] = static_cast<uint8_t>(value >> 24);
+    p[1] = static_cast<uint8_t>(value >> 16);
+    p[2] = static_cast<uint8_t>(value >> 8);
+    p[3] = static_cast<uint8_t>(value);
+  }
+
+  void
+  putLe16(uint8_t* p, uint16_t value)
+  {
+    p[0] = static_cast<uint8_t>(value);
+    p[1] = static_cast<uint8_t>(value >> 8);
+  }
+
+  bool
+  writeAll(int fd, uint8_t const* buff, size_t n)
+  {
+    while (n > 0)
+    {
+      ssize_t ret = write(fd, buff, n);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        return false;
+      buff += ret;
+      n -= ret;
+    }
+    return true;
+  }
+}
+
+BtSnoopRecorder::BtSnoopRecorder()
+  : m_fd(-1)
+  , m_path()
+  , m_enabled(false)
+  , m_ring()
+  , m_head(0)
+  , m_tail(0)
+  , m_recorded(0)
+  , m_dropped(0)
+  , m_running(false)
+  , m_mutex()
+  , m_cond()
+  , m_writer()
+{
+}
+
+BtSnoopRecorder::~BtSnoopRecorder()
+{
+  close();
+}
+
+bool
+BtSnoopRecorder::open(std::string const& path, size_t ringSize)
+{
+  close();
+
+  m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (m_fd < 0)
+  {
+    XLOG_ERROR("failed to create capture file %s. %s", path.c_str(), strerror(errno));
+    m_fd = -1;
+    return false;
+  }
+
+  uint8_t header[16] = { 'b', 't', 's', 'n', 'o', 'o', 'p', '\0' };
+  putBe32(header + 8, 1);
+  putBe32(header + 12, kDatalinkH4);
+  if (!writeAll(m_fd, header, sizeof(header)))
+  {
+    XLOG_ERROR("failed to write capture file %s. %s", path.c_str(), strerror(errno));
+    ::close(m_fd);
+    m_fd = -1;
+    return false;
+  }
+
+  // big enough for at least one PDU at the largest MTU
+  m_path = path;
+  m_ring.assign(std::max(ringSize, static_cast<size_t>(4096)), 0);
+  m_head = 0;
+  m_tail = 0;
+  m_recorded = 0;
+  m_dropped = 0;
+  m_running = true;
+  m_writer = std::thread([this] { this->writeRecords(); });
+
+  XLOG_INFO("capturing ATT traffic to %s with a %zu byte ring", path.c_str(), m_ring.size());
+  return true;
+}
+
+void
+BtSnoopRecorder::close()
+{
+  if (m_writer.joinable())
+  {
+    m_running = false;
+    m_cond.notify_one();
+    m_writer.join();
+  }
+
+  if (m_fd != -1)
+  {
+    ::close(m_fd);
+    m_fd = -1;
+  }
+}
+
+void
+BtSnoopRecorder::put(uint64_t pos, uint8_t const* buff, size_t n)
+{
+  size_t offset = static_cast<size_t>(pos % m_ring.size());
+  size_t first = std::min(n, m_ring.size() - offset);
+  memcpy(m_ring.data() + offset, buff, first);
+  memcpy(m_ring.data(), buff + first, n - first);
+}
+
+void
+BtSnoopRecorder::record(uint16_t handle, bool received, uint8_t const* pdu, size_t n)
+{
+  if (!m_enabled || m_fd == -1 || n > 0xffff - 4)
+    return;
+
+  size_t size = kRecordOverhead + n;
+  uint64_t head = m_head.load(std::memory_order_relaxed);
+  uint64_t tail = m_tail.load(std::memory_order_acquire);
+  if (size > m_ring.size() - (head - tail))
+  {
+    m_dropped++;
+    return;
+  }
+
+  uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count() + kEpochOffsetUs;
+  uint32_t packetSize = static_cast<uint32_t>(size - 24);
+
+  uint8_t header[kRecordOverhead];
+  putBe32(header, packetSize);
+  putBe32(header + 4, packetSize);
+  putBe32(header + 8, received ? 1 : 0);
+  putBe32(header + 12, static_cast<uint32_t>(m_dropped.load()));
+  putBe32(header + 16, static_cast<uint32_t>(now >> 32));
+  putBe32(header + 20, static_cast<uint32_t>(now));
+  header[24] = kH4AclData;
+  putLe16(header + 25, (handle & 0x0fff) | kAclStart);
+  putLe16(header + 27, static_cast<uint16_t>(n + 4));
+  putLe16(header + 29, static_cast<uint16_t>(n));
+  putLe16(header + 31, kAttCid);
+
+  put(head, header, sizeof(header));
+  put(head + sizeof(header), pdu, n);
+  m_head.store(head + size, std::memory_order_release);
+  m_recorded++;
+
+  // the writer wakes up on its own every so often, it's only hurried
+  // along once the ring is half full
+  if ((head + size - tail) * 2 > m_ring.size())
+    m_cond.notify_one();
+}
+
+void
+BtSnoopRecorder::writeRecords()
+{
+  bool failed = false;
+  while (true)
+  {
+    bool running = true;
+    {
+      std::unique_lock<std::mutex> guard(m_mutex);
+      m_cond.wait_for(guard, kWriterInterval);
+      running = m_running;
+    }
+
+    uint64_t tail = m_tail.load(std::memory_order_relaxed);
+    uint64_t head = m_head.load(std::memory_order_acquire);
+    if (head != tail)
+    {
+      size_t offset = static_cast<size_t>(tail % m_ring.size());
+      size_t n = static_cast<size_t>(head - tail);
+      size_t first = std::min(n, m_ring.size() - offset);
+
+      // a full disk only costs the capture, the ring keeps draining
+      if (!failed && (!writeAll(m_fd, m_ring.data() + offset, first)
+        || !writeAll(m_fd, m_ring.data(), n - first)))
+      {
+        XLOG_ERROR("failed to write capture file %s, capture stopped. %s", m_path.c_str(), strerror(errno));
+        failed = true;
+      }
+      m_tail.store(head, std::memory_order_release);
+    }
+
+    if (!running)
+      break;
+  }
+}
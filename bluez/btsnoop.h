@@ -0,0 +1,81 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __BTSNOOP_H__
+#define __BTSNOOP_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+// writes ATT PDUs to a btsnoop file, the snoop format of RFC 1761 with the
+// HCI UART datalink, so a capture opens in wireshark. each PDU is wrapped
+// in the L2CAP and ACL headers it had on the air. record() only copies
+// into a preallocated ring, a thread of its own does the file I/O. when
+// the ring is full the PDU is dropped and counted rather than waited for
+//
+// there's a single producer, every connection records from the mainloop
+// thread
+class BtSnoopRecorder
+{
+public:
+  BtSnoopRecorder();
+  ~BtSnoopRecorder();
+
+  // creates the file and starts the writer, false if it can't be created
+  bool open(std::string const& path, size_t ringSize);
+  void close();
+
+  bool isOpen() const
+    { return m_fd != -1; }
+  std::string const& path() const
+    { return m_path; }
+
+  void setEnabled(bool enabled)
+    { m_enabled = enabled; }
+  bool enabled() const
+    { return m_enabled; }
+
+  void record(uint16_t handle, bool received, uint8_t const* pdu, size_t n);
+
+  uint64_t recorded() const
+    { return m_recorded; }
+  uint64_t dropped() const
+    { return m_dropped; }
+
+private:
+  void writeRecords();
+  void put(uint64_t pos, uint8_t const* buff, size_t n);
+
+private:
+  int                     m_fd;
+  std::string             m_path;
+  std::atomic<bool>       m_enabled;
+  std::vector<uint8_t>    m_ring;
+  std::atomic<uint64_t>   m_head;
+  std::atomic<uint64_t>   m_tail;
+  std::atomic<uint64_t>   m_recorded;
+  std::atomic<uint64_t>   m_dropped;
+  std::atomic<bool>       m_running;
+  std::mutex              m_mutex;
+  std::condition_variable m_cond;
+  std::thread             m_writer;
+};
+
+#endif
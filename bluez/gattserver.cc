@@ -14,7 +14,6 @@
 // limitations under the License.
 //
 #include "gattserver.h"
-#include "beacon.h"
 #include "../defs.h"
 #include "../logger.h"
 #include "../util.h"
@@ -30,18 +29,37 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdarg.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <cJSON.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/cmac.h>
+#endif
 
 // from bluez
 extern "C" 
 {
+#include <lib/hci.h>
+#include <lib/bluetooth/hci_lib.h>
 #include <src/shared/mainloop.h>
 }
 
 namespace
 {
-  char const     kRecordDelimiter         {30};
+  // every service starts at a fixed handle so a client that caches the
+  // database finds the same handles after a restart or a rebuild. each
+  // range leaves room for the service to grow
+  uint16_t const kHandleGattService       {0x0001};
+  uint16_t const kHandleDeviceInfoService {0x0010};
+  uint16_t const kHandleRdkDiagService    {0x0030};
+  uint16_t const kHandleRpcService        {0x0050};
+
+  uint16_t const kUuidDatabaseHash        {0x2b2a};
+
   uint16_t const kUuidDeviceInfoService   {0x180a};
 
   uint16_t const kUuidSystemId            {0x2a23};
@@ -55,6 +73,8 @@ namespace
   std::string const kUuidRpcService       {"503553ca-eb90-11e8-ac5b-bb7e434023e8"};
   std::string const kUuidRpcInbox         {"510c87c8-eb90-11e8-b3dc-17292c2ecc2d"};
   std::string const kUuidRpcEPoll         {"5140f882-eb90-11e8-a835-13d2bd922d3f"};
+  std::string const kUuidRpcOutbox        {"5177f6de-eb90-11e8-9ad4-3b5c0e4f4a2b"};
+  std::string const kUuidRpcBulkPsm       {"51ae52c2-eb90-11e8-8e3c-27a1f0e1b4d6"};
 
   //uint16_t const kUuidRdkDiagService      {0xFDB9};
   std::string const kUuidDeviceStatus     {"1f113f2c-cc01-4f03-9c5c-4b273ed631bb"};
@@ -72,9 +92,6 @@ namespace
     }
   }
 
-  void throw_errno(int err, char const* fmt, ...)
-    __attribute__ ((format (printf, 2, 3)));
-
   void ATT_debugCallback(char const* str, void* UNUSED_PARAM(argp))
   {
     if (!str)
@@ -91,31 +108,132 @@ namespace
       XLOG_DEBUG("GATT: %s", str);
   }
 
-  void throw_errno(int e, char const* fmt, ...)
+  // AES-CMAC with a zero key, Core spec vol 3 part G 7.3
+  bool
+  aesCmac(std::vector<uint8_t> const& message, uint8_t* mac)
+  {
+    uint8_t const key[16] = { 0 };
+    size_t len = 0;
+    bool ok = false;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    EVP_MAC* cmac = EVP_MAC_fetch(nullptr, "CMAC", nullptr);
+    EVP_MAC_CTX* ctx = cmac ? EVP_MAC_CTX_new(cmac) : nullptr;
+    if (ctx)
+    {
+      char cipher[] = "AES-128-CBC";
+      OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_CIPHER, cipher, 0),
+        OSSL_PARAM_construct_end()
+      };
+      ok = EVP_MAC_init(ctx, key, sizeof(key), params)
+        && EVP_MAC_update(ctx, message.data(), message.size())
+        && EVP_MAC_final(ctx, mac, &len, 16);
+      EVP_MAC_CTX_free(ctx);
+    }
+    EVP_MAC_free(cmac);
+#else
+    CMAC_CTX* ctx = CMAC_CTX_new();
+    if (ctx)
+    {
+      ok = CMAC_Init(ctx, key, sizeof(key), EVP_aes_128_cbc(), nullptr)
+        && CMAC_Update(ctx, message.data(), message.size())
+        && CMAC_Final(ctx, mac, &len);
+      CMAC_CTX_free(ctx);
+    }
+#endif
+
+    return ok && len == 16;
+  }
+
+  void GATT_hashValue(gatt_db_attribute* UNUSED_PARAM(attr), int err, uint8_t const* value, size_t len,
+    void* argp)
+  {
+    std::vector<uint8_t>* message = reinterpret_cast<std::vector<uint8_t> *>(argp);
+    if (!err && value)
+      message->insert(message->end(), value, value + len);
+  }
+
+  void GATT_lastHandle(gatt_db_attribute* service, void* argp)
   {
-    char buff[256] = {0};
+    uint16_t* last = reinterpret_cast<uint16_t *>(argp);
+    uint16_t start = 0;
+    uint16_t end = 0;
+    if (gatt_db_attribute_get_service_handles(service, &start, &end) && end > *last)
+      *last = end;
+  }
 
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(buff, sizeof(buff), fmt, args);
-    buff[sizeof(buff) - 1] = '\0';
-    va_end(args);
+  // the handle, type and, for declarations, the value of every attribute
+  // that describes the layout. characteristic values aren't part of it
+  bool
+  computeDatabaseHash(gatt_db* db, uint8_t* hash)
+  {
+    std::vector<uint8_t> message;
 
-    char err[256] = {0};
-    char* p = strerror_r(e, err, sizeof(err));
+    uint16_t last = 0;
+    gatt_db_foreach_service(db, nullptr, &GATT_lastHandle, &last);
 
-    std::stringstream out;
-    if (strlen(buff) > 0)
+    for (uint32_t handle = 1; handle <= last; ++handle)
     {
-      out << buff;
-      out << ". ";
+      gatt_db_attribute* attr = gatt_db_get_attribute(db, static_cast<uint16_t>(handle));
+      if (!attr)
+        continue;
+
+      bt_uuid_t const* type = gatt_db_attribute_get_type(attr);
+      if (bt_uuid_len(type) != 2)
+        continue;
+
+      bool withValue = false;
+      switch (type->value.u16)
+      {
+        case GATT_PRIM_SVC_UUID:
+        case GATT_SND_SVC_UUID:
+        case GATT_INCLUDE_UUID:
+        case GATT_CHARAC_UUID:
+        case GATT_CHARAC_EXT_PROPER_UUID:
+          withValue = true;
+          break;
+        case GATT_CHARAC_USER_DESC_UUID:
+        case GATT_CLIENT_CHARAC_CFG_UUID:
+        case GATT_SERVER_CHARAC_CFG_UUID:
+        case GATT_CHARAC_FMT_UUID:
+        case GATT_CHARAC_AGREG_FMT_UUID:
+          break;
+        default:
+          continue;
+      }
+
+      uint8_t buff[4];
+      put_le16(static_cast<uint16_t>(handle), buff);
+      put_le16(type->value.u16, buff + 2);
+      message.insert(message.end(), buff, buff + sizeof(buff));
+
+      // declarations hold their value, the callback runs before this returns
+      if (withValue)
+        gatt_db_attribute_read(attr, 0, 0, nullptr, &GATT_hashValue, &message);
     }
-    if (p && strlen(p) > 0)
-      out << p;
 
-    std::string message(out.str());
-    XLOG_ERROR("exception:%s", message.c_str());
-    throw std::runtime_error(message);
+    uint8_t mac[16];
+    if (!aesCmac(message, mac))
+      return false;
+
+    // sent least significant octet first like every other multi-octet value
+    for (int i = 0; i < 16; ++i)
+      hash[i] = mac[15 - i];
+    return true;
+  }
+
+  overflow_policy parseOverflowPolicy(char const* s)
+  {
+    if (!s || strcmp(s, "drop-oldest") == 0)
+      return overflow_policy::drop_oldest;
+    if (strcmp(s, "block") == 0)
+      return overflow_policy::block;
+    if (strcmp(s, "replace") == 0)
+      return overflow_policy::replace;
+
+    XLOG_WARN("unknown outgoing-policy %s, using drop-oldest", s);
+    return overflow_policy::drop_oldest;
   }
 
   void GattClient_onClientDisconnected(int err, void* argp)
@@ -126,213 +244,1612 @@ namespace
 
   void GattClient_onTimeout(int UNUSED_PARAM(fd), void* argp)
   {
-    GattClient* clnt = reinterpret_cast<GattClient *>(argp);
-    clnt->onTimeout();
+    GattClient* clnt = reinterpret_cast<GattClient *>(argp);
+    clnt->onTimeout();
+  }
+
+  void GattClient_onIdleCheck(int UNUSED_PARAM(fd), void* argp)
+  {
+    GattClient* clnt = reinterpret_cast<GattClient *>(argp);
+    clnt->onIdleCheck();
+  }
+
+  bool
+  getFlag(cJSON const* conf, char const* name)
+  {
+    cJSON const* item = JsonWrapper::search(conf, name, false);
+    return item && cJSON_IsTrue(item);
+  }
+
+  char const*
+  phyName(uint8_t phy)
+  {
+    switch (phy)
+    {
+      case 1: return "1M";
+      case 2: return "2M";
+      case 3: return "coded";
+    }
+    return "unknown";
+  }
+
+  // intervals are configured in ms and go over HCI in 1.25 ms units, the
+  // supervision timeout goes in 10 ms units
+  ConnectionParameters parseConnectionParameters(cJSON const* conf, char const* mode,
+    int minInterval, int maxInterval, int latency)
+  {
+    std::string path("/connection-parameters/");
+    path += mode;
+
+    minInterval = JsonWrapper::getInt(conf, (path + "/min-interval-ms").c_str(), false, minInterval);
+    maxInterval = JsonWrapper::getInt(conf, (path + "/max-interval-ms").c_str(), false, maxInterval);
+    latency = JsonWrapper::getInt(conf, (path + "/latency").c_str(), false, latency);
+    int timeout = JsonWrapper::getInt(conf, "/connection-parameters/supervision-timeout-ms", false, 4000);
+
+    ConnectionParameters params;
+    params.MinInterval = static_cast<uint16_t>(std::min(std::max(minInterval * 4 / 5, 6), 3200));
+    params.MaxInterval = static_cast<uint16_t>(std::min(std::max(maxInterval * 4 / 5,
+      static_cast<int>(params.MinInterval)), 3200));
+    params.Latency = static_cast<uint16_t>(std::min(std::max(latency, 0), 499));
+
+    // the link has to survive the central skipping latency events on top of
+    // a missed one, the spec wants more than twice that
+    int slowest = (1 + params.Latency) * params.MaxInterval * 5 / 4 * 2;
+    if (timeout <= slowest)
+    {
+      XLOG_WARN("supervision-timeout-ms %d too short for %s parameters, using %d", timeout, mode,
+        slowest + 10);
+      timeout = slowest + 10;
+    }
+    params.SupervisionTimeout = static_cast<uint16_t>(std::min(std::max(timeout / 10, 10), 3200));
+    return params;
+  }
+
+  void GattClient_onMtuExchange(uint8_t UNUSED_PARAM(opcode), void const* UNUSED_PARAM(pdu),
+    uint16_t UNUSED_PARAM(length), void* argp)
+  {
+    GattClient* clnt = reinterpret_cast<GattClient *>(argp);
+    clnt->onMtuExchange();
+  }
+
+  // the database is shared by every connection, attribute callbacks find
+  // theirs from the bearer the request came in on
+  GattClient* GattServer_findClient(bt_att* att, void* argp)
+  {
+    GattServer* server = reinterpret_cast<GattServer *>(argp);
+    GattClient* clnt = server->findClient(att);
+    if (!clnt)
+      XLOG_WARN("GATT request on unknown bearer");
+    return clnt;
+  }
+
+  void GattClient_onInboxWrite(gatt_db_attribute* attr, unsigned int id, uint16_t offset,
+    uint8_t const* value, size_t len, uint8_t opcode, bt_att* att, void* argp)
+  {
+    GattClient* clnt = GattServer_findClient(att, argp);
+    if (!clnt)
+    {
+      gatt_db_attribute_write_result(attr, id, BT_ATT_ERROR_UNLIKELY);
+      return;
+    }
+
+    // every write is appended to the stream, there's no value to write
+    // into the middle of. prepared writes at an offset aren't taken
+    if (offset != 0)
+    {
+      XLOG_WARN("refusing inbox write at offset %u", offset);
+      gatt_db_attribute_write_result(attr, id, BT_ATT_ERROR_INVALID_OFFSET);
+      return;
+    }
+
+    clnt->onInboxWrite(value, len);
+
+    // completes the pending write. for write-without-response the gatt
+    // server doesn't send anything back. while the server is backed up the
+    // write response is held back, the peer can't send the next write
+    // request until it gets it
+    if (clnt->inboundPaused() && opcode != BT_ATT_OP_WRITE_CMD)
+      clnt->deferWriteResult(attr, id);
+    else
+      gatt_db_attribute_write_result(attr, id, 0);
+  }
+
+  void GattClient_onOutboxRead(gatt_db_attribute* attr, unsigned int id, uint16_t offset,
+    uint8_t UNUSED_PARAM(opcode), bt_att* att, void* argp)
+  {
+    GattClient* clnt = GattServer_findClient(att, argp);
+    if (!clnt)
+      gatt_db_attribute_read_result(attr, id, BT_ATT_ERROR_UNLIKELY, nullptr, 0);
+    else
+      clnt->onOutboxRead(attr, id, offset);
+  }
+
+  void GattServer_onBulkPsmRead(gatt_db_attribute* attr, unsigned int id, uint16_t UNUSED_PARAM(offset),
+    uint8_t UNUSED_PARAM(opcode), bt_att* UNUSED_PARAM(att), void* argp)
+  {
+    GattServer* server = reinterpret_cast<GattServer *>(argp);
+    uint8_t value[2];
+    put_le16(server->bulkPsm(), value);
+    gatt_db_attribute_read_result(attr, id, 0, value, sizeof(value));
+  }
+
+  void GattServer_onDatabaseHashRead(gatt_db_attribute* attr, unsigned int id, uint16_t UNUSED_PARAM(offset),
+    uint8_t UNUSED_PARAM(opcode), bt_att* UNUSED_PARAM(att), void* argp)
+  {
+    GattServer* server = reinterpret_cast<GattServer *>(argp);
+    gatt_db_attribute_read_result(attr, id, 0, server->databaseHash(), 16);
+  }
+
+  // values that change while we run are fetched from the provider when
+  // they're read, long values are read in pieces so offset is honored
+  void GattServer_onProviderRead(gatt_db_attribute* attr, unsigned int id, uint16_t offset,
+    uint8_t UNUSED_PARAM(opcode), bt_att* UNUSED_PARAM(att), void* argp)
+  {
+    std::function< std::string () > const* get = reinterpret_cast<std::function< std::string () > const *>(argp);
+    std::string value = (*get) ? (*get)() : std::string();
+    if (offset > value.size())
+    {
+      gatt_db_attribute_read_result(attr, id, BT_ATT_ERROR_INVALID_OFFSET, nullptr, 0);
+      return;
+    }
+    gatt_db_attribute_read_result(attr, id, 0, reinterpret_cast<uint8_t const *>(value.data()) + offset,
+      value.size() - offset);
+  }
+
+  // client configuration descriptors are per connection even though the
+  // attribute isn't
+  template<uint16_t (GattClient::*Get)() const>
+  void GattClient_onConfigRead(gatt_db_attribute* attr, unsigned int id, uint16_t UNUSED_PARAM(offset),
+    uint8_t UNUSED_PARAM(opcode), bt_att* att, void* argp)
+  {
+    GattClient* clnt = GattServer_findClient(att, argp);
+    if (!clnt)
+    {
+      gatt_db_attribute_read_result(attr, id, BT_ATT_ERROR_UNLIKELY, nullptr, 0);
+      return;
+    }
+
+    uint8_t value[2];
+    put_le16((clnt->*Get)(), value);
+    gatt_db_attribute_read_result(attr, id, 0, value, sizeof(value));
+  }
+
+  template<void (GattClient::*Set)(uint16_t)>
+  void GattClient_onConfigWrite(gatt_db_attribute* attr, unsigned int id, uint16_t offset,
+    uint8_t const* value, size_t len, uint8_t UNUSED_PARAM(opcode), bt_att* att, void* argp)
+  {
+    int err = 0;
+    GattClient* clnt = GattServer_findClient(att, argp);
+    if (!clnt)
+      err = BT_ATT_ERROR_UNLIKELY;
+    else if (offset)
+      err = BT_ATT_ERROR_INVALID_OFFSET;
+    else if (len != 2)
+      err = BT_ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LEN;
+    else
+      (clnt->*Set)(get_le16(value));
+    gatt_db_attribute_write_result(attr, id, err);
+  }
+
+  void GattClient_onIndicationConfirm(void* argp)
+  {
+    GattClient* clnt = reinterpret_cast<GattClient *>(argp);
+    clnt->onIndicationConfirm();
+  }
+
+  // passes every PDU between the link and bt_att's end of a socketpair,
+  // recording each one on the way. it owns both fds and lives until the
+  // mainloop has let go of both, the GattClient it was made for can be
+  // gone by then. the mainloop calls a whole batch of events from a saved
+  // array, so neither fd is ever removed from the other's callback. once
+  // one side is done the other is shut down, and sees a hang up of its own
+  class CaptureRelay
+  {
+  public:
+    CaptureRelay(BtSnoopRecorder* capture, uint16_t handle, int airFd, int attFd)
+      : m_capture(capture)
+      , m_handle(handle)
+      , m_air_fd(airFd)
+      , m_att_fd(attFd)
+      , m_to_air()
+      , m_to_att()
+    {
+    }
+
+    void onEvent(int fd, uint32_t events);
+
+  private:
+    void drop(int fd);
+
+  private:
+    BtSnoopRecorder*     m_capture;
+    uint16_t             m_handle;
+    int                  m_air_fd;
+    int                  m_att_fd;
+    std::vector<uint8_t> m_to_air;
+    std::vector<uint8_t> m_to_att;
+  };
+
+  void
+  CaptureRelay::drop(int fd)
+  {
+    int peer = (fd == m_air_fd) ? m_att_fd : m_air_fd;
+    if (peer != -1)
+      shutdown(peer, SHUT_RDWR);
+
+    mainloop_remove_fd(fd);
+    close(fd);
+    if (fd == m_air_fd)
+      m_air_fd = -1;
+    else
+      m_att_fd = -1;
+
+    if (m_air_fd == -1 && m_att_fd == -1)
+      delete this;
+  }
+
+  void
+  CaptureRelay::onEvent(int fd, uint32_t events)
+  {
+    // the other side may have finished earlier in the same batch
+    bool fromAir = fd == m_air_fd;
+    int peer = fromAir ? m_att_fd : m_air_fd;
+    if ((events & (EPOLLERR | EPOLLHUP)) || peer == -1)
+    {
+      drop(fd);
+      return;
+    }
+
+    // a PDU the other side wouldn't take yet is held, and nothing more is
+    // read from this side until it's gone, so the relay never buffers more
+    // than one PDU each way
+    std::vector<uint8_t>& held = fromAir ? m_to_air : m_to_att;
+    std::vector<uint8_t>& forward = fromAir ? m_to_att : m_to_air;
+    bool toAirEmpty = m_to_air.empty();
+    bool toAttEmpty = m_to_att.empty();
+
+    if ((events & EPOLLOUT) && !held.empty())
+    {
+      if (send(fd, held.data(), held.size(), MSG_DONTWAIT | MSG_NOSIGNAL) >= 0)
+      {
+        held.clear();
+      }
+      else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        drop(fd);
+        return;
+      }
+    }
+
+    if ((events & EPOLLIN) && forward.empty())
+    {
+      uint8_t buff[BT_ATT_MAX_LE_MTU];
+      ssize_t n = recv(fd, buff, sizeof(buff), MSG_DONTWAIT);
+      if (n > 0)
+      {
+        m_capture->record(m_handle, fromAir, buff, n);
+        if (send(peer, buff, n, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+          {
+            drop(fd);
+            return;
+          }
+          forward.assign(buff, buff + n);
+        }
+      }
+      else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+      {
+        drop(fd);
+        return;
+      }
+    }
+
+    // both sides' masks depend on both buffers, one can empty as the other
+    // fills in the same call
+    if (toAirEmpty != m_to_air.empty() || toAttEmpty != m_to_att.empty())
+    {
+      uint32_t in = EPOLLIN;
+      uint32_t out = EPOLLOUT;
+      mainloop_modify_fd(m_air_fd, (m_to_att.empty() ? in : 0) | (m_to_air.empty() ? 0 : out));
+      mainloop_modify_fd(m_att_fd, (m_to_air.empty() ? in : 0) | (m_to_att.empty() ? 0 : out));
+    }
+  }
+
+  void CaptureRelay_onEvent(int fd, uint32_t events, void* argp)
+  {
+    CaptureRelay* relay = reinterpret_cast<CaptureRelay *>(argp);
+    relay->onEvent(fd, events);
+  }
+
+  void GattClient_onWakeup(int UNUSED_PARAM(fd), uint32_t UNUSED_PARAM(events), void* argp)
+  {
+    GattClient* clnt = reinterpret_cast<GattClient *>(argp);
+    clnt->onWakeup();
+  }
+
+  void GattServer_onIncomingConnection(int fd, uint32_t UNUSED_PARAM(events), void* argp)
+  {
+    GattServer* server = reinterpret_cast<GattServer *>(argp);
+    server->onIncomingConnection(fd);
+  }
+
+  void GattServer_onLinkEvent(int fd, uint32_t UNUSED_PARAM(events), void* argp)
+  {
+    GattServer* server = reinterpret_cast<GattServer *>(argp);
+    server->onLinkEvent(fd);
+  }
+
+  void GattServer_onWakeup(int fd, uint32_t UNUSED_PARAM(events), void* UNUSED_PARAM(argp))
+  {
+    uint64_t n = 0;
+    if (read(fd, &n, sizeof(n)) != sizeof(n))
+      XLOG_WARN("failed to read mainloop wakeup. %s", strerror(errno));
+  }
+}
+
+GattServer::GattServer()
+  : m_adapters()
+  , m_wakeup_fd(-1)
+  , m_db(nullptr)
+  , m_epoll_handle(0)
+  , m_outbox_handle(0)
+  , m_service_changed_handle(0)
+  , m_db_hash()
+  , m_db_changed(false)
+  , m_listener_config(nullptr)
+  , m_mainloop_thread()
+  , m_mutex()
+  , m_cond()
+  , m_clients()
+  , m_accepted()
+  , m_bulk_listener()
+  , m_bulk_accept_thread()
+{
+  memset(&m_local_interface, 0, sizeof(m_local_interface));
+}
+
+GattServer::~GattServer()
+{
+  if (m_mainloop_thread.joinable())
+  {
+    // mainloop_quit only sets a flag, poke the loop so it notices
+    mainloop_quit();
+    uint64_t one = 1;
+    if (write(m_wakeup_fd, &one, sizeof(one)) != sizeof(one))
+      XLOG_WARN("failed to signal mainloop thread. %s", strerror(errno));
+    m_mainloop_thread.join();
+  }
+
+  if (m_bulk_accept_thread.joinable())
+  {
+    m_bulk_listener->stop();
+    m_bulk_accept_thread.join();
+  }
+  m_bulk_listener.reset();
+
+  m_clients.clear();
+
+  if (m_db)
+    gatt_db_unref(m_db);
+
+  for (GattAdapter const& adapter : m_adapters)
+  {
+    if (adapter.ListenFd != -1)
+      close(adapter.ListenFd);
+    if (adapter.LinkFd != -1)
+      close(adapter.LinkFd);
+  }
+
+  if (m_wakeup_fd != -1)
+    close(m_wakeup_fd);
+
+  if (m_listener_config)
+    cJSON_Delete(m_listener_config);
+}
+
+void
+GattServer::init(cJSON const* listenerConfig)
+{
+  if (listenerConfig)
+    m_listener_config = cJSON_Duplicate(listenerConfig, true);
+  else
+    m_listener_config = cJSON_CreateObject();
+
+  m_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_wakeup_fd < 0)
+    throw_errno(errno, "failed to create eventfd");
+
+  // all connections share one mainloop, it's only run from
+  // m_mainloop_thread once accept() is first called
+  mainloop_init();
+
+  int ret = mainloop_add_fd(m_wakeup_fd, EPOLLIN, &GattServer_onWakeup, this, nullptr);
+  if (ret < 0)
+    throw_errno(-ret, "failed to add eventfd to mainloop");
+
+  // every controller listens and advertises on its own, the connections
+  // all end up in the one mainloop and db. with more than one configured a
+  // controller that won't come up is left out instead of stopping the rest
+  std::vector<int> deviceIds = listenerDeviceIds(m_listener_config);
+  m_adapters.reserve(deviceIds.size());
+  for (int deviceId : deviceIds)
+  {
+    m_adapters.push_back(GattAdapter{ deviceId, -1, -1, LinkCapabilities(), false, false });
+    try
+    {
+      initAdapter(m_adapters.back());
+    }
+    catch (std::exception const& err)
+    {
+      if (deviceIds.size() == 1)
+        throw;
+
+      XLOG_ERROR("hci%d disabled. %s", deviceId, err.what());
+      GattAdapter const& adapter = m_adapters.back();
+      if (adapter.ListenFd != -1)
+      {
+        mainloop_remove_fd(adapter.ListenFd);
+        close(adapter.ListenFd);
+      }
+      if (adapter.LinkFd != -1)
+      {
+        mainloop_remove_fd(adapter.LinkFd);
+        close(adapter.LinkFd);
+      }
+      m_adapters.pop_back();
+    }
+  }
+
+  if (m_adapters.empty())
+    throw std::runtime_error("none of the configured bluetooth controllers could be started");
+
+  // the bulk channel is optional, a kernel without LE credit based
+  // channels still gets the GATT transport. it listens on every controller
+  if (JsonWrapper::getInt(m_listener_config, "l2cap-psm", false, 0) >= 0)
+  {
+    try
+    {
+      std::shared_ptr<L2capServer> bulk(new L2capServer());
+      bulk->init(m_listener_config);
+      m_bulk_listener = bulk;
+    }
+    catch (std::exception const& err)
+    {
+      XLOG_WARN("l2cap bulk transport disabled. %s", err.what());
+    }
+  }
+
+  initCapture();
+
+  for (GattAdapter const& adapter : m_adapters)
+    startBeacon(m_listener_config, adapter.DeviceId);
+}
+
+void
+GattServer::initCapture()
+{
+  char const* path = JsonWrapper::getString(m_listener_config, "btsnoop-file", false, "");
+  if (!path || !path[0])
+    return;
+
+  if (m_capture.open(path, JsonWrapper::getInt(m_listener_config, "btsnoop-ring-bytes", false, 1048576)))
+    m_capture.setEnabled(getFlag(m_listener_config, "btsnoop-enabled"));
+}
+
+void
+GattServer::initAdapter(GattAdapter& adapter)
+{
+  // bound to the controller's own address, more than one socket can't
+  // listen on BDADDR_ANY
+  bdaddr_t src_addr = {0};
+  if (hci_devba(adapter.DeviceId, &src_addr) < 0)
+    throw_errno(errno, "failed to get address of hci%d", adapter.DeviceId);
+
+  adapter.ListenFd = socket(PF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, BTPROTO_L2CAP);
+  if (adapter.ListenFd < 0)
+    throw_errno(errno, "failed to create bluetooth socket");
+
+  sockaddr_l2 srcaddr;
+  memset(&srcaddr, 0, sizeof(srcaddr));
+  srcaddr.l2_family = AF_BLUETOOTH;
+  srcaddr.l2_cid = htobs(4);
+  srcaddr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
+  bacpy(&srcaddr.l2_bdaddr, &src_addr);
+
+  int ret = bind(adapter.ListenFd, reinterpret_cast<sockaddr *>(&srcaddr), sizeof(srcaddr));
+  if (ret < 0)
+    throw_errno(errno, "failed to bind bluetooth socket");
+
+  bt_security btsec = {0, 0};
+  btsec.level = BT_SECURITY_LOW;
+  ret = setsockopt(adapter.ListenFd, SOL_BLUETOOTH, BT_SECURITY, &btsec, sizeof(btsec));
+  if (ret < 0)
+    throw_errno(errno, "failed to set security on bluetooth socket");
+
+  ret = listen(adapter.ListenFd, 2);
+  if (ret < 0)
+    throw_errno(errno, "failed to listen on bluetooth socket");
+
+  ret = mainloop_add_fd(adapter.ListenFd, EPOLLIN, &GattServer_onIncomingConnection, this, nullptr);
+  if (ret < 0)
+    throw_errno(-ret, "failed to add bluetooth socket to mainloop");
+
+  // longer packets and the 2M PHY are only asked for when the controller
+  // can do them, the central still has the final say
+  adapter.DataLengthEnabled = getFlag(m_listener_config, "le-data-length");
+  adapter.Phy2MEnabled = getFlag(m_listener_config, "le-2m-phy");
+  if (adapter.DataLengthEnabled || adapter.Phy2MEnabled)
+  {
+    if (!readLinkCapabilities(adapter.DeviceId, adapter.Caps))
+      memset(&adapter.Caps, 0, sizeof(adapter.Caps));
+
+    XLOG_INFO("hci%d data length extension:%s max tx %u octets %u us, 2M PHY:%s", adapter.DeviceId,
+      adapter.Caps.DataLengthExtension ? "yes" : "no", adapter.Caps.MaxTxOctets, adapter.Caps.MaxTxTime,
+      adapter.Caps.Phy2M ? "yes" : "no");
+
+    adapter.DataLengthEnabled = adapter.DataLengthEnabled && adapter.Caps.DataLengthExtension;
+    adapter.Phy2MEnabled = adapter.Phy2MEnabled && adapter.Caps.Phy2M;
+  }
+
+  // connection parameters are only managed when there's somewhere to see
+  // what the central made of the request
+  if (JsonWrapper::getInt(m_listener_config, "/connection-parameters/idle-ms", false, 5000) > 0
+    || adapter.DataLengthEnabled || adapter.Phy2MEnabled)
+  {
+    adapter.LinkFd = openLinkEvents(adapter.DeviceId);
+    if (adapter.LinkFd < 0)
+      XLOG_WARN("connection parameter, data length and PHY updates disabled on hci%d", adapter.DeviceId);
+    else if ((ret = mainloop_add_fd(adapter.LinkFd, EPOLLIN, &GattServer_onLinkEvent, this, nullptr)) < 0)
+      throw_errno(-ret, "failed to add HCI socket to mainloop");
+  }
+}
+
+void
+GattServer::initLoopback(cJSON const* conf, DeviceInfoProvider const& deviceInfoProvider,
+  RdkDiagProvider const& rdkDiagProvider)
+{
+  if (conf)
+    m_listener_config = cJSON_Duplicate(conf, true);
+  else
+    m_listener_config = cJSON_CreateObject();
+
+  m_device_info_provider = deviceInfoProvider;
+  m_rdk_diag_provider = rdkDiagProvider;
+  buildGattDatabase();
+  initCapture();
+}
+
+std::shared_ptr<GattClient>
+GattServer::attach(int fd, std::string const& remoteAddress, int adapter)
+{
+  std::shared_ptr<GattClient> clnt(new GattClient(this, fd, remoteAddress, adapter));
+  clnt->init(m_device_info_provider, m_rdk_diag_provider);
+  m_clients.insert(std::make_pair(clnt.get(), clnt));
+  return clnt;
+}
+
+std::shared_ptr<RpcConnectedClient>
+GattServer::accept(DeviceInfoProvider const& deviceInfoProvider, RdkDiagProvider const& rdkDiagProvider)
+{
+  if (!m_mainloop_thread.joinable())
+  {
+    // the providers are only known once the first accept comes in, the
+    // db is built from them before the mainloop starts accepting
+    m_device_info_provider = deviceInfoProvider;
+    m_rdk_diag_provider = rdkDiagProvider;
+    buildGattDatabase();
+    m_mainloop_thread = std::thread([] { mainloop_run(); });
+
+    if (m_bulk_listener)
+      m_bulk_accept_thread = std::thread([this] { this->acceptBulkClients(); });
+  }
+
+  XLOG_INFO("waiting for incoming BLE connections");
+
+  std::unique_lock<std::mutex> guard(m_mutex);
+  m_cond.wait(guard, [this] { return !this->m_accepted.empty(); });
+
+  std::shared_ptr<RpcConnectedClient> clnt = m_accepted.front();
+  m_accepted.pop();
+  return clnt;
+}
+
+void
+GattServer::acceptBulkClients()
+{
+  // L2CAP clients are serviced from the socket server's epoll thread, they
+  // only come through here to be handed out by accept() with the GATT ones
+  while (true)
+  {
+    std::shared_ptr<RpcConnectedClient> clnt = m_bulk_listener->accept(m_device_info_provider,
+      m_rdk_diag_provider);
+    if (!clnt)
+      return;
+
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      m_accepted.push(clnt);
+    }
+    m_cond.notify_one();
+  }
+}
+
+void
+GattServer::onIncomingConnection(int fd)
+{
+  int adapter = 0;
+  while (adapter < static_cast<int>(m_adapters.size()) && m_adapters[adapter].ListenFd != fd)
+    adapter++;
+  if (adapter == static_cast<int>(m_adapters.size()))
+    return;
+
+  sockaddr_l2 peer_addr;
+  memset(&peer_addr, 0, sizeof(peer_addr));
+
+  socklen_t n = sizeof(peer_addr);
+  int soc = ::accept(fd, reinterpret_cast<sockaddr *>(&peer_addr), &n);
+  if (soc < 0)
+  {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      XLOG_ERROR("failed to accept incoming connection on bluetooth socket. %s", strerror(errno));
+    return;
+  }
+
+  char remote_address[64] = {0};
+  ba2str(&peer_addr.l2_bdaddr, remote_address);
+  XLOG_INFO("accepted remote connection from:%s on hci%d", remote_address, m_adapters[adapter].DeviceId);
+
+  std::shared_ptr<GattClient> clnt = attach(soc, remote_address, adapter);
+
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_accepted.push(clnt);
+  }
+  m_cond.notify_one();
+
+  // the controller stops advertising when a central connects, turn it back
+  // on so other centrals can find us
+  enableAdvertising(m_adapters[adapter].DeviceId);
+}
+
+void
+GattServer::onLinkEvent(int fd)
+{
+  int adapter = 0;
+  while (adapter < static_cast<int>(m_adapters.size()) && m_adapters[adapter].LinkFd != fd)
+    adapter++;
+  if (adapter == static_cast<int>(m_adapters.size()))
+    return;
+
+  LinkEvent event;
+  while (readLinkEvent(fd, event))
+  {
+    if (event.Kind == LinkEvent::Type::CommandStatus)
+    {
+      if (event.Status)
+        XLOG_WARN("controller refused %s, status:0x%02x", linkCommandName(event.Opcode), event.Status);
+    }
+    else if (event.Kind != LinkEvent::Type::Other)
+    {
+      // the kernel and other processes update links too, only ours are logged
+      for (auto const& kv : m_clients)
+      {
+        if (kv.first->adapter() == adapter && kv.first->connectionHandle() == event.Handle)
+          kv.first->onLinkEvent(event);
+      }
+    }
+  }
+}
+
+bool
+GattServer::requestConnectionUpdate(int adapter, uint16_t handle, ConnectionParameters const& params)
+{
+  if (adapter < 0 || m_adapters[adapter].LinkFd < 0)
+    return false;
+  return ::requestConnectionUpdate(m_adapters[adapter].LinkFd, handle, params);
+}
+
+void
+GattServer::requestFastLink(int adapter, uint16_t handle)
+{
+  if (adapter < 0 || m_adapters[adapter].LinkFd < 0)
+    return;
+
+  GattAdapter const& a = m_adapters[adapter];
+  if (a.DataLengthEnabled)
+    requestDataLength(a.LinkFd, handle, a.Caps.MaxTxOctets, a.Caps.MaxTxTime);
+  if (a.Phy2MEnabled)
+    requestPhy2M(a.LinkFd, handle);
+}
+
+void
+GattServer::checkDatabaseHash()
+{
+  char const* fname = JsonWrapper::getString(m_listener_config, "gatt-hash-file", false, nullptr);
+  if (!fname)
+    return;
+
+  // compared against the last run, the layout can't change while we run
+  std::string current(reinterpret_cast<char const *>(m_db_hash), sizeof(m_db_hash));
+  std::string previous;
+  {
+    std::ifstream in(fname, std::ios::binary);
+    char buff[sizeof(m_db_hash)];
+    if (in.read(buff, sizeof(buff)))
+      previous.assign(buff, sizeof(buff));
+  }
+
+  if (previous == current)
+    return;
+
+  m_db_changed = !previous.empty();
+  if (m_db_changed)
+    XLOG_INFO("GATT database changed since it was last served");
+
+  std::ofstream out(fname, std::ios::binary | std::ios::trunc);
+  if (!out.write(current.data(), current.size()))
+    XLOG_WARN("failed to save GATT database hash to %s", fname);
+}
+
+GattClient*
+GattServer::findClient(bt_att* att) const
+{
+  for (auto const& kv : m_clients)
+  {
+    if (kv.first->att() == att)
+      return kv.first;
+  }
+  return nullptr;
+}
+
+void
+GattServer::buildGattDatabase()
+{
+  // built once and shared by every connection. only the characteristics
+  // that change while we run have read callbacks
+  m_db = gatt_db_new();
+  if (!m_db)
+  {
+    XLOG_CRITICAL("failed to create gatt database");
+    return;
+  }
+
+  buildGattService();
+  buildDeviceInfoService(m_device_info_provider);
+  buildRdkDiagService(m_rdk_diag_provider);
+  buildRpcService();
+
+  if (!computeDatabaseHash(m_db, m_db_hash))
+  {
+    XLOG_ERROR("failed to compute GATT database hash");
+    return;
+  }
+  checkDatabaseHash();
+}
+
+void
+GattServer::addGattCharacteristic(
+  gatt_db_attribute* service,
+  bt_uuid_t          uuid,
+  std::string const& value)
+{
+  char buff[128];
+
+  gatt_db_attribute* attr = gatt_db_service_add_characteristic(service, &uuid, BT_ATT_PERM_READ,
+    BT_GATT_CHRC_PROP_READ, nullptr, nullptr, nullptr);
+
+  bt_uuid_to_string(&uuid, buff, sizeof(buff));
+  if (!attr)
+  {
+    XLOG_CRITICAL("failed to create GATT characteristic %s", buff);
+    return;
+  }
+
+  uint8_t const* p = reinterpret_cast<uint8_t const *>(value.c_str());
+
+  XLOG_INFO("setting GATT attr:%s to %s", buff, value.c_str());
+
+  // I'm not sure whether i like this or just having callbacks setup for reads
+  gatt_db_attribute_write(attr, 0, p, value.length(), BT_ATT_OP_WRITE_REQ, nullptr,
+      &DIS_writeCallback, nullptr);
+}
+
+void
+GattServer::addGattCharacteristic(
+  gatt_db_attribute* service,
+  uint16_t           id,
+  std::string const& value)
+{
+  bt_uuid_t uuid;
+  bt_uuid16_create(&uuid, id);
+
+  addGattCharacteristic(service, uuid, value);
+}
+
+void
+GattServer::addGattCharacteristic(
+  gatt_db_attribute* service,
+  std::string const& id,
+  std::string const& value)
+{
+  bt_uuid_t uuid;
+  bt_string_to_uuid(&uuid, id.c_str());
+
+  addGattCharacteristic(service, uuid, value);
+}
+
+void
+GattServer::addGattCharacteristic(
+  gatt_db_attribute*                      service,
+  std::string const&                      id,
+  std::function< std::string () > const*  getter)
+{
+  bt_uuid_t uuid;
+  bt_string_to_uuid(&uuid, id.c_str());
+
+  gatt_db_attribute* attr = gatt_db_service_add_characteristic(service, &uuid, BT_ATT_PERM_READ,
+    BT_GATT_CHRC_PROP_READ, &GattServer_onProviderRead, nullptr, const_cast<std::function< std::string () > *>(getter));
+  if (!attr)
+    XLOG_CRITICAL("failed to create GATT characteristic %s", id.c_str());
+}
+
+void
+GattServer::buildDeviceInfoService(DeviceInfoProvider const& deviceInfoProvider)
+{
+  bt_uuid_t uuid;
+  bt_uuid16_create(&uuid, kUuidDeviceInfoService);
+
+  gatt_db_attribute* service = gatt_db_insert_service(m_db, kHandleDeviceInfoService, &uuid, true, 30);
+
+  XLOG_INFO("\nBuilding DeviceInfo Service");
+  addGattCharacteristic(service, kUuidSystemId, deviceInfoProvider.GetSystemId());
+  addGattCharacteristic(service, kUuidModelNumber, deviceInfoProvider.GetModelNumber());
+  addGattCharacteristic(service, kUuidSerialNumber, deviceInfoProvider.GetSerialNumber());
+  addGattCharacteristic(service, kUuidFirmwareRevision, deviceInfoProvider.GetFirmwareRevision());
+  addGattCharacteristic(service, kUuidHardwareRevision, deviceInfoProvider.GetHardwareRevision());
+  addGattCharacteristic(service, kUuidSoftwareRevision, deviceInfoProvider.GetSoftwareRevision());
+  addGattCharacteristic(service, kUuidManufacturerName, deviceInfoProvider.GetManufacturerName());
+
+  gatt_db_service_set_active(service, true);
+}
+
+void
+GattServer::buildRdkDiagService(RdkDiagProvider const& rdkDiagProvider)
+{
+  bt_uuid_t uuid;
+  bt_uuid16_create(&uuid, rdkDiagProvider.rdkDiagUuid);
+
+  gatt_db_attribute* service = gatt_db_insert_service(m_db, kHandleRdkDiagService, &uuid, true, 31);
+
+  // these change while we run, the provider is asked on every read.
+  // rdkDiagProvider is m_rdk_diag_provider so the getters outlive the db
+  XLOG_INFO("\nBuilding RdkDiag Service");
+  addGattCharacteristic(service, kUuidDeviceStatus, &rdkDiagProvider.GetDeviceStatus);
+  addGattCharacteristic(service, kUuidFwDownloadStatus, &rdkDiagProvider.GetFirmwareDownloadStatus);
+  addGattCharacteristic(service, kUuidWebPAStatus, &rdkDiagProvider.GetWebPAStatus);
+  addGattCharacteristic(service, kUuidWiFiRadio1Status, &rdkDiagProvider.GetWiFiRadio1Status);
+  addGattCharacteristic(service, kUuidWiFiRadio2Status, &rdkDiagProvider.GetWiFiRadio2Status);
+  addGattCharacteristic(service, kUuidRFStatus, &rdkDiagProvider.GetRFStatus);
+
+  gatt_db_service_set_active(service, true);
+}
+
+void
+GattServer::buildGattService()
+{
+  bt_uuid_t uuid;
+  bt_uuid16_create(&uuid, UUID_GATT);
+
+  gatt_db_attribute* service = gatt_db_insert_service(m_db, kHandleGattService, &uuid, true, 8);
+
+  XLOG_INFO("\nBuilding GATT Service");
+
+  // clients only cache the database when the server can tell them it
+  // changed. the layout is fixed for the life of the process, so the only
+  // indication is for clients that cached what an older build served
+  bt_uuid16_create(&uuid, GATT_CHARAC_SERVICE_CHANGED);
+  gatt_db_attribute* changed = gatt_db_service_add_characteristic(service, &uuid, BT_ATT_PERM_NONE,
+    BT_GATT_CHRC_PROP_INDICATE, nullptr, nullptr, this);
+  if (!changed)
+    XLOG_CRITICAL("failed to create GATT characteristic %04x", GATT_CHARAC_SERVICE_CHANGED);
+  else
+    m_service_changed_handle = gatt_db_attribute_get_handle(changed);
+
+  bt_uuid16_create(&uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+  gatt_db_service_add_descriptor(service, &uuid, BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+    &GattClient_onConfigRead<&GattClient::serviceChangedConfig>,
+    &GattClient_onConfigWrite<&GattClient::setServiceChangedConfig>, this);
+
+  // lets a client that cached the database check it in one read instead
+  // of rediscovering every service
+  bt_uuid16_create(&uuid, kUuidDatabaseHash);
+  if (!gatt_db_service_add_characteristic(service, &uuid, BT_ATT_PERM_READ, BT_GATT_CHRC_PROP_READ,
+    &GattServer_onDatabaseHashRead, nullptr, this))
+    XLOG_CRITICAL("failed to create GATT characteristic %04x", kUuidDatabaseHash);
+
+  gatt_db_service_set_active(service, true);
+}
+
+void
+GattServer::buildRpcService()
+{
+  bt_uuid_t uuid;
+  bt_string_to_uuid(&uuid, kUuidRpcService.c_str());
+
+  gatt_db_attribute* service = gatt_db_insert_service(m_db, kHandleRpcService, &uuid, true, 16);
+
+  XLOG_INFO("\nBuilding Rpc Service");
+
+  // requests are streamed into the inbox and split on kRecordDelimiter, or
+  // on their length headers once the client asks for that.
+  // write-without-response lets the client keep writing without waiting a
+  // connection interval for each write response
+  bt_string_to_uuid(&uuid, kUuidRpcInbox.c_str());
+  if (!gatt_db_service_add_characteristic(service, &uuid, BT_ATT_PERM_WRITE,
+    BT_GATT_CHRC_PROP_WRITE | BT_GATT_CHRC_PROP_WRITE_WITHOUT_RESP,
+    nullptr, &GattClient_onInboxWrite, this))
+    XLOG_CRITICAL("failed to create GATT characteristic %s", kUuidRpcInbox.c_str());
+
+  bt_string_to_uuid(&uuid, kUuidRpcEPoll.c_str());
+  gatt_db_attribute* blepoll = gatt_db_service_add_characteristic(service, &uuid, BT_ATT_PERM_NONE,
+    BT_GATT_CHRC_PROP_NOTIFY, nullptr, nullptr, this);
+  if (!blepoll)
+    XLOG_CRITICAL("failed to create GATT characteristic %s", kUuidRpcEPoll.c_str());
+  else
+    m_epoll_handle = gatt_db_attribute_get_handle(blepoll);
+
+  bt_uuid16_create(&uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+  gatt_db_service_add_descriptor(service, &uuid, BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+    &GattClient_onConfigRead<&GattClient::epollConfig>,
+    &GattClient_onConfigWrite<&GattClient::setEPollConfig>, this);
+
+  // the value of the outbox is the record at the head of m_outgoing_queue,
+  // delimiter included, or the next 512 bytes of a longer one. the client
+  // pulls it with Read and Read Blob, or subscribes to it to have the
+  // bytes pushed instead
+  bt_string_to_uuid(&uuid, kUuidRpcOutbox.c_str());
+  gatt_db_attribute* outbox = gatt_db_service_add_characteristic(service, &uuid, BT_ATT_PERM_READ,
+    BT_GATT_CHRC_PROP_READ | BT_GATT_CHRC_PROP_NOTIFY | BT_GATT_CHRC_PROP_INDICATE,
+    &GattClient_onOutboxRead, nullptr, this);
+  if (!outbox)
+    XLOG_CRITICAL("failed to create GATT characteristic %s", kUuidRpcOutbox.c_str());
+  else
+    m_outbox_handle = gatt_db_attribute_get_handle(outbox);
+
+  bt_uuid16_create(&uuid, GATT_CLIENT_CHARAC_CFG_UUID);
+  gatt_db_service_add_descriptor(service, &uuid, BT_ATT_PERM_READ | BT_ATT_PERM_WRITE,
+    &GattClient_onConfigRead<&GattClient::outboxConfig>,
+    &GattClient_onConfigWrite<&GattClient::setOutboxConfig>, this);
+
+  // where to open an L2CAP channel to the same rpc server for bulk
+  // transfers, little endian. zero if there isn't one
+  bt_string_to_uuid(&uuid, kUuidRpcBulkPsm.c_str());
+  if (!gatt_db_service_add_characteristic(service, &uuid, BT_ATT_PERM_READ, BT_GATT_CHRC_PROP_READ,
+    &GattServer_onBulkPsmRead, nullptr, this))
+    XLOG_CRITICAL("failed to create GATT characteristic %s", kUuidRpcBulkPsm.c_str());
+
+  gatt_db_service_set_active(service, true);
+}
+
+void
+GattServer::onClientDisconnected(GattClient* clnt)
+{
+  int adapter = clnt->adapter();
+
+  // may drop the last reference, don't touch clnt after this
+  m_clients.erase(clnt);
+  XLOG_INFO("%d BLE clients still connected", static_cast<int>(m_clients.size()));
+
+  // loopback connections never came from an adapter
+  if (adapter < 0)
+    return;
+
+  // the listen socket and advertiser stay configured for the life of the
+  // process, a disconnect only needs advertising switched back on. this
+  // also covers the controller refusing to advertise while it was at its
+  // connection limit
+  enableAdvertising(m_adapters[adapter].DeviceId);
+}
+
+void
+GattClient::init(DeviceInfoProvider const& UNUSED_PARAM(deviceInfoProvider),
+  RdkDiagProvider const& UNUSED_PARAM(rdkDiagProvider))
+{
+  // the GattServer built the db from the providers when it started.
+  // captured PDUs are recorded with the link's connection handle
+  l2cap_conninfo info;
+  socklen_t len = sizeof(info);
+  memset(&info, 0, sizeof(info));
+  if (getsockopt(m_fd, SOL_L2CAP, L2CAP_CONNINFO, &info, &len) < 0)
+    XLOG_WARN("failed to get connection handle for %s. %s", m_remote_address.c_str(), strerror(errno));
+  else
+    m_conn_handle = info.hci_handle;
+
+  startRelay();
+  m_att = bt_att_new(m_att_fd, 0);
+  if (!m_att)
+  {
+    XLOG_ERROR("failed to create new att:%d", errno);
+  }
+
+  bt_att_set_close_on_unref(m_att, true);
+  bt_att_register_disconnect(m_att, &GattClient_onClientDisconnected, this, nullptr);
+
+  // this is the most we'll accept, the gatt server answers the client's
+  // Exchange MTU request with it and the effective MTU is the smaller of
+  // the two
+  int maxMtu = JsonWrapper::getInt(m_listener->config(), "att-mtu", false, BT_ATT_MAX_LE_MTU);
+  if (maxMtu < BT_ATT_DEFAULT_LE_MTU || maxMtu > BT_ATT_MAX_LE_MTU)
+  {
+    XLOG_WARN("att-mtu %d out of range, using %d", maxMtu, BT_ATT_MAX_LE_MTU);
+    maxMtu = BT_ATT_MAX_LE_MTU;
+  }
+
+  // the gatt server takes its own reference on the shared db
+  m_server = bt_gatt_server_new(m_listener->database(), m_att, static_cast<uint16_t>(maxMtu));
+  if (!m_server)
+  {
+    XLOG_ERROR("failed to create gatt server");
+  }
+
+  // registered after the gatt server so it runs once the new MTU is set
+  bt_att_register(m_att, BT_ATT_OP_MTU_REQ, &GattClient_onMtuExchange, this, nullptr);
+
+  if (true)
+  {
+    bt_att_set_debug(m_att, ATT_debugCallback, this, nullptr);
+    bt_gatt_server_set_debug(m_server, GATT_debugCallback, this, nullptr);
+  }
+
+  m_mainloop_thread = std::this_thread::get_id();
+
+  // enqueueForSend signals the eventfd so the notification goes out as soon
+  // as the mainloop picks it up, there's no polling while idle
+  m_notify_coalesce_ms = JsonWrapper::getInt(m_listener->config(), "notify-coalesce-ms", false, 0);
+
+  m_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_wakeup_fd < 0)
+    XLOG_ERROR("failed to create eventfd:%d", errno);
+  else if (mainloop_add_fd(m_wakeup_fd, EPOLLIN, &GattClient_onWakeup, this, nullptr) < 0)
+    XLOG_ERROR("failed to add eventfd to mainloop");
+  else
+    m_wakeup_watched = true;
+
+  // keeps a slow link from growing the outgoing queue without bound
+  cJSON const* conf = m_listener->config();
+  m_max_request_size = JsonWrapper::getInt(conf, "max-request-size", false, kDefaultMaxRequestSize);
+
+  m_outgoing_queue.set_limits(
+    JsonWrapper::getInt(conf, "outgoing-max-bytes", false, 65536),
+    JsonWrapper::getInt(conf, "outgoing-max-records", false, 128),
+    parseOverflowPolicy(JsonWrapper::getString(conf, "outgoing-policy", false, "drop-oldest")));
+
+  if (m_notify_coalesce_ms > 0)
+  {
+    // a one-shot timer, it's only armed when there's something to send
+    m_timeout_id = mainloop_add_timeout(0, &GattClient_onTimeout, this, nullptr);
+    if (m_timeout_id < 0)
+      XLOG_ERROR("failed to create coalescing timer");
+  }
+
+  // a short interval while requests are going back and forth, a long one
+  // with some slave latency once the client has gone quiet
+  m_idle_ms = JsonWrapper::getInt(conf, "/connection-parameters/idle-ms", false, 5000);
+  if (m_idle_ms > 0 && m_conn_handle != 0xffff)
+  {
+    m_active_params = parseConnectionParameters(conf, "active", 15, 30, 0);
+    m_idle_params = parseConnectionParameters(conf, "idle", 100, 200, 4);
+
+    // periodic, an idle link is noticed at most one period late
+    m_idle_timer_id = mainloop_add_timeout(m_idle_ms, &GattClient_onIdleCheck, this, nullptr);
+    if (m_idle_timer_id < 0)
+      XLOG_ERROR("failed to create idle timer");
+  }
+
+  if (m_conn_handle != 0xffff)
+    m_listener->requestFastLink(m_adapter, m_conn_handle);
+
+}
+
+void
+GattClient::startRelay()
+{
+  // bt_att keeps the fd it was given, so the relay can only go in as the
+  // connection is made. connections made while nothing is being recorded
+  // don't pay for a copy and a wakeup per PDU
+  BtSnoopRecorder& capture = m_listener->capture();
+  if (!capture.isOpen() || !capture.enabled())
+    return;
+
+  int pair[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0)
+  {
+    XLOG_WARN("failed to create capture relay for %s. %s", m_remote_address.c_str(), strerror(errno));
+    return;
+  }
+
+  CaptureRelay* relay = new CaptureRelay(&capture, m_conn_handle, m_fd, pair[1]);
+  if (mainloop_add_fd(m_fd, EPOLLIN, &CaptureRelay_onEvent, relay, nullptr) < 0)
+  {
+    XLOG_WARN("failed to add %s to mainloop, not capturing", m_remote_address.c_str());
+    delete relay;
+    close(pair[0]);
+    close(pair[1]);
+    return;
+  }
+
+  if (mainloop_add_fd(pair[1], EPOLLIN, &CaptureRelay_onEvent, relay, nullptr) < 0)
+  {
+    XLOG_WARN("failed to add capture relay to mainloop, not capturing %s", m_remote_address.c_str());
+    mainloop_remove_fd(m_fd);
+    delete relay;
+    close(pair[0]);
+    close(pair[1]);
+    return;
+  }
+
+  // the relay closes the link once bt_att lets go of its end
+  m_att_fd = pair[0];
+  m_fd = -1;
+  m_captured = true;
+}
+
+cJSON*
+GattClient::setCapture(bool enabled)
+{
+  BtSnoopRecorder& capture = m_listener->capture();
+  if (!capture.isOpen())
+    return nullptr;
+
+  capture.setEnabled(enabled);
+
+  // only connections made while recording is on are relayed
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddBoolToObject(res, "enabled", enabled);
+  cJSON_AddBoolToObject(res, "this-connection", enabled && m_captured);
+  cJSON_AddStringToObject(res, "file", capture.path().c_str());
+  cJSON_AddNumberToObject(res, "recorded", capture.recorded());
+  cJSON_AddNumberToObject(res, "dropped", capture.dropped());
+  return res;
+}
+
+void
+GattClient::setServiceChangedConfig(uint16_t value)
+{
+  m_service_change_enabled = (value & 0x0002) != 0;
+  uint16_t handle = m_listener->serviceChangedHandle();
+  if (!m_service_change_enabled || !m_listener->databaseChanged() || !handle)
+    return;
+
+  XLOG_INFO("indicating service changed to %s", m_remote_address.c_str());
+
+  uint8_t range[4];
+  put_le16(0x0001, range);
+  put_le16(0xffff, range + 2);
+  if (!bt_gatt_server_send_indication(m_server, handle, range, sizeof(range),
+    nullptr, nullptr, nullptr))
+    XLOG_WARN("failed to indicate service changed to %s", m_remote_address.c_str());
+}
+
+void
+GattClient::onMtuExchange()
+{
+  m_mtu = bt_att_get_mtu(m_att);
+  XLOG_INFO("negotiated ATT MTU:%u with %s", m_mtu, m_remote_address.c_str());
+}
+
+void
+GattClient::onWakeup()
+{
+  uint64_t n = 0;
+  if (read(m_wakeup_fd, &n, sizeof(n)) != sizeof(n))
+    return;
+
+  if (m_outgoing_queue.size() > 0)
+    onLinkActivity();
+
+  if (m_running && !m_held_records.empty())
+  {
+    XLOG_DEBUG("handing over %zu records that %s sent before it was served", m_held_records.size(),
+      m_remote_address.c_str());
+    std::vector< std::pair<std::string, RecordCheck> > held;
+    held.swap(m_held_records);
+    for (auto const& record : held)
+      dispatchRecord(record.first.c_str(), static_cast<int>(record.first.size()), record.second);
+  }
+
+  if (!inboundPaused() && !m_deferred_writes.empty())
+  {
+    XLOG_DEBUG("sending %zu deferred write responses to %s", m_deferred_writes.size(),
+      m_remote_address.c_str());
+    for (auto const& write : m_deferred_writes)
+      gatt_db_attribute_write_result(write.first, write.second, 0);
+    m_deferred_writes.clear();
+  }
+
+  // with a coalescing window, records queued within the window share one
+  // notification
+  if (m_timeout_id != -1)
+  {
+    if (!m_timeout_armed)
+    {
+      mainloop_modify_timeout(m_timeout_id, m_notify_coalesce_ms);
+      m_timeout_armed = true;
+    }
+  }
+  else
+  {
+    sendNotification();
+  }
+}
+
+void
+GattClient::onInboxWrite(uint8_t const* value, size_t len)
+{
+  if (!value || len == 0)
+    return;
+
+  onLinkActivity();
+
+  // the rest of a record that was rejected for being too big is dropped
+  // before it's buffered, nothing else is buffered while it comes in
+  size_t skip = 0;
+  if (m_discard_remaining > 0)
+  {
+    skip = std::min(static_cast<size_t>(m_discard_remaining), len);
+    m_discard_remaining -= skip;
+  }
+  else if (m_discarding)
+  {
+    skip = findRecordDelimiter(reinterpret_cast<char const *>(value), len);
+    if (skip < len)
+    {
+      m_discarding = false;
+      m_scanner.reset();
+      skip++;
+    }
+  }
+
+  value += skip;
+  len -= skip;
+  if (len == 0)
+    return;
+
+  // the framing only switches between two records. when that's part way
+  // through what's buffered, the rest is read again the new way
+  if (atRecordBoundary())
+    takeReframe();
+
+  m_incoming_buff.insert(m_incoming_buff.end(), value, value + len);
+
+  size_t fresh = len;
+  while (fresh > 0)
+  {
+    if (m_length_prefixed)
+      readLengthPrefixed(fresh);
+    else
+      readDelimited(fresh);
   }
 }
 
-GattServer::GattServer()
-  : m_listen_fd(-1)
+bool
+GattClient::atRecordBoundary() const
 {
-  memset(&m_local_interface, 0, sizeof(m_local_interface));
+  return m_incoming_buff.empty() && !m_discarding && m_discard_remaining == 0;
 }
 
-GattServer::~GattServer()
+bool
+GattClient::takeReframe()
 {
-  if (m_listen_fd != -1)
-    close(m_listen_fd);
+  if (!m_reframe_pending.exchange(false))
+    return false;
+
+  m_length_prefixed = m_reframe_length_prefixed;
+  m_scanner.reset();
+  XLOG_INFO("reading %s records from %s", m_length_prefixed ? "length prefixed" : "delimited",
+    m_remote_address.c_str());
+  return true;
 }
 
 void
-GattServer::init(cJSON const* listenerConfig)
+GattClient::readDelimited(size_t& fresh)
 {
-  m_listen_fd = socket(PF_BLUETOOTH, SOCK_SEQPACKET, BTPROTO_L2CAP);
-  if (m_listen_fd < 0)
-    throw_errno(errno, "failed to create bluetooth socket");
-
-  bdaddr_t src_addr = {0}; // BDADDR_ANY
-
-  sockaddr_l2 srcaddr;
-  memset(&srcaddr, 0, sizeof(srcaddr));
-  srcaddr.l2_family = AF_BLUETOOTH;
-  srcaddr.l2_cid = htobs(4);
-  srcaddr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
-  bacpy(&srcaddr.l2_bdaddr, &src_addr);
-
-  int ret = bind(m_listen_fd, reinterpret_cast<sockaddr *>(&srcaddr), sizeof(srcaddr));
-  if (ret < 0)
-    throw_errno(errno, "failed to bind bluetooth socket");
-
-  bt_security btsec = {0, 0};
-  btsec.level = BT_SECURITY_LOW;
-  ret = setsockopt(m_listen_fd, SOL_BLUETOOTH, BT_SECURITY, &btsec, sizeof(btsec));
-  if (ret < 0)
-    throw_errno(errno, "failed to set security on bluetooth socket");
+  // only scan what just arrived, the bytes buffered before it are a
+  // partial record without a delimiter. the scanner already checked those
+  // and picks up where it left off
+  char* begin = m_incoming_buff.data();
+  char* end = begin + m_incoming_buff.size();
+  char* scan = end - fresh;
+  fresh = 0;
+
+  while (fresh == 0 && scan < end)
+  {
+    size_t i = m_scanner.scan(scan, end - scan);
+    if (i == static_cast<size_t>(end - scan))
+      break;
+
+    // records are handed over in place, null terminated over the delimiter
+    char* p = scan + i;
+    *p = '\0';
+    if (p > begin)
+      dispatchRecord(begin, static_cast<int>(p - begin), m_scanner.check());
+    m_scanner.reset();
+    begin = p + 1;
+    scan = begin;
+
+    if (takeReframe())
+      fresh = static_cast<size_t>(end - begin);
+  }
 
-  ret = listen(m_listen_fd, 2);
-  if (ret < 0)
-    throw_errno(errno, "failed to listen on bluetooth socket");
+  m_incoming_buff.erase(m_incoming_buff.begin(), m_incoming_buff.begin() + (begin - m_incoming_buff.data()));
 
-  startBeacon(listenerConfig);
+  // no need to wait for the delimiter, hand over what's there so it gets
+  // rejected and drop the rest of the record as it comes in
+  if (fresh == 0 && static_cast<int>(m_incoming_buff.size()) > m_max_request_size)
+  {
+    XLOG_WARN("record from %s exceeds max size of %d bytes without delimiter", m_remote_address.c_str(),
+      m_max_request_size);
+    dispatchRecord(m_incoming_buff.data(), static_cast<int>(m_incoming_buff.size()), RecordCheck::Oversized);
+    m_incoming_buff.clear();
+    m_scanner.reset();
+    m_discarding = true;
+  }
 }
 
-std::shared_ptr<RpcConnectedClient>
-GattServer::accept(DeviceInfoProvider const& deviceInfoProvider, RdkDiagProvider const& rdkDiagProvider)
+void
+GattClient::readLengthPrefixed(size_t& fresh)
 {
-  mainloop_init();
+  // the spare byte at the end lets the last record be null terminated in
+  // place like the others
+  m_incoming_buff.push_back('\0');
 
-  sockaddr_l2 peer_addr;
-  memset(&peer_addr, 0, sizeof(peer_addr));
+  char* begin = m_incoming_buff.data();
+  char* end = begin + m_incoming_buff.size() - 1;
+  fresh = 0;
 
-  XLOG_INFO("waiting for incoming BLE connections");
+  while (fresh == 0 && begin < end)
+  {
+    uint32_t n = 0;
+    int header = getVarint(begin, end - begin, n);
+    if (header == 0)
+      break;
 
-  socklen_t n = sizeof(peer_addr);
-  int soc = ::accept(m_listen_fd, reinterpret_cast<sockaddr *>(&peer_addr), &n);
-  if (soc < 0)
-    throw_errno(errno, "failed to accept incoming connection on bluetooth socket");
+    // there's no way to find the next record after a bad header
+    if (header < 0)
+    {
+      XLOG_WARN("invalid record length from %s, dropping %zd buffered bytes",
+        m_remote_address.c_str(), end - begin);
+      begin = end;
+      break;
+    }
 
-  char remote_address[64] = {0};
-  ba2str(&peer_addr.l2_bdaddr, remote_address);
-  XLOG_INFO("accepted remote connection from:%s", remote_address);
+    size_t available = static_cast<size_t>(end - begin - header);
+    if (n > static_cast<uint32_t>(m_max_request_size))
+    {
+      XLOG_WARN("%u byte record from %s, max size is %d", n, m_remote_address.c_str(), m_max_request_size);
+      size_t k = std::min(static_cast<size_t>(n), available);
+      dispatchRecord(begin + header, static_cast<int>(k), RecordCheck::Oversized);
+      m_discard_remaining = n - k;
+      begin += header + k;
+    }
+    else
+    {
+      if (available < n)
+        break;
+
+      char* record = begin + header;
+      char saved = record[n];
+      record[n] = '\0';
+      if (n > 0)
+        dispatchRecord(record, static_cast<int>(n), RecordCheck::Unchecked);
+      record[n] = saved;
+      begin = record + n;
+    }
 
-  auto clnt = std::shared_ptr<GattClient>(new GattClient(soc));
-  clnt->init(deviceInfoProvider, rdkDiagProvider);
-  return clnt;
+    if (m_discard_remaining == 0 && takeReframe())
+      fresh = static_cast<size_t>(end - begin);
+  }
+
+  m_incoming_buff.pop_back();
+  m_incoming_buff.erase(m_incoming_buff.begin(), m_incoming_buff.begin() + (begin - m_incoming_buff.data()));
+
+  // the header of a partial record says exactly how big the buffer needs
+  // to get, so it's only allocated once
+  uint32_t n = 0;
+  int header = getVarint(m_incoming_buff.data(), m_incoming_buff.size(), n);
+  if (fresh == 0 && header > 0)
+    m_incoming_buff.reserve(header + n + 1);
 }
 
 void
-GattClient::init(DeviceInfoProvider const& deviceInfoProvider, RdkDiagProvider const& rdkDiagProvider)
+GattClient::dispatchRecord(char const* buff, int n, RecordCheck check)
 {
-  m_att = bt_att_new(m_fd, 0);
-  if (!m_att)
-  {
-    XLOG_ERROR("failed to create new att:%d", errno);
-  }
-
-  bt_att_set_close_on_unref(m_att, true);
-  bt_att_register_disconnect(m_att, &GattClient_onClientDisconnected, this, nullptr);
-  m_db = gatt_db_new();
-  if (!m_db)
+  // a central with a cached database can write before run(), and the
+  // records held from then go first
+  if (!m_running || !m_held_records.empty())
   {
-    XLOG_ERROR("failed to create gatt database");
+    m_held_records.push_back(std::make_pair(std::string(buff, n), check));
+    return;
   }
 
-  m_server = bt_gatt_server_new(m_db, m_att, m_mtu);
-  if (!m_server)
-  {
-    XLOG_ERROR("failed to create gatt server");
-  }
+  std::lock_guard<std::mutex> guard(m_data_handler_mutex);
+  if (m_data_handler)
+    m_data_handler(buff, n, check);
+  else
+    XLOG_WARN("dropping request from %s, no data handler", m_remote_address.c_str());
+}
 
-  if (true)
-  {
-    bt_att_set_debug(m_att, ATT_debugCallback, this, nullptr);
-    bt_gatt_server_set_debug(m_server, GATT_debugCallback, this, nullptr);
-  }
+void
+GattClient::setInboundPaused(bool paused)
+{
+  m_inbound_paused = paused;
 
-  m_timeout_id = mainloop_add_timeout(1000, &GattClient_onTimeout, this, nullptr);
-  buildGattDatabase(deviceInfoProvider, rdkDiagProvider);
+  // deferred write responses are sent from the mainloop thread
+  if (!paused)
+    wakeup();
 }
 
 void
-GattClient::buildGattDatabase(DeviceInfoProvider const& deviceInfoProvider, RdkDiagProvider const& rdkDiagProvider)
+GattClient::deferWriteResult(gatt_db_attribute* attr, unsigned int id)
 {
-  buildDeviceInfoService(deviceInfoProvider);
-  buildRdkDiagService(rdkDiagProvider);
+  m_deferred_writes.push_back(std::make_pair(attr, id));
 }
 
 void
-GattClient::addGattCharacteristic(
-  gatt_db_attribute* service,
-  bt_uuid_t          uuid,
-  std::string const& value)
+GattClient::onOutboxRead(gatt_db_attribute* attr, unsigned int id, uint16_t offset)
 {
-  char buff[128];
+  // a value whose length is a multiple of the slice size is followed by
+  // one more Read Blob at offset == length. it's already been released so
+  // answer with an empty value to end the long read
+  if (offset != 0 && offset == m_outbox_trailing_offset)
+  {
+    m_outbox_trailing_offset = 0;
+    gatt_db_attribute_read_result(attr, id, 0, nullptr, 0);
+    return;
+  }
 
-  gatt_db_attribute* attr = gatt_db_service_add_characteristic(service, &uuid, BT_ATT_PERM_READ,
-    BT_GATT_CHRC_PROP_READ, nullptr, nullptr, this);
+  // in push mode the bytes belong to the notification stream
+  if (pushEnabled())
+  {
+    gatt_db_attribute_read_result(attr, id, 0, nullptr, 0);
+    return;
+  }
 
-  bt_uuid_to_string(&uuid, buff, sizeof(buff));
-  if (!attr)
+  // an attribute value is at most 512 bytes, and that's where Android and
+  // iOS give up on a long read. a longer record is served as a run of
+  // values of up to that size, the client reads them in turn until it has
+  // the whole record
+  int value_size = std::min(m_outgoing_queue.front_size(), BT_ATT_MAX_VALUE_LEN);
+  if (offset > value_size)
   {
-    XLOG_CRITICAL("failed to create GATT characteristic %s", buff);
+    gatt_db_attribute_read_result(attr, id, BT_ATT_ERROR_INVALID_OFFSET, nullptr, 0);
     return;
   }
 
-  uint8_t const* p = reinterpret_cast<uint8_t const *>(value.c_str());
+  // the read response takes everything but the opcode
+  int slice_size = m_mtu - 1;
+  if (static_cast<int>(m_read_buff.size()) < slice_size)
+    m_read_buff.resize(slice_size);
 
-  XLOG_INFO("setting GATT attr:%s to %s", buff, value.c_str());
+  int n = m_outgoing_queue.peek(m_read_buff.data(), std::min(slice_size, value_size - offset), offset);
+  gatt_db_attribute_read_result(attr, id, 0, reinterpret_cast<uint8_t *>(m_read_buff.data()), n);
 
-  // I'm not sure whether i like this or just having callbacks setup for reads
-  gatt_db_attribute_write(attr, 0, p, value.length(), BT_ATT_OP_WRITE_REQ, nullptr,
-      &DIS_writeCallback, nullptr);
+  // the whole value has been read, release it and let the client know if
+  // there's more behind it
+  if (value_size > 0 && offset + n == value_size)
+  {
+    m_outgoing_queue.pop(value_size);
+    m_outbox_trailing_offset = (n == slice_size) ? value_size : 0;
+    sendNotification();
+  }
 }
 
 void
-GattClient::addGattCharacteristic(
-  gatt_db_attribute* service,
-  uint16_t           id,
-  std::string const& value)
+GattClient::setEPollConfig(uint16_t value)
 {
-  bt_uuid_t uuid;
-  bt_uuid16_create(&uuid, id);
+  XLOG_INFO("%s notifications for %s", (value & 0x0001) ? "enabling" : "disabling",
+    m_remote_address.c_str());
 
-  addGattCharacteristic(service, uuid, value);
+  m_epoll_config = value;
+
+  // anything queued before the client subscribed
+  if (m_epoll_config & 0x0001)
+    sendNotification();
 }
 
 void
-GattClient::addGattCharacteristic(
-  gatt_db_attribute* service,
-  std::string const& id,
-  std::string const& value)
+GattClient::setOutboxConfig(uint16_t value)
 {
-  bt_uuid_t uuid;
-  bt_string_to_uuid(&uuid, id.c_str());
+  if (value & 0x0002)
+    XLOG_INFO("pushing responses to %s with indications", m_remote_address.c_str());
+  else if (value & 0x0001)
+    XLOG_INFO("pushing responses to %s with notifications", m_remote_address.c_str());
+  else
+    XLOG_INFO("disabling push mode for %s", m_remote_address.c_str());
 
-  addGattCharacteristic(service, uuid, value);
+  m_outbox_config = value;
+
+  if (pushEnabled())
+    sendNotification();
 }
 
 void
-GattClient::buildDeviceInfoService(DeviceInfoProvider const& deviceInfoProvider)
+GattClient::onIndicationConfirm()
 {
-  bt_uuid_t uuid;
-  bt_uuid16_create(&uuid, kUuidDeviceInfoService);
+  // the client has the chunk, it's safe to let it go
+  m_outgoing_queue.pop(m_indication_size);
+  m_indication_size = 0;
 
-  gatt_db_attribute* service = gatt_db_add_service(m_db, &uuid, true, 30);
-
-  XLOG_INFO("\nBuilding DeviceInfo Service");
-  addGattCharacteristic(service, kUuidSystemId, deviceInfoProvider.GetSystemId());
-  addGattCharacteristic(service, kUuidModelNumber, deviceInfoProvider.GetModelNumber());
-  addGattCharacteristic(service, kUuidSerialNumber, deviceInfoProvider.GetSerialNumber());
-  addGattCharacteristic(service, kUuidFirmwareRevision, deviceInfoProvider.GetFirmwareRevision());
-  addGattCharacteristic(service, kUuidHardwareRevision, deviceInfoProvider.GetHardwareRevision());
-  addGattCharacteristic(service, kUuidSoftwareRevision, deviceInfoProvider.GetSoftwareRevision());
-  addGattCharacteristic(service, kUuidManufacturerName, deviceInfoProvider.GetManufacturerName());
-
-  gatt_db_service_set_active(service, true);
+  sendNotification();
 }
 
 void
-GattClient::buildRdkDiagService(RdkDiagProvider const& rdkDiagProvider)
+GattClient::pushOutbox()
 {
-  bt_uuid_t uuid;
-  bt_uuid16_create(&uuid, rdkDiagProvider.rdkDiagUuid);
+  // one indication is outstanding at a time, the next goes out when this
+  // one is confirmed
+  if (m_indication_size > 0)
+    return;
 
-  gatt_db_attribute* service = gatt_db_add_service(m_db, &uuid, true, 31);
+  int chunk_size = maxPayloadSize();
+  if (static_cast<int>(m_read_buff.size()) < chunk_size)
+    m_read_buff.resize(chunk_size);
 
-  XLOG_INFO("\nBuilding RdkDiag Service");
-  addGattCharacteristic(service, kUuidDeviceStatus, rdkDiagProvider.GetDeviceStatus());
-  addGattCharacteristic(service, kUuidFwDownloadStatus, rdkDiagProvider.GetFirmwareDownloadStatus());
-  addGattCharacteristic(service, kUuidWebPAStatus, rdkDiagProvider.GetWebPAStatus());
-  addGattCharacteristic(service, kUuidWiFiRadio1Status, rdkDiagProvider.GetWiFiRadio1Status());
-  addGattCharacteristic(service, kUuidWiFiRadio2Status, rdkDiagProvider.GetWiFiRadio2Status());
-  addGattCharacteristic(service, kUuidRFStatus, rdkDiagProvider.GetRFStatus());
+  uint8_t* chunk = reinterpret_cast<uint8_t *>(m_read_buff.data());
 
-  gatt_db_service_set_active(service, true);
+  // records are queued whole, so the stream can be cut anywhere and the
+  // client reassembles on kRecordDelimiter
+  int n = 0;
+  if (m_outbox_config & 0x0002)
+  {
+    n = m_outgoing_queue.peek(m_read_buff.data(), chunk_size, 0);
+    if (n > 0)
+    {
+      if (bt_gatt_server_send_indication(m_server, m_listener->outboxHandle(), chunk, n,
+        &GattClient_onIndicationConfirm, this, nullptr))
+        m_indication_size = n;
+      else
+        XLOG_WARN("failed to send indication of %d bytes to %s", n, m_remote_address.c_str());
+    }
+  }
+  else
+  {
+    while ((n = m_outgoing_queue.peek(m_read_buff.data(), chunk_size, 0)) > 0)
+    {
+      if (!bt_gatt_server_send_notification(m_server, m_listener->outboxHandle(), chunk, n))
+      {
+        XLOG_WARN("failed to send notification of %d bytes to %s", n, m_remote_address.c_str());
+        break;
+      }
+      m_outgoing_queue.pop(n);
+    }
+  }
 }
 
 void
 GattClient::onTimeout()
 {
+  m_timeout_armed = false;
+  sendNotification();
+}
+
+void
+GattClient::sendNotification()
+{
+  if (!m_server)
+    return;
+
+  if (pushEnabled())
+  {
+    pushOutbox();
+    return;
+  }
+
+  // client hasn't subscribed yet, it's notified once it does
+  if (!(m_epoll_config & 0x0001))
+    return;
+
   uint32_t bytes_available = m_outgoing_queue.size();
 
   if (bytes_available > 0)
@@ -341,8 +1858,7 @@ GattClient::onTimeout()
 
     bytes_available = htonl(bytes_available);
 
-    //uint16_t handle = gatt_db_attribute_get_handle(m_blepoll);
-    uint16_t handle = m_notify_handle;
+    uint16_t handle = m_listener->epollHandle();
     int ret = bt_gatt_server_send_notification(
       m_server,
       handle,
@@ -355,55 +1871,260 @@ GattClient::onTimeout()
         ret, bytes_available);
     }
   }
+}
+
+void
+GattClient::onLinkActivity()
+{
+  m_last_activity = std::chrono::steady_clock::now();
+  if (!m_link_active && m_idle_timer_id != -1)
+    requestConnectionParameters(true);
+}
+
+void
+GattClient::onIdleCheck()
+{
+  if (!m_link_active)
+    return;
 
-  mainloop_modify_timeout(m_timeout_id, 1000);
+  auto quiet = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - m_last_activity);
+  if (quiet.count() >= m_idle_ms)
+    requestConnectionParameters(false);
 }
 
 void
-GattClient::run()
+GattClient::requestConnectionParameters(bool active)
 {
-  m_mainloop_thread = std::this_thread::get_id();
+  // it's only asked for once per change, a central that says no isn't
+  // going to change its mind on the next request
+  m_link_active = active;
 
-  sigset_t mask;
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGINT);
-  sigaddset(&mask, SIGTERM);
+  ConnectionParameters const& params = active ? m_active_params : m_idle_params;
+  XLOG_INFO("requesting %s connection parameters for %s, interval %.2f-%.2f ms latency %u timeout %u ms",
+    active ? "active" : "idle", m_remote_address.c_str(), params.MinInterval * 1.25,
+    params.MaxInterval * 1.25, params.Latency, params.SupervisionTimeout * 10);
 
-  mainloop_run();
+  if (!m_listener->requestConnectionUpdate(m_adapter, m_conn_handle, params))
+    XLOG_WARN("failed to request connection parameters for %s", m_remote_address.c_str());
 }
 
-GattClient::GattClient(int fd)
+void
+GattClient::onLinkEvent(LinkEvent const& event)
+{
+  if (event.Status)
+  {
+    XLOG_WARN("%s for %s failed, status:0x%02x", event.Kind == LinkEvent::Type::PhyUpdate
+      ? "PHY update" : "connection update", m_remote_address.c_str(), event.Status);
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(m_link_mutex);
+  if (event.Kind == LinkEvent::Type::ConnectionUpdate)
+  {
+    XLOG_INFO("connection parameters for %s now interval %.2f ms latency %u timeout %u ms",
+      m_remote_address.c_str(), event.Interval * 1.25, event.Latency, event.SupervisionTimeout * 10);
+    m_link_state.Interval = event.Interval;
+    m_link_state.Latency = event.Latency;
+    m_link_state.SupervisionTimeout = event.SupervisionTimeout;
+  }
+  else if (event.Kind == LinkEvent::Type::DataLengthChange)
+  {
+    XLOG_INFO("data length for %s now tx %u octets %u us, rx %u octets %u us", m_remote_address.c_str(),
+      event.TxOctets, event.TxTime, event.RxOctets, event.RxTime);
+    m_link_state.TxOctets = event.TxOctets;
+    m_link_state.TxTime = event.TxTime;
+    m_link_state.RxOctets = event.RxOctets;
+    m_link_state.RxTime = event.RxTime;
+  }
+  else if (event.Kind == LinkEvent::Type::PhyUpdate)
+  {
+    XLOG_INFO("PHY for %s now tx %s rx %s", m_remote_address.c_str(), phyName(event.TxPhy),
+      phyName(event.RxPhy));
+    m_link_state.TxPhy = event.TxPhy;
+    m_link_state.RxPhy = event.RxPhy;
+  }
+}
+
+cJSON*
+GattClient::linkStats() const
+{
+  cJSON* stats = cJSON_CreateObject();
+
+  std::lock_guard<std::mutex> guard(m_link_mutex);
+  cJSON_AddStringToObject(stats, "transport", "gatt");
+  if (m_adapter >= 0)
+    cJSON_AddNumberToObject(stats, "hci-device-id", m_listener->adapterDeviceId(m_adapter));
+
+  // the interval isn't known until the first update of this connection
+  if (m_link_state.Interval)
+  {
+    cJSON_AddNumberToObject(stats, "interval-ms", m_link_state.Interval * 1.25);
+    cJSON_AddNumberToObject(stats, "latency", m_link_state.Latency);
+    cJSON_AddNumberToObject(stats, "supervision-timeout-ms", m_link_state.SupervisionTimeout * 10);
+  }
+  cJSON_AddNumberToObject(stats, "tx-octets", m_link_state.TxOctets);
+  cJSON_AddNumberToObject(stats, "tx-time-us", m_link_state.TxTime);
+  cJSON_AddNumberToObject(stats, "rx-octets", m_link_state.RxOctets);
+  cJSON_AddNumberToObject(stats, "rx-time-us", m_link_state.RxTime);
+  cJSON_AddStringToObject(stats, "tx-phy", phyName(m_link_state.TxPhy));
+  cJSON_AddStringToObject(stats, "rx-phy", phyName(m_link_state.RxPhy));
+
+  // what the outgoing queue's overflow policy has had to do so far
+  memory_stream_stats queued = m_outgoing_queue.stats();
+  cJSON* outgoing = cJSON_CreateObject();
+  cJSON_AddNumberToObject(outgoing, "queued-bytes", m_outgoing_queue.size());
+  cJSON_AddNumberToObject(outgoing, "blocked", queued.blocked);
+  cJSON_AddNumberToObject(outgoing, "dropped", queued.dropped);
+  cJSON_AddNumberToObject(outgoing, "replaced", queued.replaced);
+  cJSON_AddItemToObject(stats, "outgoing-queue", outgoing);
+  return stats;
+}
+
+void
+GattClient::run()
+{
+  // all connections are serviced from the GattServer's mainloop thread.
+  // the client is attached there before accept() hands it out, so anything
+  // that arrived since is waiting for this
+  m_running = true;
+  wakeup();
+}
+
+GattClient::GattClient(GattServer* listener, int fd, std::string const& remoteAddress, int adapter)
   : RpcConnectedClient()
+  , m_listener(listener)
+  , m_adapter(adapter)
+  , m_remote_address(remoteAddress)
   , m_fd(fd)
+  , m_att_fd(fd)
+  , m_captured(false)
   , m_att(nullptr)
-  , m_db(nullptr)
   , m_server(nullptr)
-  , m_mtu(16)
+  , m_mtu(BT_ATT_DEFAULT_LE_MTU)
   , m_outgoing_queue(kRecordDelimiter)
   , m_incoming_buff()
-  , m_data_channel(nullptr)
-  , m_blepoll(nullptr)
+  , m_epoll_config(0)
+  , m_read_buff()
+  , m_outbox_trailing_offset(0)
+  , m_max_request_size(kDefaultMaxRequestSize)
+  , m_discarding(false)
+  , m_scanner()
+  , m_length_prefixed(false)
+  , m_reframe_pending(false)
+  , m_reframe_length_prefixed(false)
+  , m_discard_remaining(0)
+  , m_inbound_paused(false)
+  , m_deferred_writes()
+  , m_outbox_config(0)
+  , m_indication_size(0)
   , m_service_change_enabled(false)
   , m_timeout_id(-1)
+  , m_timeout_armed(false)
+  , m_notify_coalesce_ms(0)
+  , m_wakeup_fd(-1)
+  , m_wakeup_watched(false)
   , m_mainloop_thread()
+  , m_data_handler_mutex()
   , m_data_handler(nullptr)
+  , m_running(false)
+  , m_held_records()
+  , m_connected_at(std::chrono::steady_clock::now())
+  , m_first_send_done(false)
+  , m_conn_handle(0xffff)
+  , m_active_params()
+  , m_idle_params()
+  , m_idle_ms(0)
+  , m_idle_timer_id(-1)
+  , m_link_active(false)
+  , m_last_activity()
+  , m_link_mutex()
+  , m_link_state()
 {
+  // what every LE link starts out with until the controller says otherwise
+  m_link_state.TxOctets = 27;
+  m_link_state.TxTime = 328;
+  m_link_state.RxOctets = 27;
+  m_link_state.RxTime = 328;
+  m_link_state.TxPhy = 1;
+  m_link_state.RxPhy = 1;
 }
 
 GattClient::~GattClient()
 {
-  if (m_fd != -1)
-    close(m_fd);
+  release();
+
+  // closed here rather than in release(), enqueueForSend may still be
+  // signalling it from another thread until the last reference goes away
+  if (m_wakeup_fd != -1)
+    close(m_wakeup_fd);
+}
+
+void
+GattClient::release()
+{
+  // a producer blocked on a full queue would otherwise wait forever
+  m_outgoing_queue.close();
+
+  if (m_timeout_id != -1)
+  {
+    mainloop_remove_timeout(m_timeout_id);
+    m_timeout_id = -1;
+  }
+
+  if (m_idle_timer_id != -1)
+  {
+    mainloop_remove_timeout(m_idle_timer_id);
+    m_idle_timer_id = -1;
+  }
+
+  // release() runs again from the destructor, which may be on another
+  // thread, and the mainloop isn't thread safe
+  if (m_wakeup_watched)
+  {
+    mainloop_remove_fd(m_wakeup_fd);
+    m_wakeup_watched = false;
+  }
 
   if (m_server)
+  {
     bt_gatt_server_unref(m_server);
+    m_server = nullptr;
+  }
 
-  if (m_db)
-    gatt_db_unref(m_db);
+  // the att owns the fd it was given, close_on_unref is set
+  if (m_att)
+  {
+    bt_att_unref(m_att);
+    m_att = nullptr;
+    if (m_att_fd == m_fd)
+      m_fd = -1;
+    m_att_fd = -1;
+  }
+
+  if (m_fd != -1)
+  {
+    close(m_fd);
+    m_fd = -1;
+  }
 }
 
 void
 GattClient::enqueueForSend(char const* buff, int n)
+{
+  if (!buff || n <= 0)
+  {
+    enqueueForSend(std::shared_ptr<char const>(), n);
+    return;
+  }
+
+  std::shared_ptr<char> copy(new char[n], std::default_delete<char[]>());
+  memcpy(copy.get(), buff, n);
+  enqueueForSend(copy, n);
+}
+
+void
+GattClient::enqueueForSend(std::shared_ptr<char const> const& buff, int n)
 {
   if (!buff)
   {
@@ -418,14 +2139,86 @@ GattClient::enqueueForSend(char const* buff, int n)
   }
 
   m_outgoing_queue.put_line(buff, n);
+  wakeup();
+
+  if (!m_first_send_done.exchange(true))
+  {
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - m_connected_at);
+    XLOG_INFO("first response for %s queued %lld ms after connect",
+      m_remote_address.c_str(), static_cast<long long>(elapsed.count()));
+  }
+}
+
+void
+GattClient::enqueueError(std::shared_ptr<char const> const& buff, int n)
+{
+  if (!buff || n <= 0)
+  {
+    XLOG_WARN("invalid buffer length:%d", n);
+    return;
+  }
+
+  // called from onInboxWrite() on the mainloop, which is what drains the
+  // queue
+  m_outgoing_queue.put_line_now(buff, n);
+  wakeup();
+}
+
+void
+GattClient::enqueueWithFraming(std::shared_ptr<char const> const& buff, int n, RecordFraming framing)
+{
+  if (!buff || n <= 0)
+  {
+    XLOG_WARN("invalid buffer length:%d", n);
+    return;
+  }
+
+  // onInboxWrite() picks the switch up on the mainloop, it's posted
+  // before the reply can go out
+  bool length_prefixed = (framing == RecordFraming::LengthPrefixed);
+  m_reframe_length_prefixed = length_prefixed;
+  m_reframe_pending = true;
+  m_outgoing_queue.put_line_and_reframe(buff, n, length_prefixed);
+  wakeup();
+
+  XLOG_INFO("sending %s records to %s", length_prefixed ? "length prefixed" : "delimited",
+    m_remote_address.c_str());
+}
+
+void
+GattClient::enqueueNotification(std::shared_ptr<char const> const& buff, int n, std::string const& key)
+{
+  if (!buff || n <= 0)
+  {
+    XLOG_WARN("invalid notification buffer length:%d", n);
+    return;
+  }
+
+  if (m_outgoing_queue.put_notification(buff, n, key))
+    wakeup();
+  else
+    XLOG_DEBUG("dropped notification %s for %s", key.c_str(), m_remote_address.c_str());
+}
+
+void
+GattClient::wakeup()
+{
+  uint64_t one = 1;
+  if (m_wakeup_fd != -1 && write(m_wakeup_fd, &one, sizeof(one)) != sizeof(one))
+    XLOG_WARN("failed to wake mainloop for %s. %s", m_remote_address.c_str(), strerror(errno));
 }
 
 void
 GattClient::onClientDisconnected(int err)
 {
-  // TODO: we should stash the remote client as a member of the
-  // GattClient so we can print out mac addres of client that
-  // just disconnected
-  XLOG_INFO("disconnect:%d", err);
-  mainloop_quit();
+  memory_stream_stats stats = m_outgoing_queue.stats();
+  XLOG_INFO("disconnect:%d from:%s blocked:%llu dropped:%llu replaced:%llu", err, m_remote_address.c_str(),
+    static_cast<unsigned long long>(stats.blocked),
+    static_cast<unsigned long long>(stats.dropped),
+    static_cast<unsigned long long>(stats.replaced));
+
+  // other connections share the mainloop, just tear down this one
+  release();
+  m_listener->onClientDisconnected(this);
 }
@@ -16,12 +16,21 @@
 #ifndef __GATT_SERVER_H__
 #define __GATT_SERVER_H__
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <list>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <queue>
 #include <thread>
 #include <vector>
 #include <sstream>
 
+#include "beacon.h"
+#include "btsnoop.h"
+#include "l2capserver.h"
 #include "memory_stream.h"
 #include "../rpcserver.h"
 
@@ -38,45 +47,154 @@ extern "C"
 #include <cJSON.h>
 
 struct gatt_db_attribute;
+class GattServer;
 
 class GattClient : public RpcConnectedClient
 {
 public:
-  GattClient(int fd);
+  GattClient(GattServer* listener, int fd, std::string const& remoteAddress, int adapter);
   virtual ~GattClient();
 
   virtual void init(DeviceInfoProvider const& deviceInfoProvider, RdkDiagProvider const& rdkDiagProvider) override;
-  virtual void enqueueForSend(char const* buff, int n) override; 
+  virtual void enqueueForSend(char const* buff, int n) override;
+  virtual void enqueueForSend(std::shared_ptr<char const> const& buff, int n) override;
+  virtual void enqueueError(std::shared_ptr<char const> const& buff, int n) override;
+  virtual void enqueueNotification(std::shared_ptr<char const> const& buff, int n,
+    std::string const& key) override;
   virtual void run() override;
   virtual void setDataHandler(RpcDataHandler const& handler) override
-    { m_data_handler = handler; }
+  {
+    std::lock_guard<std::mutex> guard(m_data_handler_mutex);
+    m_data_handler = handler;
+  }
+  virtual void setInboundPaused(bool paused) override;
+  virtual bool supportsFraming(RecordFraming framing) const override
+    { return framing != RecordFraming::Packet; }
+  virtual void enqueueWithFraming(std::shared_ptr<char const> const& buff, int n,
+    RecordFraming framing) override;
+  virtual cJSON* linkStats() const override;
+  virtual cJSON* setCapture(bool enabled) override;
 
   void onTimeout();
+  void onWakeup();
+  void onMtuExchange();
+  void onInboxWrite(uint8_t const* value, size_t len);
+  void onOutboxRead(gatt_db_attribute* attr, unsigned int id, uint16_t offset);
+  // write responses are also held until run(), there's no one to take
+  // the requests before that
+  bool inboundPaused() const
+    { return m_inbound_paused || !m_running; }
+  void deferWriteResult(gatt_db_attribute* attr, unsigned int id);
   void onClientDisconnected(int err);
+  uint16_t epollConfig() const
+    { return m_epoll_config; }
+  void setEPollConfig(uint16_t value);
+  uint16_t outboxConfig() const
+    { return m_outbox_config; }
+  void setOutboxConfig(uint16_t value);
+  void onIndicationConfirm();
+  void onIdleCheck();
+  void onLinkEvent(LinkEvent const& event);
+  uint16_t connectionHandle() const
+    { return m_conn_handle; }
+
+  // index into the listener's adapters, -1 for a loopback connection
+  int adapter() const
+    { return m_adapter; }
+
+  // largest value that fits in a single notification or read response,
+  // the ATT opcode and handle take the other 3 bytes
+  uint16_t maxPayloadSize() const
+    { return m_mtu - 3; }
+
+  bt_att* att() const
+    { return m_att; }
+  uint16_t serviceChangedConfig() const
+    { return m_service_change_enabled ? 0x0002 : 0x0000; }
+  void setServiceChangedConfig(uint16_t value);
 
 private:
-  void buildGattDatabase(DeviceInfoProvider const& deviceInfoProvider, RdkDiagProvider const& rdkDiagProvider);
-  void addGattCharacteristic(gatt_db_attribute* service, bt_uuid_t uuid, std::string const& value);
-  void addGattCharacteristic(gatt_db_attribute* service, uint16_t id, std::string const& value);
-  void addGattCharacteristic(gatt_db_attribute* service, std::string const& id, std::string const& value);
-  void buildDeviceInfoService(DeviceInfoProvider const& deviceInfoProvider);
-  void buildRdkDiagService(RdkDiagProvider const& rdkDiagProvider);
+  void release();
+  void startRelay();
+  void sendNotification();
+  void pushOutbox();
+  void wakeup();
+  void onLinkActivity();
+  void requestConnectionParameters(bool active);
+  bool atRecordBoundary() const;
+  bool takeReframe();
+  void readDelimited(size_t& fresh);
+  void readLengthPrefixed(size_t& fresh);
+  void dispatchRecord(char const* buff, int n, RecordCheck check);
+
+  // the client subscribed to the outbox, responses are streamed in
+  // notifications or indications rather than announced on the epoll
+  bool pushEnabled() const
+    { return (m_outbox_config & 0x0003) || m_indication_size > 0; }
 
 private:
+  GattServer*         m_listener;
+  int                 m_adapter;
+  std::string         m_remote_address;
   int                 m_fd;
+
+  // bt_att's end of the connection. it's m_fd unless captures are on,
+  // then it's one end of a socketpair. a CaptureRelay takes over m_fd and
+  // the other end, and passes every PDU between them
+  int                 m_att_fd;
+  bool                m_captured;
   bt_att*             m_att;
-  gatt_db*            m_db;
   bt_gatt_server*     m_server;
   uint16_t            m_mtu;
   memory_stream       m_outgoing_queue;
   std::vector<char>   m_incoming_buff;
-  gatt_db_attribute*  m_data_channel;
-  gatt_db_attribute*  m_blepoll;
-  uint16_t            m_notify_handle;
+  uint16_t            m_epoll_config;
+  std::vector<char>   m_read_buff;
+  int                 m_outbox_trailing_offset;
+  int                 m_max_request_size;
+  bool                m_discarding;
+  RecordScanner       m_scanner;
+  bool                m_length_prefixed;
+
+  // a switch of inbound framing from enqueueWithFraming(), made by the
+  // mainloop at the next record boundary
+  std::atomic<bool>   m_reframe_pending;
+  std::atomic<bool>   m_reframe_length_prefixed;
+  uint32_t            m_discard_remaining;
+  std::atomic<bool>   m_inbound_paused;
+  std::vector< std::pair<gatt_db_attribute*, unsigned int> > m_deferred_writes;
+  uint16_t            m_outbox_config;
+  int                 m_indication_size;
   bool                m_service_change_enabled;
   int                 m_timeout_id;
+  bool                m_timeout_armed;
+  int                 m_notify_coalesce_ms;
+  int                 m_wakeup_fd;
+
+  // the eventfd is in the mainloop until release(), it's only closed by
+  // the destructor
+  bool                m_wakeup_watched;
   std::thread::id     m_mainloop_thread;
+  std::mutex          m_data_handler_mutex;
   RpcDataHandler      m_data_handler;
+
+  // records that came in before run(), the data handler may not be set
+  // yet. onWakeup() hands them over once it is
+  std::atomic<bool>   m_running;
+  std::vector< std::pair<std::string, RecordCheck> > m_held_records;
+  std::chrono::steady_clock::time_point m_connected_at;
+  std::atomic<bool>   m_first_send_done;
+  uint16_t            m_conn_handle;
+  ConnectionParameters m_active_params;
+  ConnectionParameters m_idle_params;
+  int                 m_idle_ms;
+  int                 m_idle_timer_id;
+  bool                m_link_active;
+  std::chrono::steady_clock::time_point m_last_activity;
+
+  // the latest values the controller reported for this link
+  mutable std::mutex  m_link_mutex;
+  LinkEvent           m_link_state;
 };
 
 class GattServer : public RpcListener
@@ -89,9 +207,103 @@ public:
   virtual std::shared_ptr<RpcConnectedClient>
     accept(DeviceInfoProvider const& deviceInfoProvider, RdkDiagProvider const& rdkDiagProvider) override;
 
+  // serves the GATT db on connections the caller sets up, with no adapter,
+  // advertising or mainloop thread. the caller runs the mainloop. used by
+  // the ATT loopback benchmark
+  void initLoopback(cJSON const* conf, DeviceInfoProvider const& deviceInfoProvider,
+    RdkDiagProvider const& rdkDiagProvider);
+
+  // serves ATT on an already connected SEQPACKET socket, fd is owned by
+  // the client from here on. adapter is -1 when it didn't come from one
+  std::shared_ptr<GattClient> attach(int fd, std::string const& remoteAddress, int adapter);
+
+  void onIncomingConnection(int fd);
+  void onClientDisconnected(GattClient* clnt);
+  void onLinkEvent(int fd);
+  bool requestConnectionUpdate(int adapter, uint16_t handle, ConnectionParameters const& params);
+  void requestFastLink(int adapter, uint16_t handle);
+  int adapterDeviceId(int adapter) const
+    { return adapter >= 0 ? m_adapters[adapter].DeviceId : -1; }
+
+  GattClient* findClient(bt_att* att) const;
+  cJSON const* config() const
+    { return m_listener_config; }
+
+  // the one db every connection's gatt server serves, and the handles of
+  // the values that are notified or indicated
+  gatt_db* database() const
+    { return m_db; }
+  uint16_t epollHandle() const
+    { return m_epoll_handle; }
+  uint16_t outboxHandle() const
+    { return m_outbox_handle; }
+  uint16_t serviceChangedHandle() const
+    { return m_service_changed_handle; }
+  uint8_t const* databaseHash() const
+    { return m_db_hash; }
+
+  // whether the layout differs from the one the last run served, the hash
+  // is kept in gatt-hash-file
+  bool databaseChanged() const
+    { return m_db_changed; }
+
+  // every connection records into the one capture, when btsnoop-file is set
+  BtSnoopRecorder& capture()
+    { return m_capture; }
+
+  // zero when there's no L2CAP listener
+  uint16_t bulkPsm() const
+    { return m_bulk_listener ? m_bulk_listener->psm() : 0; }
+
+private:
+  // a controller from hci-device-ids with its own ATT listen socket and
+  // advertiser. connection handles are only unique per controller
+  struct GattAdapter
+  {
+    int               DeviceId;
+    int               ListenFd;
+    int               LinkFd;
+    LinkCapabilities  Caps;
+    bool              DataLengthEnabled;
+    bool              Phy2MEnabled;
+  };
+
+  void initAdapter(GattAdapter& adapter);
+  void acceptBulkClients();
+  void buildGattDatabase();
+  void checkDatabaseHash();
+  void addGattCharacteristic(gatt_db_attribute* service, bt_uuid_t uuid, std::string const& value);
+  void addGattCharacteristic(gatt_db_attribute* service, uint16_t id, std::string const& value);
+  void addGattCharacteristic(gatt_db_attribute* service, std::string const& id, std::string const& value);
+  void addGattCharacteristic(gatt_db_attribute* service, std::string const& id,
+    std::function< std::string () > const* getter);
+  void buildDeviceInfoService(DeviceInfoProvider const& deviceInfoProvider);
+  void buildRdkDiagService(RdkDiagProvider const& rdkDiagProvider);
+  void buildRpcService();
+  void buildGattService();
+  void initCapture();
+
 private:
-  int             m_listen_fd;
-  bdaddr_t        m_local_interface;
+  std::vector<GattAdapter> m_adapters;
+  int                 m_wakeup_fd;
+  gatt_db*            m_db;
+  uint16_t            m_epoll_handle;
+  uint16_t            m_outbox_handle;
+  uint16_t            m_service_changed_handle;
+  uint8_t             m_db_hash[16];
+  bool                m_db_changed;
+  bdaddr_t            m_local_interface;
+  cJSON*              m_listener_config;
+  DeviceInfoProvider  m_device_info_provider;
+  RdkDiagProvider     m_rdk_diag_provider;
+  std::thread         m_mainloop_thread;
+  std::mutex          m_mutex;
+  std::condition_variable m_cond;
+  std::map< GattClient*, std::shared_ptr<GattClient> > m_clients;
+  std::queue< std::shared_ptr<RpcConnectedClient> > m_accepted;
+  std::shared_ptr<L2capServer> m_bulk_listener;
+  std::thread         m_bulk_accept_thread;
+  BtSnoopRecorder     m_capture;
 };
 
 #endif
@@ -0,0 +1,116 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "l2capserver.h"
+#include "../defs.h"
+#include "../logger.h"
+#include "../util.h"
+#include "../jsonwrapper.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+extern "C"
+{
+#include <lib/bluetooth.h>
+#include <lib/l2cap.h>
+}
+
+namespace
+{
+  // largest SDU an LE credit based channel can carry
+  int const kMaxSduSize {65535};
+}
+
+L2capServer::L2capServer()
+  : SocketServer()
+  , m_psm(0)
+{
+}
+
+L2capServer::~L2capServer()
+{
+}
+
+int
+L2capServer::createListenSocket(cJSON const* listenerConfig)
+{
+  int psm = JsonWrapper::getInt(listenerConfig, "l2cap-psm", false, 0);
+
+  int soc = socket(PF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, BTPROTO_L2CAP);
+  if (soc < 0)
+    throw_errno(errno, "failed to create l2cap socket");
+
+  bdaddr_t src_addr = {0}; // BDADDR_ANY
+
+  // an LE address with no cid is a credit based channel, a psm of zero has
+  // the kernel hand out a free one from the dynamic range
+  sockaddr_l2 srcaddr;
+  memset(&srcaddr, 0, sizeof(srcaddr));
+  srcaddr.l2_family = AF_BLUETOOTH;
+  srcaddr.l2_psm = htobs(static_cast<uint16_t>(psm));
+  srcaddr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
+  bacpy(&srcaddr.l2_bdaddr, &src_addr);
+
+  int ret = bind(soc, reinterpret_cast<sockaddr *>(&srcaddr), sizeof(srcaddr));
+  if (ret < 0)
+  {
+    int err = errno;
+    close(soc);
+    throw_errno(err, "failed to bind l2cap socket to psm %d", psm);
+  }
+
+  bt_security btsec = {0, 0};
+  btsec.level = BT_SECURITY_LOW;
+  ret = setsockopt(soc, SOL_BLUETOOTH, BT_SECURITY, &btsec, sizeof(btsec));
+  if (ret < 0)
+  {
+    int err = errno;
+    close(soc);
+    throw_errno(err, "failed to set security on l2cap socket");
+  }
+
+  // a whole request has to fit in one SDU. accepted channels inherit this
+  uint16_t mtu = static_cast<uint16_t>(std::min(maxRecordSize(), kMaxSduSize));
+  ret = setsockopt(soc, SOL_BLUETOOTH, BT_RCVMTU, &mtu, sizeof(mtu));
+  if (ret < 0)
+    XLOG_WARN("failed to set l2cap receive mtu to %d. %s", static_cast<int>(mtu), strerror(errno));
+
+  ret = listen(soc, 2);
+  if (ret < 0)
+  {
+    int err = errno;
+    close(soc);
+    throw_errno(err, "failed to listen on l2cap socket");
+  }
+
+  socklen_t n = sizeof(srcaddr);
+  memset(&srcaddr, 0, sizeof(srcaddr));
+  if (getsockname(soc, reinterpret_cast<sockaddr *>(&srcaddr), &n) < 0)
+  {
+    int err = errno;
+    close(soc);
+    throw_errno(err, "failed to get l2cap socket address");
+  }
+
+  m_psm = btohs(srcaddr.l2_psm);
+  XLOG_INFO("listening for rpc clients on l2cap psm 0x%04x, mtu %d", m_psm, static_cast<int>(mtu));
+
+  return soc;
+}
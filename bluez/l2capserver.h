@@ -0,0 +1,45 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __L2CAP_SERVER_H__
+#define __L2CAP_SERVER_H__
+
+#include <stdint.h>
+
+#include "../socket/socketserver.h"
+
+// LE credit based L2CAP channels. each SDU is one record and the kernel
+// takes care of segmentation and flow control, so a record goes out in as
+// many back to back PDUs as the credits allow rather than one notification
+// or read per connection interval. the PSM is picked by the kernel unless
+// listener.l2cap-psm asks for one, GattServer publishes it in the rpc
+// service
+class L2capServer : public SocketServer
+{
+public:
+  L2capServer();
+  virtual ~L2capServer();
+
+  uint16_t psm() const
+    { return m_psm; }
+
+protected:
+  virtual int createListenSocket(cJSON const* conf) override;
+
+private:
+  uint16_t m_psm;
+};
+
+#endif
@@ -13,75 +13,365 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 //
-#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <string>
 #include <string.h>
+#include <stdint.h>
+
+#include "../defs.h"
+#include "../util.h"
 
 #ifndef __MEMORY_STREAM_H__
 #define __MEMORY_STREAM_H__
 
+// a queue of delimited records kept as a chain of reference counted
+// segments. records handed over as a shared buffer are queued without a
+// copy, the delimiter is implied at the end of each segment rather than
+// written into it so the same buffer can be queued on several streams.
+// once the stream is length prefixed each segment carries a varint header
+// instead of the delimiter
+//
+// the stream can be given a byte and record budget. what happens once it's
+// spent depends on the overflow_policy, but responses are never dropped
+// and bytes already handed out by peek() are never dropped or replaced
+enum class overflow_policy
+{
+  // the producer waits until the consumer makes room
+  block,
+
+  // the oldest queued notifications are dropped to make room
+  drop_oldest,
+
+  // a queued notification with the same key is overwritten in place,
+  // otherwise same as drop_oldest
+  replace
+};
+
+struct memory_stream_stats
+{
+  uint64_t blocked;
+  uint64_t dropped;
+  uint64_t replaced;
+};
+
 class memory_stream
 {
 public:
   memory_stream(char delim)
-    : m_stream()
+    : m_segments()
+    , m_head_offset(0)
+    , m_peek_end(0)
+    , m_size(0)
     , m_mutex()
+    , m_cond()
     , m_delimiter(delim)
+    , m_length_prefixed(false)
+    , m_max_bytes(0)
+    , m_max_records(0)
+    , m_policy(overflow_policy::drop_oldest)
+    , m_closed(false)
+    , m_stats{0, 0, 0}
+  {
+  }
+
+  // zero means unlimited
+  void set_limits(int max_bytes, int max_records, overflow_policy policy)
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_max_bytes = max_bytes;
+    m_max_records = max_records;
+    m_policy = policy;
+  }
+
+  // wakes up any blocked producer, nothing is queued after this
+  void close()
   {
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      m_closed = true;
+    }
+    m_cond.notify_all();
   }
 
+  memory_stream_stats stats() const
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    return m_stats;
+  }
 
+  // consume up to n bytes
   int get_line(char* s, int n)
   {
     int bytes_read = 0;
-
-    std::lock_guard<std::mutex> guard(m_mutex);
-    while (!m_stream.empty() && (bytes_read < n))
     {
-      s[bytes_read++] = m_stream.front();
-      m_stream.pop();
+      std::lock_guard<std::mutex> guard(m_mutex);
+      bytes_read = copy_out(s, n, 0);
+      consume(bytes_read);
     }
-
+    m_cond.notify_all();
     return bytes_read;
   }
 
-  void put_line(char const* s, int n)
+  bool put_line(char const* s, int n)
   {
-    if (!s)
-      return;
+    if (!s || n < 0)
+      return false;
 
-    std::lock_guard<std::mutex> guard(m_mutex);
-    for (int i = 0; i < n; ++i)
-      m_stream.push(s[i]);
-    m_stream.push(m_delimiter);
+    std::shared_ptr<char> buff(new char[n], std::default_delete<char[]>());
+    memcpy(buff.get(), s, n);
+    return put_line(buff, n);
+  }
+
+  bool put_line(std::shared_ptr<char const> const& s, int n)
+  {
+    return put(segment{s, n, false, std::string(), {}, 0}, nullptr, true);
+  }
+
+  // queues a response over budget rather than wait for room, for the
+  // consumer's own thread where waiting would never end
+  bool put_line_now(std::shared_ptr<char const> const& s, int n)
+  {
+    return put(segment{s, n, false, std::string(), {}, 0}, nullptr, false);
+  }
+
+  // queues a record in the current framing and switches the framing of
+  // everything queued after it
+  bool put_line_and_reframe(std::shared_ptr<char const> const& s, int n, bool length_prefixed)
+  {
+    return put(segment{s, n, false, std::string(), {}, 0}, &length_prefixed, true);
+  }
+
+  // queues a record that may be dropped, or replaced by a newer record
+  // with the same non-empty key, when the stream is over budget. returns
+  // false if it was dropped instead
+  bool put_notification(std::shared_ptr<char const> const& s, int n, std::string const& key)
+  {
+    return put(segment{s, n, true, key, {}, 0}, nullptr, true);
   }
 
   int size() const
+  {
+    return m_size.load(std::memory_order_acquire);
+  }
+
+  // length of what's left of the first record including its delimiter or
+  // header, 0 if nothing is queued
+  int front_size() const
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (m_segments.empty())
+      return 0;
+    return m_segments.front().length() - m_head_offset;
+  }
+
+  // copy up to n bytes starting at offset without consuming them
+  int peek(char* s, int n, int offset) const
   {
     std::lock_guard<std::mutex> guard(m_mutex);
-    return m_stream.size();
+    int bytes_read = copy_out(s, n, offset);
+    m_peek_end = std::max(m_peek_end, offset + bytes_read);
+    return bytes_read;
+  }
+
+  // discard the first n bytes
+  void pop(int n)
+  {
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      consume(n);
+    }
+    m_cond.notify_all();
   }
 
 private:
-  bool read_complete(int bytes_read, int n)
+  struct segment
   {
-    if (m_stream.empty())
-      return true;
+    std::shared_ptr<char const> data;
+    int                         size;
+    bool                        droppable;
+    std::string                 key;
+    char                        header[kMaxVarintSize];
+    int                         header_size;
 
-    if (bytes_read == n)
-      return true;
+    // no header means the record is delimited
+    void frame(bool length_prefixed)
+    {
+      header_size = length_prefixed ? putVarint(static_cast<uint32_t>(size), header) : 0;
+    }
+
+    int length() const
+    {
+      return header_size ? header_size + size : size + 1;
+    }
+  };
+
+  bool put(segment&& seg, bool const* reframe, bool wait)
+  {
+    if (!seg.data || seg.size < 0)
+      return false;
+
+    std::unique_lock<std::mutex> guard(m_mutex);
+    if (m_closed)
+      return false;
+
+    seg.frame(m_length_prefixed);
+
+    if (m_policy == overflow_policy::replace && seg.droppable && !seg.key.empty())
+    {
+      for (auto itr = first_unpinned(); itr != m_segments.end(); ++itr)
+      {
+        if (itr->droppable && itr->key == seg.key)
+        {
+          int old_length = itr->length();
+          itr->data = std::move(seg.data);
+          itr->size = seg.size;
+          itr->frame(itr->header_size != 0);
+          m_size.fetch_add(itr->length() - old_length, std::memory_order_release);
+          m_stats.replaced++;
+          return true;
+        }
+      }
+    }
+
+    if (wait && !fits(seg.length()))
+    {
+      if (m_policy == overflow_policy::block)
+      {
+        m_stats.blocked++;
+        m_cond.wait(guard, [this, &seg] { return m_closed || fits(seg.length()); });
+        if (m_closed)
+          return false;
+
+        // the framing may have been switched while this one waited
+        seg.frame(m_length_prefixed);
+      }
+      else
+      {
+        auto itr = first_unpinned();
+        while (!fits(seg.length()) && itr != m_segments.end())
+        {
+          if (itr->droppable)
+          {
+            m_size.fetch_sub(itr->length(), std::memory_order_release);
+            itr = m_segments.erase(itr);
+            m_stats.dropped++;
+          }
+          else
+          {
+            ++itr;
+          }
+        }
+
+        // only responses are left, they go over budget rather than get lost
+        if (!fits(seg.length()) && seg.droppable)
+        {
+          m_stats.dropped++;
+          return false;
+        }
+      }
+    }
+
+    m_size.fetch_add(seg.length(), std::memory_order_release);
+    m_segments.push_back(std::move(seg));
+    if (reframe)
+      m_length_prefixed = *reframe;
+    return true;
+  }
 
-    if (m_stream.front() == m_delimiter)
+  // a single record is always let in, otherwise one bigger than the budget
+  // would never get through. n includes the framing
+  bool fits(int n) const
+  {
+    if (m_segments.empty())
       return true;
+    if (m_max_records > 0 && static_cast<int>(m_segments.size()) + 1 > m_max_records)
+      return false;
+    if (m_max_bytes > 0 && m_size.load(std::memory_order_relaxed) + n > m_max_bytes)
+      return false;
+    return true;
+  }
+
+  // first segment none of whose bytes have been handed out by peek()
+  std::deque<segment>::iterator first_unpinned()
+  {
+    int start = -m_head_offset;
+    auto itr = m_segments.begin();
+    while (itr != m_segments.end() && (start < m_peek_end || start < 0))
+    {
+      start += itr->length();
+      ++itr;
+    }
+    return itr;
+  }
+
+  int copy_out(char* s, int n, int offset) const
+  {
+    int bytes_read = 0;
+    int skip = offset + m_head_offset;
+
+    for (auto itr = m_segments.begin(); itr != m_segments.end() && bytes_read < n; ++itr)
+    {
+      int len = itr->length();
+      if (skip >= len)
+      {
+        skip -= len;
+        continue;
+      }
 
-    return false;
+      int h = itr->header_size;
+      while (skip < h && bytes_read < n)
+        s[bytes_read++] = itr->header[skip++];
+
+      int k = std::min(h + itr->size - skip, n - bytes_read);
+      if (k > 0)
+      {
+        memcpy(s + bytes_read, itr->data.get() + skip - h, k);
+        bytes_read += k;
+        skip += k;
+      }
+
+      if (h == 0 && skip == itr->size && bytes_read < n)
+        s[bytes_read++] = m_delimiter;
+      skip = 0;
+    }
+
+    return bytes_read;
+  }
+
+  void consume(int n)
+  {
+    n = std::min(n, m_size.load(std::memory_order_relaxed));
+    m_size.fetch_sub(n, std::memory_order_release);
+    m_peek_end = std::max(0, m_peek_end - n);
+
+    n += m_head_offset;
+    while (!m_segments.empty() && n >= m_segments.front().length())
+    {
+      n -= m_segments.front().length();
+      m_segments.pop_front();
+    }
+    m_head_offset = n;
   }
 
 private:
-  std::queue<char>    m_stream;
-  mutable std::mutex  m_mutex;
-  char                m_delimiter;
+  std::deque<segment>     m_segments;
+  int                     m_head_offset;
+  mutable int             m_peek_end;
+  std::atomic<int>        m_size;
+  mutable std::mutex      m_mutex;
+  std::condition_variable m_cond;
+  char                    m_delimiter;
+  bool                    m_length_prefixed;
+  int                     m_max_bytes;
+  int                     m_max_records;
+  overflow_policy         m_policy;
+  bool                    m_closed;
+  memory_stream_stats     m_stats;
 };
 
 #endif
@@ -21,4 +21,36 @@
 
 #define kJsonRpcVersion "2.0"
 
+// ASCII record separator, terminates each json record on stream transports
+#define kRecordDelimiter ((char) 30)
+
+// binary records start with a marker byte json never starts with and
+// escape kRecordEscape and kRecordDelimiter, see escapeRecord()
+#define kRecordEscape ((char) 29)
+
+// ASCII unit separator, first byte of a deflated record
+#define kCompressedRecordMarker ((char) 31)
+
+// ASCII file separator, first byte of a CBOR encoded record
+#define kCborRecordMarker ((char) 28)
+
+// longest varint length header of a length prefixed record, see putVarint()
+#define kMaxVarintSize (5)
+
+// largest request accepted from a client, listener.max-request-size
+#define kDefaultMaxRequestSize (16384)
+
+// requests waiting to be dispatched before clients are throttled,
+// listener.max-pending-requests
+#define kDefaultMaxPendingRequests (16)
+
+// records shorter than this are never compressed, listener.compress-threshold
+#define kDefaultCompressThreshold (64)
+
+// how long a disconnected session can be resumed, listener.session-grace-ms
+#define kDefaultSessionGraceMs (30000)
+
+// records kept per session for replay, listener.session-replay-bytes
+#define kDefaultSessionReplayBytes (65536)
+
 #endif
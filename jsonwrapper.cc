@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <math.h>
 
 cJSON*
 JsonWrapper::makeError(int code, char const* fmt, ...)
@@ -188,3 +189,333 @@ JsonWrapper::fromFile(char const* fname)
 
   return json;
 }
+
+namespace
+{
+  int const kCborMaxDepth = 32;
+
+  void
+  cborPutHead(std::vector<uint8_t>& out, uint8_t major, uint64_t n)
+  {
+    major <<= 5;
+    if (n < 24)
+    {
+      out.push_back(major | static_cast<uint8_t>(n));
+    }
+    else if (n <= 0xff)
+    {
+      out.push_back(major | 24);
+      out.push_back(static_cast<uint8_t>(n));
+    }
+    else if (n <= 0xffff)
+    {
+      out.push_back(major | 25);
+      out.push_back(static_cast<uint8_t>(n >> 8));
+      out.push_back(static_cast<uint8_t>(n));
+    }
+    else if (n <= 0xffffffff)
+    {
+      out.push_back(major | 26);
+      for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<uint8_t>(n >> shift));
+    }
+    else
+    {
+      out.push_back(major | 27);
+      for (int shift = 56; shift >= 0; shift -= 8)
+        out.push_back(static_cast<uint8_t>(n >> shift));
+    }
+  }
+
+  void
+  cborPutString(std::vector<uint8_t>& out, char const* s)
+  {
+    size_t n = s ? strlen(s) : 0;
+    cborPutHead(out, 3, n);
+    out.insert(out.end(), s, s + n);
+  }
+
+  void
+  cborPutNumber(std::vector<uint8_t>& out, double d)
+  {
+    // integers are what diagnostics are mostly made of, and they're a
+    // byte or two instead of nine. the cast is only defined once d is known
+    // to fit
+    if (isfinite(d) && d > -9.2e18 && d < 9.2e18 && d == static_cast<double>(static_cast<int64_t>(d)))
+    {
+      int64_t i = static_cast<int64_t>(d);
+      if (i >= 0)
+        cborPutHead(out, 0, static_cast<uint64_t>(i));
+      else
+        cborPutHead(out, 1, static_cast<uint64_t>(-1 - i));
+      return;
+    }
+
+    float f = static_cast<float>(d);
+    if (static_cast<double>(f) == d)
+    {
+      uint32_t bits;
+      memcpy(&bits, &f, sizeof(bits));
+      out.push_back(0xfa);
+      for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<uint8_t>(bits >> shift));
+      return;
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &d, sizeof(bits));
+    out.push_back(0xfb);
+    for (int shift = 56; shift >= 0; shift -= 8)
+      out.push_back(static_cast<uint8_t>(bits >> shift));
+  }
+
+  void
+  cborPutItem(std::vector<uint8_t>& out, cJSON const* item)
+  {
+    switch (item->type & 0xff)
+    {
+      case cJSON_False:
+        out.push_back(0xf4);
+        break;
+      case cJSON_True:
+        out.push_back(0xf5);
+        break;
+      case cJSON_Number:
+        cborPutNumber(out, item->valuedouble);
+        break;
+      case cJSON_String:
+      case cJSON_Raw:
+        cborPutString(out, item->valuestring);
+        break;
+      case cJSON_Array:
+      case cJSON_Object:
+      {
+        bool isObject = (item->type & 0xff) == cJSON_Object;
+        uint64_t count = 0;
+        for (cJSON const* child = item->child; child; child = child->next)
+          count++;
+        cborPutHead(out, isObject ? 5 : 4, count);
+        for (cJSON const* child = item->child; child; child = child->next)
+        {
+          if (isObject)
+            cborPutString(out, child->string);
+          cborPutItem(out, child);
+        }
+        break;
+      }
+      default:
+        out.push_back(0xf6);
+        break;
+    }
+  }
+
+  class CborReader
+  {
+  public:
+    CborReader(uint8_t const* buff, size_t n)
+      : m_buff(buff)
+      , m_end(buff + n) { }
+
+    bool atEnd() const
+      { return m_buff == m_end; }
+
+    cJSON* readItem(int depth);
+
+  private:
+    bool readHead(uint8_t& major, uint8_t& info, uint64_t& n);
+    bool readString(uint8_t info, uint64_t n, std::string& s);
+    bool isBreak()
+    {
+      if (m_buff < m_end && *m_buff == 0xff)
+      {
+        m_buff++;
+        return true;
+      }
+      return false;
+    }
+
+  private:
+    uint8_t const* m_buff;
+    uint8_t const* m_end;
+  };
+
+  bool
+  CborReader::readHead(uint8_t& major, uint8_t& info, uint64_t& n)
+  {
+    if (m_buff >= m_end)
+      return false;
+
+    major = *m_buff >> 5;
+    info = *m_buff & 0x1f;
+    m_buff++;
+
+    n = info;
+    if (info < 24)
+      return true;
+
+    // only strings, arrays and maps can be of indefinite length. a break
+    // is taken by isBreak() before it gets here
+    if (info == 31)
+      return major >= 2 && major <= 5;
+    if (info > 27)
+      return false;
+
+    size_t len = size_t(1) << (info - 24);
+    if (static_cast<size_t>(m_end - m_buff) < len)
+      return false;
+
+    n = 0;
+    for (size_t i = 0; i < len; ++i)
+      n = (n << 8) | *m_buff++;
+    return true;
+  }
+
+  bool
+  CborReader::readString(uint8_t info, uint64_t n, std::string& s)
+  {
+    if (info != 31)
+    {
+      if (n > static_cast<uint64_t>(m_end - m_buff))
+        return false;
+      s.append(reinterpret_cast<char const *>(m_buff), n);
+      m_buff += n;
+      return true;
+    }
+
+    // indefinite length, a run of definite length text chunks
+    while (!isBreak())
+    {
+      uint8_t major, chunkInfo;
+      uint64_t len;
+      if (!readHead(major, chunkInfo, len) || major != 3 || chunkInfo == 31)
+        return false;
+      if (!readString(chunkInfo, len, s))
+        return false;
+    }
+    return true;
+  }
+
+  cJSON*
+  CborReader::readItem(int depth)
+  {
+    if (depth > kCborMaxDepth)
+      return nullptr;
+
+    uint8_t major, info;
+    uint64_t n;
+    if (!readHead(major, info, n))
+      return nullptr;
+
+    switch (major)
+    {
+      case 0:
+        return cJSON_CreateNumber(static_cast<double>(n));
+      case 1:
+        return cJSON_CreateNumber(-1.0 - static_cast<double>(n));
+      case 3:
+      {
+        std::string s;
+        if (!readString(info, n, s))
+          return nullptr;
+        return cJSON_CreateString(s.c_str());
+      }
+      case 4:
+      case 5:
+      {
+        cJSON* container = (major == 4) ? cJSON_CreateArray() : cJSON_CreateObject();
+        for (uint64_t i = 0; (info == 31) ? !isBreak() : (i < n); ++i)
+        {
+          std::string key;
+          if (major == 5)
+          {
+            uint8_t keyMajor, keyInfo;
+            uint64_t keyLen;
+            if (!readHead(keyMajor, keyInfo, keyLen) || keyMajor != 3 || !readString(keyInfo, keyLen, key))
+            {
+              cJSON_Delete(container);
+              return nullptr;
+            }
+          }
+
+          cJSON* child = readItem(depth + 1);
+          if (!child)
+          {
+            cJSON_Delete(container);
+            return nullptr;
+          }
+
+          if (major == 4)
+            cJSON_AddItemToArray(container, child);
+          else
+            cJSON_AddItemToObject(container, key.c_str(), child);
+        }
+        return container;
+      }
+      case 6:
+        // tags don't mean anything to json, take the tagged item as is
+        return readItem(depth + 1);
+      case 7:
+        switch (info)
+        {
+          case 20: return cJSON_CreateFalse();
+          case 21: return cJSON_CreateTrue();
+          case 22:
+          case 23: return cJSON_CreateNull();
+          case 25:
+          {
+            // half float
+            int exp = (n >> 10) & 0x1f;
+            int mant = n & 0x3ff;
+            double d = 0;
+            if (exp == 0)
+              d = ldexp(mant, -24);
+            else if (exp != 31)
+              d = ldexp(mant + 1024, exp - 25);
+            else
+              d = mant == 0 ? INFINITY : NAN;
+            return cJSON_CreateNumber((n & 0x8000) ? -d : d);
+          }
+          case 26:
+          {
+            uint32_t bits = static_cast<uint32_t>(n);
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            return cJSON_CreateNumber(f);
+          }
+          case 27:
+          {
+            double d;
+            memcpy(&d, &n, sizeof(d));
+            return cJSON_CreateNumber(d);
+          }
+        }
+        return nullptr;
+      default:
+        return nullptr;
+    }
+  }
+}
+
+void
+JsonWrapper::toCbor(cJSON const* json, std::vector<uint8_t>& out)
+{
+  if (json)
+    cborPutItem(out, json);
+}
+
+cJSON*
+JsonWrapper::fromCbor(uint8_t const* buff, size_t n)
+{
+  if (!buff || n == 0)
+    return nullptr;
+
+  CborReader reader(buff, n);
+  cJSON* json = reader.readItem(0);
+  if (json && !reader.atEnd())
+  {
+    XLOG_WARN("trailing bytes after cbor item");
+    cJSON_Delete(json);
+    json = nullptr;
+  }
+  return json;
+}
@@ -18,6 +18,9 @@
 
 #include <cJSON.h>
 #include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
 
 class JsonWrapper
 {
@@ -57,6 +60,20 @@ public:
   static cJSON*
   fromFile(
     char const* fname);
+
+  // RFC 7049 CBOR. numbers with no fractional part go out as integers,
+  // everything else maps one to one
+  static void
+  toCbor(
+    cJSON const*          json,
+    std::vector<uint8_t>& out);
+
+  // only the subset toCbor produces plus indefinite length items, tags
+  // and half floats. byte strings have no json equivalent and fail
+  static cJSON*
+  fromCbor(
+    uint8_t const*  buff,
+    size_t          n);
 };
 
 #endif
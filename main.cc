@@ -90,26 +90,27 @@ int main(int argc, char* argv[])
   std::shared_ptr<GattData> gattDataProvider(GattData::create());
   GattServiceDataProvider dataProvider = gattDataProvider->getDataProvider(listenerConfig);
 
-  while (true)
+  try
   {
-    try
-    {
-      std::shared_ptr<RpcListener> listener(RpcListener::create());
-      listener->init(listenerConfig);
+    std::shared_ptr<RpcListener> listener(RpcListener::create(listenerConfig));
+    listener->init(listenerConfig);
 
-      // blocks here until remote client makes BT connection
-      std::shared_ptr<RpcConnectedClient> client = listener->accept(dataProvider.deviceInfoProvider, dataProvider.rdkDiagProvider);
-      //client->setDataHandler(std::bind(&RpcServer::onIncomingMessage,
-      //      &server, std::placeholders::_1, std::placeholders::_2));
-      server.setClient(client);
-      server.run();
-    }
-    catch (std::runtime_error const& err)
+    while (true)
     {
-      XLOG_ERROR("unhandled exception:%s", err.what());
-      return -1;
+      // blocks here until remote client connects
+      std::shared_ptr<RpcConnectedClient> client = listener->accept(dataProvider.deviceInfoProvider, dataProvider.rdkDiagProvider);
+      server.addClient(client);
+
+      // returns when client disconnects, or right away for transports
+      // that service all of their clients from their own event loop
+      server.run(client);
     }
   }
+  catch (std::runtime_error const& err)
+  {
+    XLOG_ERROR("unhandled exception:%s", err.what());
+    return -1;
+  }
 
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,240 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// feeds a stream of json records to RecordScanner in transport sized
+// fragments, the way the receive path does, and compares the vector scan
+// with the byte at a time one and with a plain memchr that doesn't check
+// anything
+#include "defs.h"
+#include "recordscan.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace
+{
+  enum class ScanMode
+  {
+    Vector,
+    Scalar,
+    Memchr
+  };
+
+  struct Result
+  {
+    uint64_t Records;
+    uint64_t Invalid;
+    double   Seconds;
+  };
+
+  void
+  printHelp()
+  {
+    printf("\n");
+    printf("recordbench [args]\n");
+    printf("\t-n  --iterations <n>     Passes over the stream (default 200)\n");
+    printf("\t-r  --record     <bytes> Record size (default 512)\n");
+    printf("\t-c  --count      <n>     Records in the stream (default 2048)\n");
+    printf("\t-f  --fragment   <bytes> Bytes handed to the scanner at a time (default 244)\n");
+    printf("\t-u  --utf8       <pct>   Records with non-ASCII strings (default 10)\n");
+    printf("\t-x  --invalid    <pct>   Records that aren't UTF-8 (default 1)\n");
+    printf("\t-h  --help               Print this help and exit\n");
+    exit(0);
+  }
+
+  // a json request padded out to size, some with multibyte characters and
+  // some with an overlong encoding that has to be refused
+  std::string
+  makeRecord(int id, int size, bool utf8, bool invalid)
+  {
+    std::string s = "{\"jsonrpc\":\"2.0\",\"id\":" + std::to_string(id)
+      + ",\"method\":\"wifi-connect\",\"params\":{\"ssid\":\"";
+    if (utf8)
+      s += "caf\xc3\xa9 \xe2\x98\x95 \xf0\x9f\x93\xb6";
+    if (invalid)
+      s += "\xc0\xaf";
+    s += "\",\"psk\":\"";
+    while (static_cast<int>(s.size()) < size - 3)
+      s += static_cast<char>('a' + (s.size() % 26));
+    s += "\"}}";
+    return s;
+  }
+
+  Result
+  run(std::vector<char> const& stream, size_t fragment, int iterations, ScanMode mode)
+  {
+    Result result = { 0, 0, 0.0 };
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+    for (int k = 0; k < iterations; ++k)
+    {
+      RecordScanner scanner;
+      for (size_t offset = 0; offset < stream.size(); offset += fragment)
+      {
+        char const* scan = stream.data() + offset;
+        char const* end = stream.data() + std::min(offset + fragment, stream.size());
+        while (scan < end)
+        {
+          size_t n = static_cast<size_t>(end - scan);
+          size_t i = 0;
+          if (mode == ScanMode::Vector)
+            i = scanner.scan(scan, n);
+          else if (mode == ScanMode::Scalar)
+            i = scanner.scanScalar(scan, n);
+          else
+          {
+            void const* p = memchr(scan, kRecordDelimiter, n);
+            i = p ? static_cast<char const *>(p) - scan : n;
+          }
+
+          if (i == n)
+            break;
+
+          result.Records++;
+          if (mode != ScanMode::Memchr && scanner.check() == RecordCheck::Invalid)
+            result.Invalid++;
+          scanner.reset();
+          scan += i + 1;
+        }
+      }
+    }
+
+    result.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return result;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  int iterations = 200;
+  int recordSize = 512;
+  int count = 2048;
+  int fragment = 244;
+  int utf8 = 10;
+  int invalid = 1;
+
+  while (true)
+  {
+    static struct option longOptions[] =
+    {
+      { "iterations", required_argument, 0, 'n' },
+      { "record",     required_argument, 0, 'r' },
+      { "count",      required_argument, 0, 'c' },
+      { "fragment",   required_argument, 0, 'f' },
+      { "utf8",       required_argument, 0, 'u' },
+      { "invalid",    required_argument, 0, 'x' },
+      { "help",       no_argument, 0, 'h' },
+      { 0, 0, 0, 0 }
+    };
+
+    int optionIndex = 0;
+    int c = getopt_long(argc, argv, "n:r:c:f:u:x:h", longOptions, &optionIndex);
+    if (c == -1)
+      break;
+
+    switch (c)
+    {
+      case 'n':
+        iterations = std::max(atoi(optarg), 1);
+        break;
+      case 'r':
+        recordSize = std::max(atoi(optarg), 64);
+        break;
+      case 'c':
+        count = std::max(atoi(optarg), 1);
+        break;
+      case 'f':
+        fragment = std::max(atoi(optarg), 1);
+        break;
+      case 'u':
+        utf8 = std::min(std::max(atoi(optarg), 0), 100);
+        break;
+      case 'x':
+        invalid = std::min(std::max(atoi(optarg), 0), 100);
+        break;
+      case 'h':
+        printHelp();
+        break;
+      default:
+        break;
+    }
+  }
+
+  // spread the odd records evenly so every run sees the same stream
+  std::vector<char> stream;
+  uint64_t expectInvalid = 0;
+  for (int i = 0; i < count; ++i)
+  {
+    bool isUtf8 = (i * utf8) / 100 != ((i + 1) * utf8) / 100;
+    bool isInvalid = (i * invalid) / 100 != ((i + 1) * invalid) / 100;
+    std::string s = makeRecord(i, recordSize, isUtf8, isInvalid);
+    stream.insert(stream.end(), s.begin(), s.end());
+    stream.push_back(kRecordDelimiter);
+    if (isInvalid)
+      expectInvalid++;
+  }
+
+  printf("implementation:%s records:%d record:%d fragment:%d utf8:%d%% invalid:%d%% iterations:%d\n",
+    recordScanImplementation(), count, recordSize, fragment, utf8, invalid, iterations);
+
+  struct
+  {
+    char const* Name;
+    ScanMode    Mode;
+  } const modes[] =
+  {
+    { "vector", ScanMode::Vector },
+    { "scalar", ScanMode::Scalar },
+    { "memchr", ScanMode::Memchr }
+  };
+
+  double vectorSeconds = 0.0;
+  int ret = 0;
+  for (auto const& m : modes)
+  {
+    Result r = run(stream, static_cast<size_t>(fragment), iterations, m.Mode);
+    double bytes = static_cast<double>(stream.size()) * iterations;
+    if (m.Mode == ScanMode::Vector)
+      vectorSeconds = r.Seconds;
+
+    printf("%-7s %8.1f MB/s %10.1f records/ms", m.Name, bytes / r.Seconds / 1e6,
+      r.Records / r.Seconds / 1e3);
+    if (m.Mode == ScanMode::Memchr)
+      printf("   framing only, no utf-8 check");
+    else
+      printf("   %.2fx of vector", vectorSeconds / r.Seconds);
+    printf("\n");
+
+    // both scanners have to agree with what was put in the stream
+    uint64_t records = static_cast<uint64_t>(count) * iterations;
+    if (r.Records != records || (m.Mode != ScanMode::Memchr && r.Invalid != expectInvalid * iterations))
+    {
+      fprintf(stderr, "recordbench: %s found %llu records, %llu invalid, expected %llu and %llu\n",
+        m.Name, static_cast<unsigned long long>(r.Records), static_cast<unsigned long long>(r.Invalid),
+        static_cast<unsigned long long>(records), static_cast<unsigned long long>(expectInvalid * iterations));
+      ret = 1;
+    }
+  }
+
+  return ret;
+}
@@ -0,0 +1,163 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "recordscan.h"
+#include "recordscan_loop.h"
+#include "defs.h"
+
+#include <string.h>
+
+#if defined(__arm__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+namespace
+{
+  // byte at a time, built for the toolchain's default target so it runs on
+  // any CPU the rest of the program does
+  struct Blocks
+  {
+    static size_t const kSize = 0;
+
+    static void
+    masks(uint8_t const*, uint64_t& delimiters, uint64_t& nonAscii)
+      { delimiters = nonAscii = 0; }
+
+    static bool
+    isPlainRun(uint8_t const*)
+      { return false; }
+
+    static unsigned
+    firstBit(uint64_t)
+      { return 0; }
+
+    static uint64_t
+    maskBelow(unsigned)
+      { return 0; }
+  };
+
+  RecordScanOps const kRecordScanScalar =
+  {
+    "scalar",
+    &RecordScanLoop<Blocks>::scan,
+    &RecordScanLoop<Blocks>::find,
+    &RecordScanLoop<Blocks>::validate
+  };
+
+  // whether this CPU runs what recordscan_simd.cc was built for. SSE2 is
+  // part of x86-64 and NEON of 64 bit ARM, a 32 bit Pi 1 or Zero doesn't
+  // have NEON
+  bool
+  hasInstructions(char const* name)
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0)
+      return __builtin_cpu_supports("avx2");
+    if (strcmp(name, "sse2") == 0)
+      return __builtin_cpu_supports("sse2");
+#elif defined(__arm__) && defined(__linux__)
+    if (strcmp(name, "neon") == 0)
+      return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+    return true;
+  }
+
+  RecordScanOps const&
+  recordScanOps()
+  {
+    static RecordScanOps const& ops = (kRecordScanSimd.name && hasInstructions(kRecordScanSimd.name))
+      ? kRecordScanSimd
+      : kRecordScanScalar;
+    return ops;
+  }
+}
+
+RecordScanner::RecordScanner()
+  : m_start(true)
+  , m_binary(false)
+  , m_invalid(false)
+  , m_need(0)
+  , m_lo(0x80)
+  , m_hi(0xbf)
+{
+}
+
+void
+RecordScanner::reset()
+{
+  m_start = true;
+  m_binary = false;
+  m_invalid = false;
+  m_need = 0;
+  m_lo = 0x80;
+  m_hi = 0xbf;
+}
+
+RecordCheck
+RecordScanner::check() const
+{
+  if (m_binary)
+    return RecordCheck::Valid;
+  return (m_invalid || m_need) ? RecordCheck::Invalid : RecordCheck::Valid;
+}
+
+void
+RecordScanner::start(char c)
+{
+  m_start = false;
+  m_binary = (c == kCborRecordMarker || c == kCompressedRecordMarker);
+}
+
+size_t
+RecordScanner::scan(char const* buff, size_t n)
+{
+  if (n == 0)
+    return 0;
+  if (m_start)
+    start(buff[0]);
+
+  return recordScanOps().scan(*this, reinterpret_cast<uint8_t const *>(buff), n);
+}
+
+size_t
+RecordScanner::scanScalar(char const* buff, size_t n)
+{
+  if (n == 0)
+    return 0;
+  if (m_start)
+    start(buff[0]);
+
+  return RecordScanLoop<Blocks>::scanBytes(*this, reinterpret_cast<uint8_t const *>(buff), 0, n);
+}
+
+size_t
+findRecordDelimiter(char const* buff, size_t n)
+{
+  return recordScanOps().find(reinterpret_cast<uint8_t const *>(buff), n);
+}
+
+bool
+isValidUtf8(char const* buff, size_t n)
+{
+  return recordScanOps().validate(reinterpret_cast<uint8_t const *>(buff), n);
+}
+
+char const*
+recordScanImplementation()
+{
+  return recordScanOps().name;
+}
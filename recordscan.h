@@ -0,0 +1,89 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __RECORD_SCAN_H__
+#define __RECORD_SCAN_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// what a transport found out about a record while framing it
+enum class RecordCheck
+{
+  // the transport didn't look, the server checks text records itself
+  Unchecked,
+
+  // a text record that's well formed UTF-8, or a binary record
+  Valid,
+
+  // a text record with a byte sequence that isn't UTF-8
+  Invalid,
+
+  // longer than the transport takes. only what's arrived of it is handed
+  // over, and it isn't null terminated
+  Oversized
+};
+
+// finds kRecordDelimiter in a stream of records and checks that text
+// records are UTF-8 in the same pass, before anything tries to parse them.
+// records starting with kCborRecordMarker or kCompressedRecordMarker are
+// binary and only searched for the delimiter. a fragment can end anywhere,
+// even in the middle of a character, the state carries over to the next
+// one. blocks of 16 or 32 bytes are looked at with SSE2, AVX2 or NEON when
+// the CPU has them, bytes are only looked at one by one when a block has
+// something other than ASCII in it
+class RecordScanner
+{
+public:
+  RecordScanner();
+
+  // the offset of the next delimiter in buff, or n if there isn't one.
+  // the bytes before it are checked as part of the current record
+  size_t scan(char const* buff, size_t n);
+
+  // same as scan() a byte at a time, for comparison
+  size_t scanScalar(char const* buff, size_t n);
+
+  // the current record, once scan() has found its delimiter
+  RecordCheck check() const;
+
+  // the next byte starts a new record
+  void reset();
+
+private:
+  template <class Blocks> friend struct RecordScanLoop;
+
+  void start(char c);
+
+private:
+  bool    m_start;
+  bool    m_binary;
+  bool    m_invalid;
+  uint8_t m_need;
+  uint8_t m_lo;
+  uint8_t m_hi;
+};
+
+// memchr for kRecordDelimiter, n if there isn't one
+size_t findRecordDelimiter(char const* buff, size_t n);
+
+// whether buff is well formed UTF-8, no overlong forms, surrogates or code
+// points past U+10FFFF
+bool isValidUtf8(char const* buff, size_t n);
+
+// the instruction set RecordScanner runs with, for logging
+char const* recordScanImplementation();
+
+#endif
@@ -0,0 +1,220 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __RECORD_SCAN_LOOP_H__
+#define __RECORD_SCAN_LOOP_H__
+
+#include "recordscan.h"
+#include "defs.h"
+
+// the scanning loops, built once per instruction set. recordscan.cc builds
+// them byte at a time for the toolchain's default target, and
+// recordscan_simd.cc builds them with SIMD_FLAGS
+struct RecordScanOps
+{
+  // the instruction set, null when the loops were built without one
+  char const* name;
+
+  // RecordScanner::scan() past the first byte of a record
+  size_t (*scan)(RecordScanner& scanner, uint8_t const* p, size_t n);
+
+  // findRecordDelimiter()
+  size_t (*find)(uint8_t const* p, size_t n);
+
+  // isValidUtf8()
+  bool (*validate)(uint8_t const* p, size_t n);
+};
+
+// the loops in recordscan_simd.cc. they're only called once the CPU is
+// known to have the instructions, see recordScanImplementation()
+extern RecordScanOps const kRecordScanSimd;
+
+// Blocks has the block size, masks of the delimiters and of the bytes
+// with the high bit set in a block, whether kPlainRun bytes are all ASCII
+// without a delimiter, and the first byte and the bytes below a byte in a
+// mask. a block size of 0 leaves everything to the byte at a time loop.
+// Blocks lives in an anonymous namespace, which keeps each build of the
+// loops private to its object. the linker can't swap a copy built with
+// SIMD_FLAGS in for the byte at a time one that has to run on any CPU
+template <class Blocks>
+struct RecordScanLoop
+{
+  static size_t const kPlainRun = 64;
+
+  static size_t
+  scan(RecordScanner& s, uint8_t const* p, size_t n)
+  {
+    size_t i = 0;
+    if (Blocks::kSize)
+    {
+      for (; i + Blocks::kSize <= n; i += Blocks::kSize)
+      {
+        // between characters, long runs of ASCII are stepped over a cache
+        // line at a time
+        if (!s.m_need)
+        {
+          while (i + kPlainRun <= n && Blocks::isPlainRun(p + i))
+            i += kPlainRun;
+          if (i + Blocks::kSize > n)
+            break;
+        }
+
+        uint64_t delimiters = 0;
+        uint64_t nonAscii = 0;
+        Blocks::masks(p + i, delimiters, nonAscii);
+
+        // ASCII is always valid, and all there is in most json. the rest of
+        // the block only gets a closer look when there's something else
+        bool checking = !s.m_binary && !s.m_invalid;
+        if (delimiters)
+        {
+          unsigned d = Blocks::firstBit(delimiters);
+          if (checking && ((nonAscii & Blocks::maskBelow(d)) || s.m_need))
+            checkBytes(s, p + i, d);
+          return i + d;
+        }
+
+        if (checking && (nonAscii || s.m_need))
+          checkBytes(s, p + i, Blocks::kSize);
+      }
+    }
+
+    return scanBytes(s, p, i, n);
+  }
+
+  static size_t
+  find(uint8_t const* p, size_t n)
+  {
+    size_t i = 0;
+    if (Blocks::kSize)
+    {
+      for (; i + Blocks::kSize <= n; i += Blocks::kSize)
+      {
+        uint64_t delimiters = 0;
+        uint64_t nonAscii = 0;
+        Blocks::masks(p + i, delimiters, nonAscii);
+        if (delimiters)
+          return i + Blocks::firstBit(delimiters);
+      }
+    }
+
+    for (; i < n; ++i)
+    {
+      if (p[i] == static_cast<uint8_t>(kRecordDelimiter))
+        return i;
+    }
+    return n;
+  }
+
+  static bool
+  validate(uint8_t const* p, size_t n)
+  {
+    // past the start of a record, so nothing is taken for a binary marker
+    RecordScanner scanner;
+    scanner.m_start = false;
+
+    size_t i = 0;
+    if (Blocks::kSize)
+    {
+      for (; i + Blocks::kSize <= n; i += Blocks::kSize)
+      {
+        if (!scanner.m_need)
+        {
+          while (i + kPlainRun <= n && Blocks::isPlainRun(p + i))
+            i += kPlainRun;
+          if (i + Blocks::kSize > n)
+            break;
+        }
+
+        uint64_t delimiters = 0;
+        uint64_t nonAscii = 0;
+        Blocks::masks(p + i, delimiters, nonAscii);
+        if (nonAscii || scanner.m_need)
+          checkBytes(scanner, p + i, Blocks::kSize);
+        if (scanner.m_invalid)
+          return false;
+      }
+    }
+
+    checkBytes(scanner, p + i, n - i);
+    return !scanner.m_invalid && !scanner.m_need;
+  }
+
+  static void
+  checkBytes(RecordScanner& s, uint8_t const* p, size_t n)
+  {
+    // the ranges a continuation byte has to be in rule out overlong forms,
+    // surrogates and anything past U+10FFFF, see RFC 3629 section 4
+    for (size_t i = 0; i < n && !s.m_invalid; ++i)
+    {
+      uint8_t c = p[i];
+      if (s.m_need)
+      {
+        if (c < s.m_lo || c > s.m_hi)
+        {
+          s.m_invalid = true;
+          break;
+        }
+        s.m_need--;
+        s.m_lo = 0x80;
+        s.m_hi = 0xbf;
+      }
+      else if (c < 0x80)
+      {
+        continue;
+      }
+      else if (c >= 0xc2 && c <= 0xdf)
+      {
+        s.m_need = 1;
+      }
+      else if (c >= 0xe0 && c <= 0xef)
+      {
+        s.m_need = 2;
+        if (c == 0xe0)
+          s.m_lo = 0xa0;
+        else if (c == 0xed)
+          s.m_hi = 0x9f;
+      }
+      else if (c >= 0xf0 && c <= 0xf4)
+      {
+        s.m_need = 3;
+        if (c == 0xf0)
+          s.m_lo = 0x90;
+        else if (c == 0xf4)
+          s.m_hi = 0x8f;
+      }
+      else
+      {
+        s.m_invalid = true;
+      }
+    }
+  }
+
+  static size_t
+  scanBytes(RecordScanner& s, uint8_t const* p, size_t i, size_t n)
+  {
+    for (; i < n; ++i)
+    {
+      uint8_t c = p[i];
+      if (c == static_cast<uint8_t>(kRecordDelimiter))
+        return i;
+      if ((c >= 0x80 || s.m_need) && !s.m_binary && !s.m_invalid)
+        checkBytes(s, p + i, 1);
+    }
+    return n;
+  }
+};
+
+#endif
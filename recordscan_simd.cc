@@ -0,0 +1,166 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// the only file built with SIMD_FLAGS. nothing in here may run before
+// recordscan.cc has checked that the CPU has the instructions, so it has
+// no code outside the loops and no static initializers
+#include "recordscan_loop.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__arm__)
+#warning "record scanning built without NEON, see SIMD_FLAGS in the Makefile"
+#endif
+
+namespace
+{
+  // one bit per byte of a block, for the delimiter and for bytes with the
+  // high bit set
+#if defined(__AVX2__)
+  struct Blocks
+  {
+    static size_t const kSize = 32;
+
+    static void
+    masks(uint8_t const* p, uint64_t& delimiters, uint64_t& nonAscii)
+    {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p));
+      __m256i d = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(kRecordDelimiter));
+      delimiters = static_cast<uint32_t>(_mm256_movemask_epi8(d));
+      nonAscii = static_cast<uint32_t>(_mm256_movemask_epi8(v));
+    }
+
+    // no delimiter and nothing but ASCII in kPlainRun bytes
+    static bool
+    isPlainRun(uint8_t const* p)
+    {
+      __m256i const delimiter = _mm256_set1_epi8(kRecordDelimiter);
+      __m256i a = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p));
+      __m256i b = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(p + 32));
+      __m256i special = _mm256_or_si256(_mm256_or_si256(a, b),
+        _mm256_or_si256(_mm256_cmpeq_epi8(a, delimiter), _mm256_cmpeq_epi8(b, delimiter)));
+      return _mm256_movemask_epi8(special) == 0;
+    }
+
+    static unsigned
+    firstBit(uint64_t mask)
+      { return __builtin_ctzll(mask); }
+
+    static uint64_t
+    maskBelow(unsigned byte)
+      { return (1ULL << byte) - 1; }
+  };
+
+  char const kImplementation[] = "avx2";
+#elif defined(__SSE2__)
+  struct Blocks
+  {
+    static size_t const kSize = 16;
+
+    static void
+    masks(uint8_t const* p, uint64_t& delimiters, uint64_t& nonAscii)
+    {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(p));
+      __m128i d = _mm_cmpeq_epi8(v, _mm_set1_epi8(kRecordDelimiter));
+      delimiters = static_cast<uint32_t>(_mm_movemask_epi8(d));
+      nonAscii = static_cast<uint32_t>(_mm_movemask_epi8(v));
+    }
+
+    static bool
+    isPlainRun(uint8_t const* p)
+    {
+      __m128i const delimiter = _mm_set1_epi8(kRecordDelimiter);
+      __m128i special = _mm_setzero_si128();
+      for (int i = 0; i < 4; ++i)
+      {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(p + i * 16));
+        special = _mm_or_si128(special, _mm_or_si128(v, _mm_cmpeq_epi8(v, delimiter)));
+      }
+      return _mm_movemask_epi8(special) == 0;
+    }
+
+    static unsigned
+    firstBit(uint64_t mask)
+      { return __builtin_ctzll(mask); }
+
+    static uint64_t
+    maskBelow(unsigned byte)
+      { return (1ULL << byte) - 1; }
+  };
+
+  char const kImplementation[] = "sse2";
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  struct Blocks
+  {
+    static size_t const kSize = 16;
+
+    // there's no movemask, narrowing each 16 bit lane by 4 leaves a nibble
+    // per byte instead of a bit. works on 32 bit ARM too
+    static uint64_t
+    nibbleMask(uint8x16_t v)
+    {
+      uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(v), 4);
+      return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+    }
+
+    static void
+    masks(uint8_t const* p, uint64_t& delimiters, uint64_t& nonAscii)
+    {
+      uint8x16_t v = vld1q_u8(p);
+      delimiters = nibbleMask(vceqq_u8(v, vdupq_n_u8(static_cast<uint8_t>(kRecordDelimiter))));
+      nonAscii = nibbleMask(vcgeq_u8(v, vdupq_n_u8(0x80)));
+    }
+
+    static bool
+    isPlainRun(uint8_t const* p)
+    {
+      uint8x16_t const delimiter = vdupq_n_u8(static_cast<uint8_t>(kRecordDelimiter));
+      uint8x16_t special = vdupq_n_u8(0);
+      for (int i = 0; i < 4; ++i)
+      {
+        uint8x16_t v = vld1q_u8(p + i * 16);
+        special = vorrq_u8(special, vorrq_u8(vcgeq_u8(v, vdupq_n_u8(0x80)), vceqq_u8(v, delimiter)));
+      }
+      return nibbleMask(special) == 0;
+    }
+
+    static unsigned
+    firstBit(uint64_t mask)
+      { return __builtin_ctzll(mask) / 4; }
+
+    static uint64_t
+    maskBelow(unsigned byte)
+      { return (1ULL << (byte * 4)) - 1; }
+  };
+
+  char const kImplementation[] = "neon";
+#endif
+}
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(__ARM_NEON) || defined(__ARM_NEON__)
+RecordScanOps const kRecordScanSimd =
+{
+  kImplementation,
+  &RecordScanLoop<Blocks>::scan,
+  &RecordScanLoop<Blocks>::find,
+  &RecordScanLoop<Blocks>::validate
+};
+#else
+// nothing to add to the byte at a time loops in recordscan.cc
+RecordScanOps const kRecordScanSimd = { nullptr, nullptr, nullptr, nullptr };
+#endif
@@ -0,0 +1,142 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "rpccompression.h"
+#include "logger.h"
+#include "util.h"
+
+#include <string.h>
+
+namespace
+{
+  int const kDictionaryVersion = 1;
+
+  // deflate favors matches near the end of the dictionary, so the most
+  // common strings go last
+  char const kDictionary[] =
+    "\"status\":\"COMPLETED\"\"status\":\"READY\"\"status\":\"UP\"\"unknown\""
+    "\"services\":[\"methods\":[\"service\":\"params\":{\"rpc-get-server-pubkey\""
+    "\"rpc-set-client-pubkey\"\"rpc-list-services\"\"rpc-list-methods\""
+    "\"rpc-set-compression\"\"rpc-get-stats\"\"wifi-\"\"diag-\"\"cmd-\""
+    "\"error\":{\"code\":-1,\"message\":\"not implemented\"}"
+    "{\"jsonrpc\":\"2.0\",\"method\":\"\"}"
+    "{\"jsonrpc\":\"2.0\",\"id\":\"result\":{\"}}";
+}
+
+RpcCompressor::RpcCompressor()
+  : m_mutex()
+  , m_deflate()
+  , m_inflate()
+  , m_deflate_ready(false)
+  , m_inflate_ready(false)
+{
+  // raw deflate, the record marker and the dictionary version stand in for
+  // the zlib header. a smaller window and memLevel keep each stream to a
+  // few tens of KB, records are rarely bigger than that anyway
+  memset(&m_deflate, 0, sizeof(m_deflate));
+  if (deflateInit2(&m_deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12, 6, Z_DEFAULT_STRATEGY) == Z_OK)
+    m_deflate_ready = true;
+  else
+    XLOG_ERROR("failed to initialize deflate stream");
+
+  memset(&m_inflate, 0, sizeof(m_inflate));
+  if (inflateInit2(&m_inflate, -15) == Z_OK)
+    m_inflate_ready = true;
+  else
+    XLOG_ERROR("failed to initialize inflate stream");
+}
+
+RpcCompressor::~RpcCompressor()
+{
+  if (m_deflate_ready)
+    deflateEnd(&m_deflate);
+  if (m_inflate_ready)
+    inflateEnd(&m_inflate);
+}
+
+int
+RpcCompressor::dictionaryVersion()
+{
+  return kDictionaryVersion;
+}
+
+bool
+RpcCompressor::compress(char const* buff, int n, std::vector<char>& out)
+{
+  if (!buff || n <= 0)
+    return false;
+
+  std::vector<uint8_t> deflated;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    if (!m_deflate_ready)
+      return false;
+
+    deflateReset(&m_deflate);
+    deflateSetDictionary(&m_deflate, reinterpret_cast<Bytef const *>(kDictionary), sizeof(kDictionary) - 1);
+
+    deflated.resize(deflateBound(&m_deflate, n));
+    m_deflate.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(buff));
+    m_deflate.avail_in = n;
+    m_deflate.next_out = deflated.data();
+    m_deflate.avail_out = deflated.size();
+
+    if (deflate(&m_deflate, Z_FINISH) != Z_STREAM_END)
+    {
+      XLOG_WARN("failed to deflate %d byte record", n);
+      return false;
+    }
+    deflated.resize(m_deflate.total_out);
+  }
+
+  escapeRecord(kCompressedRecordMarker, deflated.data(), deflated.size(), out);
+  return static_cast<int>(out.size()) < n;
+}
+
+bool
+RpcCompressor::decompress(char const* buff, int n, int maxSize, std::vector<char>& out)
+{
+  if (!isCompressed(buff, n))
+    return false;
+
+  std::vector<uint8_t> deflated;
+  if (!unescapeRecord(buff, n, deflated))
+    return false;
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (!m_inflate_ready)
+    return false;
+
+  // a raw stream has no header to ask for the dictionary, it's always set
+  inflateReset(&m_inflate);
+  inflateSetDictionary(&m_inflate, reinterpret_cast<Bytef const *>(kDictionary), sizeof(kDictionary) - 1);
+
+  out.resize(maxSize);
+  m_inflate.next_in = deflated.data();
+  m_inflate.avail_in = deflated.size();
+  m_inflate.next_out = reinterpret_cast<Bytef *>(out.data());
+  m_inflate.avail_out = out.size();
+
+  int ret = inflate(&m_inflate, Z_FINISH);
+  if (ret != Z_STREAM_END)
+  {
+    XLOG_WARN("failed to inflate %d byte record:%d", n, ret);
+    return false;
+  }
+
+  out.resize(m_inflate.total_out);
+  out.push_back('\0');
+  return true;
+}
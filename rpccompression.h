@@ -0,0 +1,70 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __RPC_COMPRESSION_H__
+#define __RPC_COMPRESSION_H__
+
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "defs.h"
+
+struct RpcCompressionStats
+{
+  uint64_t RecordsOut;
+  uint64_t RecordsCompressed;
+  uint64_t BytesOut;
+  uint64_t WireBytesOut;
+  uint64_t RecordsIn;
+  uint64_t BytesIn;
+  uint64_t WireBytesIn;
+};
+
+// raw deflate with a preset dictionary of the keys and values that show up
+// in most of our json. every record is compressed on its own so records
+// can be dropped or reordered by the outgoing queue. a compressed record
+// is framed by escapeRecord() with kCompressedRecordMarker
+class RpcCompressor
+{
+public:
+  RpcCompressor();
+  ~RpcCompressor();
+
+  // bumped whenever the dictionary changes, clients have to ask for the
+  // version they were built with
+  static int dictionaryVersion();
+
+  static bool isCompressed(char const* buff, int n)
+    { return n > 0 && buff[0] == kCompressedRecordMarker; }
+
+  // returns false if deflate failed or the result isn't any smaller, the
+  // record should go out as is
+  bool compress(char const* buff, int n, std::vector<char>& out);
+
+  // out is null terminated. returns false if the record is corrupt or
+  // inflates to more than maxSize bytes
+  bool decompress(char const* buff, int n, int maxSize, std::vector<char>& out);
+
+private:
+  std::mutex  m_mutex;
+  z_stream    m_deflate;
+  z_stream    m_inflate;
+  bool        m_deflate_ready;
+  bool        m_inflate_ready;
+};
+
+#endif
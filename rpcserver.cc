@@ -17,16 +17,22 @@
 #include "rpcserver.h"
 #include "logger.h"
 #include "jsonwrapper.h"
+#include "util.h"
 
+#include "socket/socketserver.h"
 
 #ifdef WITH_BLUEZ
 #include "bluez/gattserver.h"
 #endif
 
+#include <algorithm>
 #include <sstream>
+#include <stdexcept>
 #include <stdarg.h>
 #include <sys/stat.h>
+#include <errno.h>
 #include <string.h>
+#include <openssl/rand.h>
 
 namespace
 {
@@ -43,6 +49,49 @@ namespace
     cJSON*& m_json;
   };
 
+  std::shared_ptr<char const>
+  shareRecord(std::vector<char> const& record)
+  {
+    std::shared_ptr<char> copy(new char[record.size()], std::default_delete<char[]>());
+    memcpy(copy.get(), record.data(), record.size());
+    return copy;
+  }
+
+  // a request id as it went over the wire, so a string id can't be taken
+  // for a number. empty when there isn't one
+  std::string
+  requestIdKey(cJSON const* id)
+  {
+    std::string key;
+    char* s = id ? cJSON_PrintUnformatted(id) : nullptr;
+    if (s)
+    {
+      key = s;
+      free(s);
+    }
+    return key;
+  }
+
+  std::string
+  makeSessionToken()
+  {
+    uint8_t bytes[16];
+    if (RAND_bytes(bytes, sizeof(bytes)) != 1)
+    {
+      XLOG_ERROR("failed to generate session token");
+      return std::string();
+    }
+
+    static char const hex[] = "0123456789abcdef";
+    std::string token;
+    for (uint8_t b : bytes)
+    {
+      token.push_back(hex[b >> 4]);
+      token.push_back(hex[b & 0x0f]);
+    }
+    return token;
+  }
+
   std::map< std::string, RpcServiceConstructor > serviceConstructors;
 }
 
@@ -72,14 +121,31 @@ RpcServer::RpcMethodInfo::parseMethod(char const* s)
 }
 
 std::shared_ptr<RpcListener>
-RpcListener::create()
+RpcListener::create(cJSON const* listenerConfig)
 {
-  return std::shared_ptr<RpcListener>(
-
+  char const* name = nullptr;
+  if (listenerConfig)
+    name = JsonWrapper::getString(listenerConfig, "name", false, nullptr);
+  if (!name)
+    name = "ble";
+
+  RpcListener* listener = nullptr;
+  if (strcmp(name, "unix") == 0)
+    listener = new UnixSocketServer();
+  else if (strcmp(name, "tcp") == 0)
+    listener = new TcpSocketServer();
 #ifdef WITH_BLUEZ
-  new GattServer()
+  else if (strcmp(name, "ble") == 0)
+    listener = new GattServer();
 #endif
-  );
+
+  if (!listener)
+  {
+    XLOG_ERROR("unsupported listener type:%s", name);
+    throw std::runtime_error(std::string("unsupported listener type ") + name);
+  }
+
+  return std::shared_ptr<RpcListener>(listener);
 }
 
 RpcService*
@@ -198,12 +264,40 @@ BasicRpcService::invokeMethod(std::string const& name, cJSON const* req)
 RpcServer::RpcServer(std::string const& configFile, cJSON const* config)
   : m_config_file(configFile)
   , m_running(false)
+  , m_max_request_size(kDefaultMaxRequestSize)
+  , m_max_pending_requests(kDefaultMaxPendingRequests)
+  , m_inbound_paused(false)
+  , m_compressor()
+  , m_compress_threshold(kDefaultCompressThreshold)
+  , m_compression_totals()
+  , m_current_client()
+  , m_next_session_id(1)
+  , m_session_detached(false)
+  , m_session_grace_ms(kDefaultSessionGraceMs)
+  , m_session_replay_bytes(kDefaultSessionReplayBytes)
 {
   if (config)
     m_config = cJSON_Duplicate(config, true);
   else
     m_config = nullptr;
 
+  if (m_config)
+  {
+    cJSON const* listenerConfig = cJSON_GetObjectItem(m_config, "listener");
+    m_max_request_size = JsonWrapper::getInt(listenerConfig, "max-request-size", false,
+      kDefaultMaxRequestSize);
+    m_max_pending_requests = static_cast<size_t>(std::max(1, JsonWrapper::getInt(listenerConfig,
+      "max-pending-requests", false, kDefaultMaxPendingRequests)));
+    m_compress_threshold = JsonWrapper::getInt(listenerConfig, "compress-threshold", false,
+      kDefaultCompressThreshold);
+    m_session_grace_ms = std::max(0, JsonWrapper::getInt(listenerConfig, "session-grace-ms", false,
+      kDefaultSessionGraceMs));
+    m_session_replay_bytes = static_cast<size_t>(std::max(0, JsonWrapper::getInt(listenerConfig,
+      "session-replay-bytes", false, kDefaultSessionReplayBytes)));
+  }
+
+  XLOG_INFO("incoming records scanned with %s", recordScanImplementation());
+
   std::shared_ptr<RpcService> s(new RpcSystemService(this));
   registerService(s);
 
@@ -240,24 +334,42 @@ RpcServer::~RpcServer()
 }
 
 void
-RpcServer::setClient(std::shared_ptr<RpcConnectedClient> const& client)
+RpcServer::addClient(std::shared_ptr<RpcConnectedClient> const& client)
 {
+  // the data handler only holds a weak reference, the transport owns the
+  // client and it simply expires here once the remote end goes away
+  std::weak_ptr<RpcConnectedClient> weakClient(client);
+  client->setDataHandler([this, weakClient](char const* buff, int n, RecordCheck check)
+    { this->onIncomingMessage(weakClient, buff, n, check); });
+
+  RpcSession session = RpcSession();
+  session.Token = makeSessionToken();
+  session.Client = client;
+  session.Framing = RecordFraming::Delimited;
+
   std::lock_guard<std::mutex> guard(m_mutex);
-  m_client = client;
+  expireSessions();
+  session.Id = m_next_session_id++;
+  m_sessions.push_back(session);
+
+  if (m_inbound_paused)
+    client->setInboundPaused(true);
 }
 
 void
-RpcServer::stop()
+RpcServer::removeClient(std::shared_ptr<RpcConnectedClient> const& client)
 {
   std::lock_guard<std::mutex> guard(m_mutex);
-  m_client.reset();
+  m_sessions.erase(std::remove_if(m_sessions.begin(), m_sessions.end(),
+    [&client](RpcSession const& s) { return s.Client.lock() == client; }),
+    m_sessions.end());
+  expireSessions();
 }
 
 void
-RpcServer::run()
+RpcServer::run(std::shared_ptr<RpcConnectedClient> const& client)
 {
-  m_client->run();
-  stop();
+  client->run();
 }
 
 void
@@ -266,32 +378,204 @@ RpcServer::enqueueAsyncMessage(cJSON const* json)
   if (!json)
     return;
 
-  char* s = cJSON_PrintUnformatted(json);
-  int n = static_cast<int>(strlen(s));
+  // a newer notification for the same method can stand in for an older
+  // one that hasn't gone out yet
+  char const* method = JsonWrapper::getString(json, "method", false, "");
+  std::string key(method ? method : "");
 
-  XLOG_INFO("notify:%s", s);
+  struct Encoded
+  {
+    bool                        Ready;
+    bool                        Compressed;
+    std::shared_ptr<char const> Buff;
+    int                         Size;
+    int                         RawSize;
+  };
 
+  struct Target
+  {
+    std::shared_ptr<RpcConnectedClient> Client;
+    int                                 Encoding;
+    uint64_t                            SessionId;
+  };
+
+  // the clients are copied out so a producer blocked on a full queue
+  // doesn't hold up incoming requests. a detached session gets its
+  // notifications kept for when it's resumed
+  std::vector<Target> targets;
   {
     std::lock_guard<std::mutex> guard(m_mutex);
-    if (m_client)
-      m_client->enqueueForSend(s, n);
-    free(s);
+    expireSessions();
+    for (RpcSession const& session : m_sessions)
+    {
+      targets.push_back(Target{ session.Client.lock(), (session.Cbor ? 2 : 0) | (session.Compress ? 1 : 0),
+        session.Id });
+    }
   }
+
+  // each encoding is made once, the first time a client needs it. the
+  // json is only printed if a json session is there to read it, and they
+  // all share the one buffer
+  Encoded encoded[4] = {};
+  std::shared_ptr<char const> printed;
+  int printedSize = 0;
+
+  for (Target const& target : targets)
+  {
+    bool cbor = (target.Encoding & 2) != 0;
+    if (!cbor && !printed)
+    {
+      char* s = cJSON_PrintUnformatted(json);
+      if (!s)
+      {
+        XLOG_ERROR("failed to serialize JSON notification to string");
+        return;
+      }
+      XLOG_INFO("notify:%s", s);
+      printed.reset(s, free);
+      printedSize = static_cast<int>(strlen(s));
+    }
+
+    Encoded& e = encoded[target.Encoding];
+    if (!e.Ready)
+    {
+      e.Ready = true;
+      e.Buff = cbor ? std::shared_ptr<char const>() : printed;
+      e.Size = cbor ? 0 : printedSize;
+      e.Compressed = encodeRecord(json, cbor, (target.Encoding & 1) != 0, e.Buff, e.Size, e.RawSize);
+    }
+
+    if (target.Client)
+    {
+      target.Client->enqueueNotification(e.Buff, e.Size, key);
+      countOutbound(target.Client.get(), e.RawSize, e.Size, e.Compressed);
+      continue;
+    }
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    RpcSession* session = findSessionById(target.SessionId);
+    if (session && keepRecord(session->Pending, session->PendingBytes, RpcSessionRecord{ std::string(), e.Buff, e.Size }))
+      XLOG_WARN("session %llu replay buffer full, dropped oldest records",
+        static_cast<unsigned long long>(session->Id));
+  }
+
+  if (!printed)
+    XLOG_INFO("notify:%s, cbor only", key.c_str());
 }
 
 void
-RpcServer::onIncomingMessage(char const* s, int UNUSED_PARAM(n))
+RpcServer::onIncomingMessage(std::weak_ptr<RpcConnectedClient> const& client,
+  char const* s, int n, RecordCheck check)
 {
-  if (!s || strlen(s) == 0)
+  if (!s)
+    return;
+
+  // don't spend any time parsing something that's going to be refused. an
+  // oversized record can be no more than its header so far
+  if (check == RecordCheck::Oversized || n > m_max_request_size)
+  {
+    XLOG_WARN("rejecting request, max size is %d", m_max_request_size);
+    rejectRequest(client, E2BIG, "request too large");
     return;
+  }
+
+  if (n <= 0)
+    return;
+
+  bool busy = false;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    busy = m_incoming_queue.size() >= m_max_pending_requests;
+  }
+
+  // peers are paused once the queue fills, this catches whatever was
+  // already in flight or came in as write-without-response
+  if (busy)
+  {
+    XLOG_WARN("rejecting request, %zu requests already pending", m_max_pending_requests);
+    rejectRequest(client, EBUSY, "server busy");
+    return;
+  }
+
+  // a compressed request is only taken from a client that asked for it,
+  // and it's held to the same size limit once inflated
+  std::vector<char> inflated;
+  if (RpcCompressor::isCompressed(s, n))
+  {
+    std::shared_ptr<RpcConnectedClient> c = client.lock();
+    if (!c || !compressionEnabled(c.get()))
+    {
+      rejectRequest(client, EPROTO, "compression not negotiated");
+      return;
+    }
+
+    if (!m_compressor.decompress(s, n, m_max_request_size, inflated))
+    {
+      rejectRequest(client, EINVAL, "invalid or oversized compressed request");
+      return;
+    }
+
+    countInbound(c.get(), static_cast<int>(inflated.size()) - 1, n);
+    s = inflated.data();
+    n = static_cast<int>(inflated.size()) - 1;
+    check = RecordCheck::Unchecked;
+  }
+
+  // json that isn't UTF-8 is refused before cJSON allocates anything for it
+  if (s[0] != kCborRecordMarker)
+  {
+    if (check == RecordCheck::Unchecked)
+      check = isValidUtf8(s, n) ? RecordCheck::Valid : RecordCheck::Invalid;
+    if (check == RecordCheck::Invalid)
+    {
+      XLOG_WARN("rejecting %d byte request, not valid utf-8", n);
+      rejectRequest(client, EILSEQ, "request is not valid utf-8");
+      return;
+    }
+  }
+
+  // cbor goes straight to cJSON, the services never see the difference.
+  // inside a compressed record it isn't escaped, deflate took care of that
+  cJSON* req = nullptr;
+  if (s[0] == kCborRecordMarker)
+  {
+    std::shared_ptr<RpcConnectedClient> c = client.lock();
+    if (!c || !cborEnabled(c.get()))
+    {
+      rejectRequest(client, EPROTO, "cbor not negotiated");
+      return;
+    }
+
+    std::vector<uint8_t> decoded;
+    if (!inflated.empty())
+      req = JsonWrapper::fromCbor(reinterpret_cast<uint8_t const *>(s) + 1, inflated.size() - 2);
+    else if (unescapeRecord(s, n, decoded))
+      req = JsonWrapper::fromCbor(decoded.data(), decoded.size());
+
+    if (!req)
+    {
+      rejectRequest(client, EINVAL, "invalid cbor request");
+      return;
+    }
+  }
+  else
+  {
+    req = cJSON_Parse(s);
+  }
 
   XLOG_INFO("enqueue new incoming request");
-  std::lock_guard<std::mutex> guard(m_mutex);
 
-  cJSON* req = cJSON_Parse(s);
   if (req)
   {
-    m_incoming_queue.push(req);
+    std::shared_ptr<RpcConnectedClient> c = client.lock();
+    std::lock_guard<std::mutex> guard(m_mutex);
+    RpcSession* session = findSession(c.get());
+    m_incoming_queue.push(RpcIncomingRequest{ req, client, session ? session->Id : 0 });
+
+    // the transports push back on their peers until the backlog drains
+    if (m_incoming_queue.size() >= m_max_pending_requests && !m_inbound_paused)
+      setInboundPaused(true);
+
     m_cond.notify_all();
   }
   else
@@ -308,11 +592,23 @@ RpcServer::processIncomingQueue()
   while (true)
   {
     cJSON* req = nullptr;
-    XLOG_INFO("processing incoming queue");
+    std::weak_ptr<RpcConnectedClient> client;
+    uint64_t sessionId = 0;
 
     {
       std::unique_lock<std::mutex> guard(m_mutex);
-      m_cond.wait(guard, [this] { return !this->m_incoming_queue.empty() || !this->m_running; });
+      auto ready = [this] { return !this->m_incoming_queue.empty() || !this->m_running ||
+        this->m_session_detached; };
+
+      // a detached session has to be dropped on time even when nothing
+      // else is going on. without one there's nothing to wake up for
+      expireSessions();
+      m_session_detached = false;
+      std::chrono::steady_clock::time_point expiry;
+      if (nextSessionExpiry(expiry))
+        m_cond.wait_until(guard, expiry, ready);
+      else
+        m_cond.wait(guard, ready);
 
       if (!m_running)
       {
@@ -320,17 +616,25 @@ RpcServer::processIncomingQueue()
         return;
       }
 
+      expireSessions();
+
       if (!m_incoming_queue.empty())
       {
-        req = m_incoming_queue.front();
+        XLOG_INFO("processing incoming queue");
+        req = m_incoming_queue.front().Request;
+        client = m_incoming_queue.front().Client;
+        sessionId = m_incoming_queue.front().SessionId;
         m_incoming_queue.pop();
+
+        if (m_inbound_paused && m_incoming_queue.size() <= m_max_pending_requests / 2)
+          setInboundPaused(false);
       }
     }
 
     if (req)
     {
       JsonDeleter requestDeleter(req);
-      processRequest(req);
+      processRequest(req, client, sessionId);
     }
   }
 }
@@ -359,7 +663,8 @@ RpcServer::invokeMethod(RpcMethodInfo const& methodInfo, cJSON const* req)
 }
 
 void
-RpcServer::processRequest(cJSON const* req)
+RpcServer::processRequest(cJSON const* req, std::weak_ptr<RpcConnectedClient> const& weakClient,
+  uint64_t sessionId)
 {
   cJSON* res = nullptr;
 
@@ -373,22 +678,98 @@ RpcServer::processRequest(cJSON const* req)
     }
   }
 
+  // the response is encoded the way the session was set up when the
+  // request came in, so the reply to rpc-set-compression or
+  // rpc-set-encoding is readable either way
+  bool compress = false;
+  bool cbor = false;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    RpcSession* session = findSessionById(sessionId);
+    if (session)
+    {
+      compress = session->Compress;
+      cbor = session->Cbor;
+    }
+  }
+
   // ensure json-rpc request
+  m_current_client = weakClient;
   if (!JsonWrapper::getString(req, "jsonrpc", false, nullptr))
     res = processNonJsonRpcRequest(req);
   else
     res = processJsonRpcRequest(req);
+  m_current_client.reset();
 
-  char* s = cJSON_Print(res);
-  if (s)
+  // a cbor session gets its response encoded straight from the tree, the
+  // json is only printed for a session that's going to read it
+  std::shared_ptr<char const> encoded;
+  int encodedSize = 0;
+  if (!cbor)
+  {
+    char* s = cJSON_Print(res);
+    if (s)
+    {
+      XLOG_INFO("res:%s", s);
+      encoded.reset(s, free);
+      encodedSize = static_cast<int>(strlen(s));
+    }
+  }
+
+  int n = 0;
+  bool compressed = false;
+  if (encoded || cbor)
+    compressed = encodeRecord(res, cbor, compress, encoded, encodedSize, n);
+
+  if (encoded)
   {
-    XLOG_INFO("res:%s", s);
+    if (cbor)
+      XLOG_INFO("res:%d bytes of cbor", encodedSize);
+    RpcSessionRecord record{ requestIdKey(cJSON_GetObjectItem(req, "id")), encoded, encodedSize };
+
+    // responses only go back to the session that sent the request. it may
+    // have been resumed on a new connection since, or be waiting for one
+    std::shared_ptr<RpcConnectedClient> client;
     {
       std::lock_guard<std::mutex> guard(m_mutex);
-      if (m_client)
-        m_client->enqueueForSend(s, strlen(s));
+      expireSessions();
+      RpcSession* session = findSessionById(sessionId);
+      if (!session)
+      {
+        client = weakClient.lock();
+      }
+      else if ((client = session->Client.lock()))
+      {
+        if (m_session_grace_ms > 0)
+          keepRecord(session->Sent, session->SentBytes, record);
+      }
+      else
+      {
+        XLOG_INFO("session %llu detached, keeping response for replay",
+          static_cast<unsigned long long>(session->Id));
+        if (keepRecord(session->Pending, session->PendingBytes, record))
+          XLOG_WARN("session %llu replay buffer full, dropped oldest records",
+            static_cast<unsigned long long>(session->Id));
+      }
+    }
+
+    if (client)
+    {
+      // the reply to rpc-set-framing is the last record framed the old way
+      RecordFraming framing = RecordFraming::Delimited;
+      if (takeReframe(client.get(), framing))
+        client->enqueueWithFraming(encoded, encodedSize, framing);
+      else
+        client->enqueueForSend(encoded, encodedSize);
+      countOutbound(client.get(), n, encodedSize, compressed);
+
+      // a resumed session gets what it missed right after the reply
+      replayPending(client);
+    }
+    else
+    {
+      XLOG_INFO("client disconnected before response was sent");
     }
-    free(s);
   }
   else
   {
@@ -424,6 +805,279 @@ RpcServer::processNonJsonRpcRequest(cJSON const* req)
   return res;
 }
 
+void
+RpcServer::rejectRequest(std::weak_ptr<RpcConnectedClient> const& weakClient, int code,
+  char const* message)
+{
+  std::shared_ptr<RpcConnectedClient> client = weakClient.lock();
+  if (!client)
+    return;
+
+  // the request was never parsed so there's no id to echo back. this runs
+  // on the transport's thread, so the reply can't wait on its queue
+  cJSON* res = JsonWrapper::wrapResponse(code, JsonWrapper::makeError(code, "%s", message), -1);
+  char* s = cJSON_PrintUnformatted(res);
+  if (s)
+    client->enqueueError(std::shared_ptr<char const>(s, free), strlen(s));
+  cJSON_Delete(res);
+}
+
+void
+RpcServer::setInboundPaused(bool paused)
+{
+  // m_mutex is held by the caller
+  XLOG_INFO("%s inbound requests, %zu pending", paused ? "pausing" : "resuming",
+    m_incoming_queue.size());
+
+  m_inbound_paused = paused;
+  for (RpcSession const& session : m_sessions)
+  {
+    std::shared_ptr<RpcConnectedClient> client = session.Client.lock();
+    if (client)
+      client->setInboundPaused(paused);
+  }
+}
+
+RpcServer::RpcSession*
+RpcServer::findSession(RpcConnectedClient const* client)
+{
+  // m_mutex is held by the caller
+  for (RpcSession& session : m_sessions)
+  {
+    if (session.Client.lock().get() == client)
+      return &session;
+  }
+  return nullptr;
+}
+
+RpcServer::RpcSession*
+RpcServer::findSessionById(uint64_t id)
+{
+  // m_mutex is held by the caller
+  for (RpcSession& session : m_sessions)
+  {
+    if (session.Id == id)
+      return &session;
+  }
+  return nullptr;
+}
+
+void
+RpcServer::expireSessions()
+{
+  // m_mutex is held by the caller
+  auto now = std::chrono::steady_clock::now();
+  for (auto itr = m_sessions.begin(); itr != m_sessions.end(); )
+  {
+    if (!itr->Detached && itr->Client.expired())
+    {
+      itr->Detached = true;
+      itr->DetachedAt = now;
+      itr->Replay = false;
+      if (m_session_grace_ms > 0)
+      {
+        XLOG_INFO("session %llu detached, can be resumed for %d ms",
+          static_cast<unsigned long long>(itr->Id), m_session_grace_ms);
+
+        // the dispatch thread may be waiting with no expiry to wake up for
+        m_session_detached = true;
+        m_cond.notify_all();
+      }
+    }
+
+    if (itr->Detached && now - itr->DetachedAt >= std::chrono::milliseconds(m_session_grace_ms))
+    {
+      if (m_session_grace_ms > 0)
+        XLOG_INFO("session %llu expired with %zu records pending",
+          static_cast<unsigned long long>(itr->Id), itr->Pending.size());
+      itr = m_sessions.erase(itr);
+    }
+    else
+    {
+      ++itr;
+    }
+  }
+}
+
+bool
+RpcServer::nextSessionExpiry(std::chrono::steady_clock::time_point& expiry)
+{
+  // m_mutex is held by the caller
+  bool found = false;
+  for (RpcSession const& session : m_sessions)
+  {
+    if (!session.Detached)
+      continue;
+
+    auto t = session.DetachedAt + std::chrono::milliseconds(m_session_grace_ms);
+    if (!found || t < expiry)
+      expiry = t;
+    found = true;
+  }
+  return found;
+}
+
+size_t
+RpcServer::keepRecord(std::deque<RpcSessionRecord>& records, size_t& bytes, RpcSessionRecord const& record)
+{
+  // m_mutex is held by the caller. returns how many of the oldest records
+  // were dropped to make room
+  records.push_back(record);
+  bytes += record.Size;
+
+  size_t dropped = 0;
+  while (bytes > m_session_replay_bytes && !records.empty())
+  {
+    bytes -= records.front().Size;
+    records.pop_front();
+    dropped++;
+  }
+  return dropped;
+}
+
+void
+RpcServer::replayPending(std::shared_ptr<RpcConnectedClient> const& client)
+{
+  std::deque<RpcSessionRecord> records;
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    RpcSession* session = findSession(client.get());
+    if (!session || !session->Replay)
+      return;
+
+    session->Replay = false;
+    records.swap(session->Pending);
+    session->PendingBytes = 0;
+
+    // replayed responses can get lost again the same way
+    for (RpcSessionRecord const& record : records)
+    {
+      if (!record.Id.empty())
+        keepRecord(session->Sent, session->SentBytes, record);
+    }
+  }
+
+  XLOG_INFO("replaying %zu records", records.size());
+  for (RpcSessionRecord const& record : records)
+    client->enqueueForSend(record.Buff, record.Size);
+}
+
+bool
+RpcServer::compressionEnabled(RpcConnectedClient const* client)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  RpcSession* session = findSession(client);
+  return session && session->Compress;
+}
+
+bool
+RpcServer::cborEnabled(RpcConnectedClient const* client)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  RpcSession* session = findSession(client);
+  return session && session->Cbor;
+}
+
+bool
+RpcServer::takeReframe(RpcConnectedClient const* client, RecordFraming& framing)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  RpcSession* session = findSession(client);
+  if (!session || !session->Reframe)
+    return false;
+
+  session->Reframe = false;
+  framing = session->Framing;
+  return true;
+}
+
+bool
+RpcServer::compressRecord(char const* buff, int n, std::shared_ptr<char const>& out, int& outSize)
+{
+  // tiny replies don't have enough in them to win back the marker
+  if (n < m_compress_threshold)
+    return false;
+
+  std::vector<char> deflated;
+  if (!m_compressor.compress(buff, n, deflated))
+    return false;
+
+  out = shareRecord(deflated);
+  outSize = static_cast<int>(deflated.size());
+  return true;
+}
+
+bool
+RpcServer::encodeRecord(cJSON const* json, bool cbor, bool compress, std::shared_ptr<char const>& out,
+  int& outSize, int& rawSize)
+{
+  // for json, out comes in holding the printed json and is left alone when
+  // that's already the best there is. cbor is encoded from the tree and
+  // whatever out held is ignored. rawSize is what the record came to
+  // before deflate, returns true if it went through deflate
+  if (!cbor)
+  {
+    rawSize = outSize;
+    if (!compress)
+      return false;
+    return compressRecord(out.get(), outSize, out, outSize);
+  }
+
+  std::vector<uint8_t> encoded;
+  JsonWrapper::toCbor(json, encoded);
+
+  // deflate gets the marker and the raw cbor, the stream it produces is
+  // escaped on its own
+  std::vector<char> record;
+  if (compress)
+  {
+    record.reserve(encoded.size() + 1);
+    record.push_back(kCborRecordMarker);
+    record.insert(record.end(), encoded.begin(), encoded.end());
+    rawSize = static_cast<int>(record.size());
+    if (compressRecord(record.data(), static_cast<int>(record.size()), out, outSize))
+      return true;
+  }
+
+  escapeRecord(kCborRecordMarker, encoded.data(), encoded.size(), record);
+  out = shareRecord(record);
+  outSize = static_cast<int>(record.size());
+  rawSize = outSize;
+  return false;
+}
+
+void
+RpcServer::countOutbound(RpcConnectedClient const* client, int n, int wireSize, bool compressed)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  RpcSession* session = findSession(client);
+  for (RpcCompressionStats* stats : { session ? &session->Stats : nullptr, &m_compression_totals })
+  {
+    if (!stats)
+      continue;
+    stats->RecordsOut++;
+    if (compressed)
+      stats->RecordsCompressed++;
+    stats->BytesOut += n;
+    stats->WireBytesOut += wireSize;
+  }
+}
+
+void
+RpcServer::countInbound(RpcConnectedClient const* client, int n, int wireSize)
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  RpcSession* session = findSession(client);
+  for (RpcCompressionStats* stats : { session ? &session->Stats : nullptr, &m_compression_totals })
+  {
+    if (!stats)
+      continue;
+    stats->RecordsIn++;
+    stats->BytesIn += n;
+    stats->WireBytesIn += wireSize;
+  }
+}
+
 cJSON*
 RpcServer::processJsonRpcRequest(cJSON const* req)
 {
@@ -525,6 +1179,288 @@ RpcServer::RpcSystemService::init(cJSON const* UNUSED_PARAM(config),
   registerMethod("list-methods", [this](cJSON const* req) -> cJSON* { return this->listMethods(req); });
   registerMethod("get-server-pubkey", [this](cJSON const* req) -> cJSON* { return this->getServerPublicKey(req); });
   registerMethod("set-client-pubkey", [this](cJSON const* req) -> cJSON* { return this->setClientPublicKey(req); });
+  registerMethod("set-compression", [this](cJSON const* req) -> cJSON* { return this->setCompression(req); });
+  registerMethod("set-encoding", [this](cJSON const* req) -> cJSON* { return this->setEncoding(req); });
+  registerMethod("set-framing", [this](cJSON const* req) -> cJSON* { return this->setFraming(req); });
+  registerMethod("get-stats", [this](cJSON const* req) -> cJSON* { return this->getStats(req); });
+  registerMethod("set-capture", [this](cJSON const* req) -> cJSON* { return this->setCapture(req); });
+  registerMethod("get-session", [this](cJSON const* req) -> cJSON* { return this->getSession(req); });
+  registerMethod("resume-session", [this](cJSON const* req) -> cJSON* { return this->resumeSession(req); });
+}
+
+cJSON*
+RpcServer::RpcSystemService::setCompression(cJSON const* req)
+{
+  char const* algorithm = nullptr;
+  cJSON const* params = cJSON_GetObjectItem(req, "params");
+  if (params)
+    algorithm = JsonWrapper::getString(params, "algorithm", false, nullptr);
+  if (!algorithm)
+    return JsonWrapper::makeError(EINVAL, "missing params.algorithm");
+
+  bool compress = false;
+  if (strcmp(algorithm, "deflate") == 0)
+  {
+    int version = JsonWrapper::getInt(params, "dictionary", false, -1);
+    if (version != RpcCompressor::dictionaryVersion())
+      return JsonWrapper::makeError(EINVAL, "unsupported dictionary %d, server has %d", version,
+        RpcCompressor::dictionaryVersion());
+    compress = true;
+  }
+  else if (strcmp(algorithm, "none") != 0)
+  {
+    return JsonWrapper::makeError(EINVAL, "unsupported algorithm %s", algorithm);
+  }
+
+  std::shared_ptr<RpcConnectedClient> client = m_server->m_current_client.lock();
+  {
+    std::lock_guard<std::mutex> guard(m_server->m_mutex);
+    RpcSession* session = m_server->findSession(client.get());
+    if (!session)
+      return JsonWrapper::makeError(ENOENT, "no session for this request");
+    session->Compress = compress;
+  }
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddStringToObject(res, "algorithm", algorithm);
+  if (compress)
+  {
+    cJSON_AddNumberToObject(res, "dictionary", RpcCompressor::dictionaryVersion());
+    cJSON_AddNumberToObject(res, "threshold", m_server->m_compress_threshold);
+  }
+  return res;
+}
+
+cJSON*
+RpcServer::RpcSystemService::setEncoding(cJSON const* req)
+{
+  char const* encoding = nullptr;
+  cJSON const* params = cJSON_GetObjectItem(req, "params");
+  if (params)
+    encoding = JsonWrapper::getString(params, "encoding", false, nullptr);
+  if (!encoding)
+    return JsonWrapper::makeError(EINVAL, "missing params.encoding");
+
+  bool cbor = false;
+  if (strcmp(encoding, "cbor") == 0)
+    cbor = true;
+  else if (strcmp(encoding, "json") != 0)
+    return JsonWrapper::makeError(EINVAL, "unsupported encoding %s", encoding);
+
+  std::shared_ptr<RpcConnectedClient> client = m_server->m_current_client.lock();
+  {
+    std::lock_guard<std::mutex> guard(m_server->m_mutex);
+    RpcSession* session = m_server->findSession(client.get());
+    if (!session)
+      return JsonWrapper::makeError(ENOENT, "no session for this request");
+    session->Cbor = cbor;
+  }
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddStringToObject(res, "encoding", encoding);
+  return res;
+}
+
+cJSON*
+RpcServer::RpcSystemService::setFraming(cJSON const* req)
+{
+  char const* name = nullptr;
+  cJSON const* params = cJSON_GetObjectItem(req, "params");
+  if (params)
+    name = JsonWrapper::getString(params, "framing", false, nullptr);
+  if (!name)
+    return JsonWrapper::makeError(EINVAL, "missing params.framing");
+
+  RecordFraming framing;
+  if (strcmp(name, "length-prefixed") == 0)
+    framing = RecordFraming::LengthPrefixed;
+  else if (strcmp(name, "delimited") == 0)
+    framing = RecordFraming::Delimited;
+  else
+    return JsonWrapper::makeError(EINVAL, "unsupported framing %s", name);
+
+  std::shared_ptr<RpcConnectedClient> client = m_server->m_current_client.lock();
+  if (client && !client->supportsFraming(framing))
+    return JsonWrapper::makeError(ENOTSUP, "framing %s not supported on this transport", name);
+
+  // the switch happens when the reply is queued
+  {
+    std::lock_guard<std::mutex> guard(m_server->m_mutex);
+    RpcSession* session = m_server->findSession(client.get());
+    if (!session)
+      return JsonWrapper::makeError(ENOENT, "no session for this request");
+    session->Reframe = true;
+    session->Framing = framing;
+  }
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddStringToObject(res, "framing", name);
+  cJSON_AddNumberToObject(res, "max-request-size", m_server->m_max_request_size);
+  return res;
+}
+
+namespace
+{
+  cJSON* compressionStatsToJson(RpcCompressionStats const& stats)
+  {
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "records-out", stats.RecordsOut);
+    cJSON_AddNumberToObject(json, "records-compressed", stats.RecordsCompressed);
+    cJSON_AddNumberToObject(json, "bytes-out", stats.BytesOut);
+    cJSON_AddNumberToObject(json, "wire-bytes-out", stats.WireBytesOut);
+    cJSON_AddNumberToObject(json, "ratio-out", stats.WireBytesOut
+      ? static_cast<double>(stats.BytesOut) / stats.WireBytesOut : 1.0);
+    cJSON_AddNumberToObject(json, "records-in", stats.RecordsIn);
+    cJSON_AddNumberToObject(json, "bytes-in", stats.BytesIn);
+    cJSON_AddNumberToObject(json, "wire-bytes-in", stats.WireBytesIn);
+    cJSON_AddNumberToObject(json, "ratio-in", stats.WireBytesIn
+      ? static_cast<double>(stats.BytesIn) / stats.WireBytesIn : 1.0);
+    return json;
+  }
+}
+
+cJSON*
+RpcServer::RpcSystemService::getStats(cJSON const* UNUSED_PARAM(req))
+{
+  std::shared_ptr<RpcConnectedClient> client = m_server->m_current_client.lock();
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON* compression = cJSON_CreateObject();
+  cJSON_AddItemToObject(res, "compression", compression);
+
+  std::lock_guard<std::mutex> guard(m_server->m_mutex);
+  RpcSession* session = m_server->findSession(client.get());
+  if (session)
+  {
+    cJSON_AddStringToObject(res, "encoding", session->Cbor ? "cbor" : "json");
+    cJSON_AddStringToObject(compression, "algorithm", session->Compress ? "deflate" : "none");
+    cJSON_AddItemToObject(compression, "session", compressionStatsToJson(session->Stats));
+  }
+  cJSON_AddItemToObject(compression, "total", compressionStatsToJson(m_server->m_compression_totals));
+
+  cJSON* link = client ? client->linkStats() : nullptr;
+  if (link)
+    cJSON_AddItemToObject(res, "link", link);
+  return res;
+}
+
+cJSON*
+RpcServer::RpcSystemService::setCapture(cJSON const* req)
+{
+  cJSON const* enabled = JsonWrapper::search(req, "/params/enabled", false);
+  if (!cJSON_IsBool(enabled))
+    return JsonWrapper::makeError(EINVAL, "missing params.enabled");
+
+  std::shared_ptr<RpcConnectedClient> client = m_server->m_current_client.lock();
+  cJSON* res = client ? client->setCapture(cJSON_IsTrue(enabled)) : nullptr;
+  if (!res)
+    return JsonWrapper::makeError(ENOTSUP, "capture not available on this transport");
+  return res;
+}
+
+cJSON*
+RpcServer::RpcSystemService::getSession(cJSON const* UNUSED_PARAM(req))
+{
+  if (m_server->m_session_grace_ms <= 0)
+    return JsonWrapper::makeError(ENOTSUP, "session resumption is disabled");
+
+  std::shared_ptr<RpcConnectedClient> client = m_server->m_current_client.lock();
+
+  std::lock_guard<std::mutex> guard(m_server->m_mutex);
+  RpcSession* session = m_server->findSession(client.get());
+  if (!session)
+    return JsonWrapper::makeError(ENOENT, "no session for this request");
+  if (session->Token.empty())
+    return JsonWrapper::makeError(EIO, "no token for this session");
+
+  cJSON* res = cJSON_CreateObject();
+  cJSON_AddStringToObject(res, "token", session->Token.c_str());
+  cJSON_AddNumberToObject(res, "grace-ms", m_server->m_session_grace_ms);
+  cJSON_AddNumberToObject(res, "replay-bytes", m_server->m_session_replay_bytes);
+  return res;
+}
+
+cJSON*
+RpcServer::RpcSystemService::resumeSession(cJSON const* req)
+{
+  char const* token = nullptr;
+  cJSON const* params = cJSON_GetObjectItem(req, "params");
+  if (params)
+    token = JsonWrapper::getString(params, "token", false, nullptr);
+  if (!token || !token[0])
+    return JsonWrapper::makeError(EINVAL, "missing params.token");
+
+  std::shared_ptr<RpcConnectedClient> client = m_server->m_current_client.lock();
+
+  cJSON* res = cJSON_CreateObject();
+  {
+    std::lock_guard<std::mutex> guard(m_server->m_mutex);
+    m_server->expireSessions();
+
+    RpcSession* current = m_server->findSession(client.get());
+    if (!current)
+    {
+      cJSON_Delete(res);
+      return JsonWrapper::makeError(ENOENT, "no session for this request");
+    }
+
+    uint64_t currentId = current->Id;
+    auto resumed = std::find_if(m_server->m_sessions.begin(), m_server->m_sessions.end(),
+      [token, currentId](RpcSession const& s) { return s.Id != currentId && s.Token == token; });
+    if (resumed == m_server->m_sessions.end())
+    {
+      cJSON_Delete(res);
+      return JsonWrapper::makeError(ENOENT, "unknown or expired session");
+    }
+    if (!resumed->Detached)
+    {
+      cJSON_Delete(res);
+      return JsonWrapper::makeError(EBUSY, "session is still connected");
+    }
+
+    // params.pending lists the ids of requests the client never got a
+    // response to, they may have been lost in the transport's queue.
+    // everything produced while detached goes out after them
+    std::deque<RpcSessionRecord> replay;
+    cJSON const* pending = params ? cJSON_GetObjectItem(params, "pending") : nullptr;
+    for (int i = 0, n = cJSON_GetArraySize(pending); i < n; ++i)
+    {
+      std::string id = requestIdKey(cJSON_GetArrayItem(pending, i));
+      for (RpcSessionRecord const& record : resumed->Sent)
+      {
+        if (!id.empty() && record.Id == id)
+          replay.push_back(record);
+      }
+    }
+    replay.insert(replay.end(), resumed->Pending.begin(), resumed->Pending.end());
+
+    // the framing belongs to the new connection, the negotiated encoding
+    // and the stats stay with the session
+    resumed->Client = current->Client;
+    resumed->Framing = current->Framing;
+    resumed->Reframe = current->Reframe;
+    resumed->Detached = false;
+    resumed->Sent.clear();
+    resumed->SentBytes = 0;
+    resumed->Pending.swap(replay);
+    resumed->PendingBytes = 0;
+    for (RpcSessionRecord const& record : resumed->Pending)
+      resumed->PendingBytes += record.Size;
+    resumed->Replay = true;
+
+    XLOG_INFO("session %llu resumed, replaying %zu records",
+      static_cast<unsigned long long>(resumed->Id), resumed->Pending.size());
+
+    cJSON_AddStringToObject(res, "token", token);
+    cJSON_AddNumberToObject(res, "replay", resumed->Pending.size());
+    cJSON_AddStringToObject(res, "encoding", resumed->Cbor ? "cbor" : "json");
+    cJSON_AddStringToObject(res, "compression", resumed->Compress ? "deflate" : "none");
+
+    m_server->m_sessions.erase(std::remove_if(m_server->m_sessions.begin(), m_server->m_sessions.end(),
+      [currentId](RpcSession const& s) { return s.Id == currentId; }),
+      m_server->m_sessions.end());
+  }
+  return res;
 }
 
 cJSON*
@@ -16,24 +16,49 @@
 #ifndef __RPC_SERVER_H__
 #define __RPC_SERVER_H__
 
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <queue>
+#include <string>
 #include <thread>
+#include <vector>
+#include "defs.h"
 #include "gattdata.h"
+#include "rpccompression.h"
+#include "recordscan.h"
 
 struct cJSON;
 class RpcService;
 
-using RpcDataHandler = std::function<void (char const* buff, int n)>;
+// n is always the number of bytes at buff. a record longer than the
+// transport's max-request-size is still handed over once, as far as it's
+// arrived, with RecordCheck::Oversized so the server can reject it without
+// parsing it. a transport that scanned the record for its delimiter says
+// whether it was UTF-8, otherwise the server checks
+using RpcDataHandler = std::function<void (char const* buff, int n, RecordCheck check)>;
 using RpcNotificationFunction = std::function<void (cJSON const* json)>;
 using RpcMethod = std::function<cJSON* (cJSON const* req)>;
 using RpcMethodMap = std::map< std::string, RpcMethod >;
 using RpcServiceConstructor = std::function<RpcService* ()>;
 
+enum class RecordFraming
+{
+  // one record per packet, SOCK_SEQPACKET
+  Packet,
+
+  // byte stream with records terminated by kRecordDelimiter
+  Delimited,
+
+  // byte stream with each record preceded by its length as a varint, see
+  // putVarint()
+  LengthPrefixed
+};
+
 class RpcConnectedClient
 {
 public:
@@ -41,8 +66,58 @@ public:
   virtual ~RpcConnectedClient() { }
   virtual void init(DeviceInfoProvider const& deviceInfoProvider, RdkDiagProvider const& rdkDiagProvider) = 0;
   virtual void enqueueForSend(char const* buff, int n) = 0;
+
+  // queues a buffer the caller no longer modifies. transports that keep
+  // their own copy can leave the default
+  virtual void enqueueForSend(std::shared_ptr<char const> const& buff, int n)
+    { enqueueForSend(buff.get(), n); }
+
+  // a reply the server makes up from inside the data handler, on the
+  // transport's own thread. it mustn't wait for room in a full queue, the
+  // thread that would make the room is the one waiting
+  virtual void enqueueError(std::shared_ptr<char const> const& buff, int n)
+    { enqueueForSend(buff, n); }
+
+  // unsolicited messages. transports with a bounded queue may drop these,
+  // or replace a queued one with the same key, where a response never is
+  virtual void enqueueNotification(std::shared_ptr<char const> const& buff, int n,
+    std::string const& UNUSED_PARAM(key))
+    { enqueueForSend(buff, n); }
+
+  // services the connection. transports that drive all of their connections
+  // from a single event loop return immediately
   virtual void run() = 0;
   virtual void setDataHandler(RpcDataHandler const& handler) = 0;
+
+  // asks the transport to stop taking new requests from the peer while the
+  // server works through its backlog
+  virtual void setInboundPaused(bool UNUSED_PARAM(paused)) { }
+
+  // whether the peer can switch the connection to framing with
+  // rpc-set-framing
+  virtual bool supportsFraming(RecordFraming UNUSED_PARAM(framing)) const
+    { return false; }
+
+  // queues the reply to rpc-set-framing in the current framing and frames
+  // everything after it, in both directions, the new way. the switch is
+  // posted to the thread that reads from the peer before the reply can go
+  // out, and made there at the next record boundary. the peer doesn't
+  // write in the new framing until it has the reply, and mustn't write
+  // anything between the request and the reply
+  virtual void enqueueWithFraming(std::shared_ptr<char const> const& buff, int n,
+    RecordFraming UNUSED_PARAM(framing))
+    { enqueueForSend(buff, n); }
+
+  // what the transport knows about the link to the peer, reported by
+  // rpc-get-stats. the caller owns the result
+  virtual cJSON* linkStats() const
+    { return nullptr; }
+
+  // turns the transport's packet capture on or off and reports on it, for
+  // rpc-set-capture. nullptr when the transport can't capture. the caller
+  // owns the result
+  virtual cJSON* setCapture(bool UNUSED_PARAM(enabled))
+    { return nullptr; }
 };
 
 class RpcService
@@ -101,7 +176,7 @@ public:
     accept(DeviceInfoProvider const& deviceInfoProvider, RdkDiagProvider const& rdkDiagProvider) = 0;
 
 public:
-  static std::shared_ptr<RpcListener> create();
+  static std::shared_ptr<RpcListener> create(cJSON const* conf);
 };
 
 class RpcServer
@@ -122,6 +197,13 @@ private:
     cJSON* listMethods(cJSON const* req);
     cJSON* getServerPublicKey(cJSON const* req);
     cJSON* setClientPublicKey(cJSON const* req);
+    cJSON* setCompression(cJSON const* req);
+    cJSON* setEncoding(cJSON const* req);
+    cJSON* setFraming(cJSON const* req);
+    cJSON* getStats(cJSON const* req);
+    cJSON* setCapture(cJSON const* req);
+    cJSON* getSession(cJSON const* req);
+    cJSON* resumeSession(cJSON const* req);
   private:
     RpcServer* m_server;
   };
@@ -138,35 +220,108 @@ private:
     static RpcMethodInfo parseMethod(char const* s);
   };
 
+  // an encoded record kept for replay. Id is the request id of a response
+  // printed as json, empty for a notification
+  struct RpcSessionRecord
+  {
+    std::string                       Id;
+    std::shared_ptr<char const>       Buff;
+    int                               Size;
+  };
+
+  struct RpcSession
+  {
+    uint64_t                          Id;
+    std::string                       Token;
+    std::weak_ptr<RpcConnectedClient> Client;
+    bool                              Compress;
+    bool                              Cbor;
+    bool                              Reframe;
+    RecordFraming                     Framing;
+    RpcCompressionStats               Stats;
+
+    // set once the client has gone away, the session is dropped when the
+    // grace period runs out without a rpc-resume-session
+    bool                              Detached;
+    std::chrono::steady_clock::time_point DetachedAt;
+
+    // the last responses handed to the transport, which may still have
+    // been sitting in its queue when the link dropped
+    std::deque<RpcSessionRecord>      Sent;
+    size_t                            SentBytes;
+
+    // everything produced for the session while it was detached, and
+    // what's left to replay after a resume
+    std::deque<RpcSessionRecord>      Pending;
+    size_t                            PendingBytes;
+    bool                              Replay;
+  };
+
+  struct RpcIncomingRequest
+  {
+    cJSON*                            Request;
+    std::weak_ptr<RpcConnectedClient> Client;
+    uint64_t                          SessionId;
+  };
+
   friend class RpcSystemService;
 
 public:
-  void setClient(std::shared_ptr<RpcConnectedClient> const& tport);
+  void addClient(std::shared_ptr<RpcConnectedClient> const& client);
+  void removeClient(std::shared_ptr<RpcConnectedClient> const& client);
   void registerService(std::shared_ptr<RpcService> const& service);
-  void stop();
-  void run();
+  void run(std::shared_ptr<RpcConnectedClient> const& client);
   void enqueueAsyncMessage(cJSON const* json);
-  void onIncomingMessage(const char* buff, int n);
+  void onIncomingMessage(std::weak_ptr<RpcConnectedClient> const& client, const char* buff, int n,
+    RecordCheck check);
   void setLastChanceHandler(RpcMethod const& lastChanceHandler);
 
 private:
   void processIncomingQueue();
-  void processRequest(cJSON const* req);
+  void processRequest(cJSON const* req, std::weak_ptr<RpcConnectedClient> const& client,
+    uint64_t sessionId);
+  void rejectRequest(std::weak_ptr<RpcConnectedClient> const& client, int code, char const* message);
+  void setInboundPaused(bool paused);
+  RpcSession* findSession(RpcConnectedClient const* client);
+  RpcSession* findSessionById(uint64_t id);
+  void expireSessions();
+  bool nextSessionExpiry(std::chrono::steady_clock::time_point& expiry);
+  size_t keepRecord(std::deque<RpcSessionRecord>& records, size_t& bytes, RpcSessionRecord const& record);
+  void replayPending(std::shared_ptr<RpcConnectedClient> const& client);
+  bool compressionEnabled(RpcConnectedClient const* client);
+  bool cborEnabled(RpcConnectedClient const* client);
+  bool takeReframe(RpcConnectedClient const* client, RecordFraming& framing);
+  bool compressRecord(char const* buff, int n, std::shared_ptr<char const>& out, int& outSize);
+  bool encodeRecord(cJSON const* json, bool cbor, bool compress, std::shared_ptr<char const>& out,
+    int& outSize, int& rawSize);
+  void countOutbound(RpcConnectedClient const* client, int n, int wireSize, bool compressed);
+  void countInbound(RpcConnectedClient const* client, int n, int wireSize);
   cJSON* processJsonRpcRequest(cJSON const* req);
   cJSON* processNonJsonRpcRequest(cJSON const* req);
   cJSON* invokeMethod(RpcMethodInfo const& methodInfo, cJSON const* req);
 
 private:
-  std::shared_ptr<RpcConnectedClient> m_client;
+  std::vector<RpcSession>             m_sessions;
   std::mutex                          m_mutex;
   std::shared_ptr<std::thread>        m_dispatch_thread;
-  std::queue<cJSON *>                 m_incoming_queue;
+  std::queue<RpcIncomingRequest>      m_incoming_queue;
   std::condition_variable             m_cond;
   std::map< std::string, std::shared_ptr<RpcService> > m_services;
   cJSON*                              m_config;
   std::string                         m_config_file;
   RpcMethod                           m_last_chance;
   bool                                m_running;
+  int                                 m_max_request_size;
+  size_t                              m_max_pending_requests;
+  bool                                m_inbound_paused;
+  RpcCompressor                       m_compressor;
+  int                                 m_compress_threshold;
+  RpcCompressionStats                 m_compression_totals;
+  std::weak_ptr<RpcConnectedClient>   m_current_client;
+  uint64_t                            m_next_session_id;
+  bool                                m_session_detached;
+  int                                 m_session_grace_ms;
+  size_t                              m_session_replay_bytes;
 };
 
 // not sure where to put these
@@ -0,0 +1,831 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#include "socketserver.h"
+#include "../defs.h"
+#include "../logger.h"
+#include "../util.h"
+#include "../jsonwrapper.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+namespace
+{
+  char const* kDefaultSocketPath        {"/var/run/bleconfd.sock"};
+  char const* kDefaultBindAddress       {"127.0.0.1"};
+  int const   kDefaultTcpPort           {10100};
+  int const   kReadChunkSize            {4096};
+  int const   kMaxEvents                {32};
+
+  // cap the number of records read from one client per wakeup so a single
+  // busy client can't starve the others sharing the epoll thread
+  int const   kMaxRecordsPerWakeup      {16};
+}
+
+SocketClient::SocketClient(SocketServer* server, int fd, RecordFraming framing)
+  : RpcConnectedClient()
+  , m_server(server)
+  , m_fd(fd)
+  , m_framing(framing)
+  , m_inbound_framing(framing)
+  , m_reframe_pending(false)
+  , m_reframe_framing(framing)
+  , m_mutex()
+  , m_outgoing_queue()
+  , m_outgoing_offset(0)
+  , m_incoming_buff()
+  , m_incoming_size(0)
+  , m_discarding(false)
+  , m_scanner()
+  , m_discard_remaining(0)
+  , m_paused(false)
+  , m_data_handler(nullptr)
+{
+  if (m_framing == RecordFraming::Packet)
+    m_incoming_buff.resize(m_server->maxRecordSize() + 1);
+}
+
+SocketClient::~SocketClient()
+{
+  close();
+}
+
+void
+SocketClient::init(DeviceInfoProvider const& UNUSED_PARAM(deviceInfoProvider),
+  RdkDiagProvider const& UNUSED_PARAM(rdkDiagProvider))
+{
+  // nothing to publish, the device info is only exposed over GATT
+}
+
+void
+SocketClient::run()
+{
+  // the fd was added to the epoll set without any events when it was
+  // accepted so nothing is read before the data handler is installed
+  std::lock_guard<std::mutex> guard(m_mutex);
+  updateWatch();
+}
+
+void
+SocketClient::setInboundPaused(bool paused)
+{
+  // the kernel socket buffer fills up and the peer's writes block
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (m_paused != paused)
+  {
+    m_paused = paused;
+    updateWatch();
+  }
+}
+
+void
+SocketClient::updateWatch()
+{
+  // m_mutex is held by the caller
+  if (m_fd == -1)
+    return;
+
+  uint32_t events = 0;
+  if (!m_paused)
+    events |= EPOLLIN;
+  if (!m_outgoing_queue.empty())
+    events |= EPOLLOUT;
+  m_server->watch(m_fd, events);
+}
+
+void
+SocketClient::close()
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  if (m_fd != -1)
+  {
+    ::close(m_fd);
+    m_fd = -1;
+  }
+  m_outgoing_queue.clear();
+  m_outgoing_offset = 0;
+}
+
+void
+SocketClient::enqueueForSend(char const* buff, int n)
+{
+  if (!buff)
+  {
+    XLOG_WARN("trying to enqueue null buffer");
+    return;
+  }
+
+  if (n <= 0)
+  {
+    XLOG_WARN("invalid buffer length:%d", n);
+    return;
+  }
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  sendRecord(buff, n);
+}
+
+bool
+SocketClient::supportsFraming(RecordFraming framing) const
+{
+  // datagrams keep their own boundaries, only streams can switch
+  if (m_inbound_framing == RecordFraming::Packet)
+    return framing == RecordFraming::Packet;
+  return framing != RecordFraming::Packet;
+}
+
+void
+SocketClient::enqueueWithFraming(std::shared_ptr<char const> const& buff, int n, RecordFraming framing)
+{
+  if (!buff || n <= 0)
+  {
+    XLOG_WARN("invalid buffer length:%d", n);
+    return;
+  }
+
+  // onReadable() picks the switch up on the epoll thread, it's posted
+  // before the reply can go out
+  m_reframe_framing = framing;
+  m_reframe_pending = true;
+
+  std::lock_guard<std::mutex> guard(m_mutex);
+  sendRecord(buff.get(), n);
+  m_framing = framing;
+}
+
+void
+SocketClient::sendRecord(char const* buff, int n)
+{
+  // m_mutex is held by the caller
+  if (m_fd == -1)
+    return;
+
+  bool delimited = (m_framing == RecordFraming::Delimited);
+  char delim = kRecordDelimiter;
+  char header[kMaxVarintSize];
+  int header_size = 0;
+  if (m_framing == RecordFraming::LengthPrefixed)
+    header_size = putVarint(static_cast<uint32_t>(n), header);
+
+  size_t total = header_size + n + (delimited ? 1 : 0);
+
+  // try to write straight through, only queue if the socket is backed up
+  ssize_t ret = 0;
+  if (m_outgoing_queue.empty())
+  {
+    iovec iov[3];
+    int iovcnt = 0;
+    if (header_size > 0)
+    {
+      iov[iovcnt].iov_base = header;
+      iov[iovcnt++].iov_len = header_size;
+    }
+    iov[iovcnt].iov_base = const_cast<char *>(buff);
+    iov[iovcnt++].iov_len = n;
+    if (delimited)
+    {
+      iov[iovcnt].iov_base = &delim;
+      iov[iovcnt++].iov_len = 1;
+    }
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    ret = sendmsg(m_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret == static_cast<ssize_t>(total))
+      return;
+
+    if (ret < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        XLOG_WARN("failed to send %d bytes on fd:%d. %s", n, m_fd, strerror(errno));
+        return;
+      }
+      ret = 0;
+    }
+  }
+
+  // a stream socket may have taken part of the record, keep the rest
+  std::vector<char> record;
+  record.reserve(total);
+  record.insert(record.end(), header, header + header_size);
+  record.insert(record.end(), buff, buff + n);
+  if (delimited)
+    record.push_back(kRecordDelimiter);
+
+  bool was_empty = m_outgoing_queue.empty();
+  if (ret > 0)
+    m_outgoing_offset = static_cast<size_t>(ret);
+  m_outgoing_queue.push_back(std::move(record));
+
+  if (was_empty)
+    updateWatch();
+}
+
+bool
+SocketClient::onWritable()
+{
+  std::lock_guard<std::mutex> guard(m_mutex);
+  while (!m_outgoing_queue.empty())
+  {
+    std::vector<char> const& record = m_outgoing_queue.front();
+
+    ssize_t ret = send(m_fd, record.data() + m_outgoing_offset, record.size() - m_outgoing_offset,
+      MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      XLOG_WARN("failed to send on fd:%d. %s", m_fd, strerror(errno));
+      return false;
+    }
+
+    m_outgoing_offset += static_cast<size_t>(ret);
+    if (m_outgoing_offset < record.size())
+      return true;
+
+    m_outgoing_queue.pop_front();
+    m_outgoing_offset = 0;
+  }
+
+  updateWatch();
+  return true;
+}
+
+bool
+SocketClient::onReadable()
+{
+  if (m_inbound_framing == RecordFraming::Packet)
+    return readPacket();
+
+  // the framing only switches between two records. when that's part way
+  // through what's buffered, the rest is read again the new way
+  if (atRecordBoundary())
+    takeReframe();
+
+  for (int i = 0; i < kMaxRecordsPerWakeup; ++i)
+  {
+    // the spare byte at the end lets the last record be null terminated in
+    // place like the others
+    if (m_incoming_buff.size() - m_incoming_size < static_cast<size_t>(kReadChunkSize) + 1)
+      m_incoming_buff.resize(m_incoming_size + kReadChunkSize + 1);
+
+    ssize_t n = recv(m_fd, m_incoming_buff.data() + m_incoming_size,
+      m_incoming_buff.size() - m_incoming_size - 1, MSG_DONTWAIT);
+
+    if (n < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      if (errno == EINTR)
+        continue;
+      XLOG_WARN("failed to read from fd:%d. %s", m_fd, strerror(errno));
+      return false;
+    }
+
+    if (n == 0)
+      return false;
+
+    m_incoming_size += static_cast<size_t>(n);
+
+    size_t fresh = static_cast<size_t>(n);
+    while (fresh > 0)
+    {
+      if (m_inbound_framing == RecordFraming::LengthPrefixed)
+      {
+        if (!readLengthPrefixed(fresh))
+          return false;
+      }
+      else
+      {
+        readDelimited(fresh);
+      }
+    }
+  }
+
+  return true;
+}
+
+bool
+SocketClient::atRecordBoundary() const
+{
+  return m_incoming_size == 0 && !m_discarding && m_discard_remaining == 0;
+}
+
+bool
+SocketClient::takeReframe()
+{
+  if (!m_reframe_pending.exchange(false))
+    return false;
+
+  m_inbound_framing = m_reframe_framing.load();
+  m_scanner.reset();
+  return true;
+}
+
+bool
+SocketClient::readPacket()
+{
+  for (int i = 0; i < kMaxRecordsPerWakeup; ++i)
+  {
+    // SOCK_SEQPACKET preserves record boundaries, each recv is exactly one
+    // request. MSG_TRUNC reports the real length of oversized records
+    ssize_t n = recv(m_fd, m_incoming_buff.data(), m_incoming_buff.size() - 1,
+      MSG_DONTWAIT | MSG_TRUNC);
+
+    if (n < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return true;
+      if (errno == EINTR)
+        continue;
+      XLOG_WARN("failed to read from fd:%d. %s", m_fd, strerror(errno));
+      return false;
+    }
+
+    if (n == 0)
+      return false;
+
+    // an oversized record is handed over as far as it was read so it's
+    // rejected without being parsed
+    RecordCheck check = RecordCheck::Unchecked;
+    if (n >= static_cast<ssize_t>(m_incoming_buff.size()))
+    {
+      XLOG_WARN("%zd byte record on fd:%d, max size is %d", n, m_fd, m_server->maxRecordSize());
+      n = static_cast<ssize_t>(m_incoming_buff.size()) - 1;
+      check = RecordCheck::Oversized;
+    }
+    m_incoming_buff[n] = '\0';
+
+    if (m_data_handler)
+      m_data_handler(m_incoming_buff.data(), static_cast<int>(n), check);
+  }
+
+  return true;
+}
+
+void
+SocketClient::readDelimited(size_t& fresh)
+{
+  // only scan the bytes that just arrived, anything before them is a
+  // partial record that's already known not to contain a delimiter and
+  // that the scanner has already checked
+  char* begin = m_incoming_buff.data();
+  char* end = begin + m_incoming_size;
+  char* scan = end - fresh;
+  fresh = 0;
+
+  // the tail of a record that was already rejected for being too big
+  if (m_discarding)
+  {
+    size_t k = findRecordDelimiter(scan, end - scan);
+    if (k == static_cast<size_t>(end - scan))
+    {
+      m_incoming_size = 0;
+      return;
+    }
+
+    m_discarding = false;
+    m_scanner.reset();
+    begin = scan + k + 1;
+    scan = begin;
+
+    if (takeReframe())
+      fresh = static_cast<size_t>(end - begin);
+  }
+
+  while (fresh == 0 && scan < end)
+  {
+    size_t k = m_scanner.scan(scan, end - scan);
+    if (k == static_cast<size_t>(end - scan))
+      break;
+
+    char* p = scan + k;
+    *p = '\0';
+    if (p > begin && m_data_handler)
+      m_data_handler(begin, static_cast<int>(p - begin), m_scanner.check());
+    m_scanner.reset();
+    begin = p + 1;
+    scan = begin;
+
+    if (takeReframe())
+      fresh = static_cast<size_t>(end - begin);
+  }
+
+  m_incoming_size = static_cast<size_t>(end - begin);
+  if (fresh == 0 && m_incoming_size > static_cast<size_t>(m_server->maxRecordSize()))
+  {
+    XLOG_WARN("record on fd:%d exceeds max size of %d bytes without delimiter",
+      m_fd, m_server->maxRecordSize());
+    if (m_data_handler)
+      m_data_handler(begin, static_cast<int>(m_incoming_size), RecordCheck::Oversized);
+    m_incoming_size = 0;
+    m_scanner.reset();
+    m_discarding = true;
+    return;
+  }
+
+  if (m_incoming_size > 0 && begin != m_incoming_buff.data())
+    memmove(m_incoming_buff.data(), begin, m_incoming_size);
+}
+
+bool
+SocketClient::readLengthPrefixed(size_t& fresh)
+{
+  char* begin = m_incoming_buff.data();
+  char* end = begin + m_incoming_size;
+  fresh = 0;
+
+  // the rest of a record that was rejected from its header alone
+  size_t skip = std::min(static_cast<size_t>(m_discard_remaining), static_cast<size_t>(end - begin));
+  m_discard_remaining -= skip;
+  begin += skip;
+  if (skip > 0 && m_discard_remaining == 0 && takeReframe())
+    fresh = static_cast<size_t>(end - begin);
+
+  uint32_t len = 0;
+  int header = 0;
+  while (fresh == 0 && begin < end && (header = getVarint(begin, end - begin, len)) != 0)
+  {
+    // there's no way to find the next record after a bad header
+    if (header < 0)
+    {
+      XLOG_WARN("invalid record length on fd:%d", m_fd);
+      return false;
+    }
+
+    size_t available = static_cast<size_t>(end - begin - header);
+    if (len > static_cast<uint32_t>(m_server->maxRecordSize()))
+    {
+      XLOG_WARN("%u byte record on fd:%d, max size is %d", len, m_fd, m_server->maxRecordSize());
+      size_t k = std::min(static_cast<size_t>(len), available);
+      if (m_data_handler)
+        m_data_handler(begin + header, static_cast<int>(k), RecordCheck::Oversized);
+      m_discard_remaining = len - k;
+      begin += header + k;
+    }
+    else
+    {
+      if (available < len)
+        break;
+
+      char* record = begin + header;
+      char saved = record[len];
+      record[len] = '\0';
+      if (len > 0 && m_data_handler)
+        m_data_handler(record, static_cast<int>(len), RecordCheck::Unchecked);
+      record[len] = saved;
+      begin = record + len;
+    }
+
+    if (m_discard_remaining == 0 && takeReframe())
+      fresh = static_cast<size_t>(end - begin);
+  }
+
+  m_incoming_size = static_cast<size_t>(end - begin);
+  if (m_incoming_size > 0 && begin != m_incoming_buff.data())
+    memmove(m_incoming_buff.data(), begin, m_incoming_size);
+
+  // the header of a partial record says exactly how big the buffer needs
+  // to get, the rest of it is read straight into place
+  if (fresh == 0 && m_incoming_size > 0 && header > 0 && m_incoming_buff.size() < header + len + 1)
+    m_incoming_buff.resize(header + len + 1);
+
+  return true;
+}
+
+SocketServer::SocketServer()
+  : m_max_record_size(kDefaultMaxRequestSize)
+  , m_listen_fd(-1)
+  , m_epoll_fd(-1)
+  , m_wakeup_fd(-1)
+  , m_epoll_thread()
+  , m_mutex()
+  , m_cond()
+  , m_clients()
+  , m_accepted()
+  , m_stopped(false)
+{
+}
+
+SocketServer::~SocketServer()
+{
+  if (m_epoll_thread.joinable())
+  {
+    uint64_t one = 1;
+    if (write(m_wakeup_fd, &one, sizeof(one)) != sizeof(one))
+      XLOG_WARN("failed to signal epoll thread. %s", strerror(errno));
+    m_epoll_thread.join();
+  }
+
+  for (auto& kv : m_clients)
+    kv.second->close();
+
+  if (m_listen_fd != -1)
+    close(m_listen_fd);
+  if (m_wakeup_fd != -1)
+    close(m_wakeup_fd);
+  if (m_epoll_fd != -1)
+    close(m_epoll_fd);
+}
+
+void
+SocketServer::init(cJSON const* listenerConfig)
+{
+  m_max_record_size = JsonWrapper::getInt(listenerConfig, "max-request-size", false,
+    kDefaultMaxRequestSize);
+  m_listen_fd = createListenSocket(listenerConfig);
+
+  m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (m_epoll_fd < 0)
+    throw_errno(errno, "failed to create epoll fd");
+
+  m_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (m_wakeup_fd < 0)
+    throw_errno(errno, "failed to create eventfd");
+
+  epoll_event e;
+  memset(&e, 0, sizeof(e));
+  e.events = EPOLLIN;
+  e.data.fd = m_listen_fd;
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &e) < 0)
+    throw_errno(errno, "failed to add listen socket to epoll set");
+
+  e.data.fd = m_wakeup_fd;
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &e) < 0)
+    throw_errno(errno, "failed to add eventfd to epoll set");
+
+  m_epoll_thread = std::thread([this] { this->run(); });
+}
+
+std::shared_ptr<RpcConnectedClient>
+SocketServer::accept(DeviceInfoProvider const& deviceInfoProvider, RdkDiagProvider const& rdkDiagProvider)
+{
+  std::shared_ptr<SocketClient> clnt;
+
+  {
+    std::unique_lock<std::mutex> guard(m_mutex);
+    m_cond.wait(guard, [this] { return !this->m_accepted.empty() || this->m_stopped; });
+    if (m_stopped)
+      return nullptr;
+    clnt = m_accepted.front();
+    m_accepted.pop();
+  }
+
+  clnt->init(deviceInfoProvider, rdkDiagProvider);
+  return clnt;
+}
+
+std::shared_ptr<SocketClient>
+SocketServer::createClient(int fd)
+{
+  return std::shared_ptr<SocketClient>(new SocketClient(this, fd, RecordFraming::Packet));
+}
+
+void
+SocketServer::stop()
+{
+  {
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_stopped = true;
+  }
+  m_cond.notify_all();
+}
+
+void
+SocketServer::watch(int fd, uint32_t events)
+{
+  epoll_event e;
+  memset(&e, 0, sizeof(e));
+  e.events = events;
+  e.data.fd = fd;
+  if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &e) < 0)
+    XLOG_WARN("failed to modify epoll events for fd:%d. %s", fd, strerror(errno));
+}
+
+void
+SocketServer::acceptConnections()
+{
+  while (true)
+  {
+    int soc = accept4(m_listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (soc < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        XLOG_WARN("failed to accept incoming connection. %s", strerror(errno));
+      return;
+    }
+
+    epoll_event e;
+    memset(&e, 0, sizeof(e));
+    e.events = 0;
+    e.data.fd = soc;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, soc, &e) < 0)
+    {
+      XLOG_WARN("failed to add fd:%d to epoll set. %s", soc, strerror(errno));
+      close(soc);
+      continue;
+    }
+
+    XLOG_INFO("accepted socket connection fd:%d", soc);
+
+    std::shared_ptr<SocketClient> clnt = createClient(soc);
+    m_clients.insert(std::make_pair(soc, clnt));
+
+    {
+      std::lock_guard<std::mutex> guard(m_mutex);
+      m_accepted.push(clnt);
+    }
+    m_cond.notify_one();
+  }
+}
+
+void
+SocketServer::closeClient(int fd)
+{
+  auto itr = m_clients.find(fd);
+  if (itr == m_clients.end())
+    return;
+
+  XLOG_INFO("closing socket connection fd:%d", fd);
+  epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+  itr->second->close();
+  m_clients.erase(itr);
+}
+
+void
+SocketServer::run()
+{
+  epoll_event events[kMaxEvents];
+
+  while (true)
+  {
+    int n = epoll_wait(m_epoll_fd, events, kMaxEvents, -1);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      XLOG_ERROR("epoll_wait failed. %s", strerror(errno));
+      return;
+    }
+
+    for (int i = 0; i < n; ++i)
+    {
+      int fd = events[i].data.fd;
+      uint32_t flags = events[i].events;
+
+      if (fd == m_wakeup_fd)
+      {
+        XLOG_INFO("socket server epoll thread got shutdown signal");
+        return;
+      }
+
+      if (fd == m_listen_fd)
+      {
+        acceptConnections();
+        continue;
+      }
+
+      auto itr = m_clients.find(fd);
+      if (itr == m_clients.end())
+        continue;
+
+      // hold a reference, the client may be closed below
+      std::shared_ptr<SocketClient> clnt = itr->second;
+
+      bool ok = true;
+      if (flags & EPOLLIN)
+        ok = clnt->onReadable();
+      if (ok && (flags & EPOLLOUT))
+        ok = clnt->onWritable();
+      if (!ok || (flags & (EPOLLHUP | EPOLLERR)))
+        closeClient(fd);
+    }
+  }
+}
+
+UnixSocketServer::UnixSocketServer()
+  : SocketServer()
+  , m_path()
+{
+}
+
+UnixSocketServer::~UnixSocketServer()
+{
+  if (!m_path.empty())
+    unlink(m_path.c_str());
+}
+
+int
+UnixSocketServer::createListenSocket(cJSON const* listenerConfig)
+{
+  char const* path = JsonWrapper::getString(listenerConfig, "socket-path", false, kDefaultSocketPath);
+
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    throw_errno(ENAMETOOLONG, "invalid unix socket path %s", path);
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  int soc = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (soc < 0)
+    throw_errno(errno, "failed to create unix socket");
+
+  // stale socket file from a previous run
+  unlink(path);
+
+  int ret = bind(soc, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+  if (ret < 0)
+    throw_errno(errno, "failed to bind unix socket to %s", path);
+
+  ret = listen(soc, SOMAXCONN);
+  if (ret < 0)
+    throw_errno(errno, "failed to listen on unix socket %s", path);
+
+  m_path = path;
+  XLOG_INFO("listening for rpc clients on unix socket %s", path);
+
+  return soc;
+}
+
+TcpSocketServer::TcpSocketServer()
+  : SocketServer()
+{
+}
+
+TcpSocketServer::~TcpSocketServer()
+{
+}
+
+int
+TcpSocketServer::createListenSocket(cJSON const* listenerConfig)
+{
+  char const* address = JsonWrapper::getString(listenerConfig, "bind-address", false, kDefaultBindAddress);
+  int port = JsonWrapper::getInt(listenerConfig, "tcp-port", false, kDefaultTcpPort);
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<uint16_t>(port));
+  if (inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+    throw_errno(EINVAL, "invalid tcp bind address %s", address);
+
+  int soc = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (soc < 0)
+    throw_errno(errno, "failed to create tcp socket");
+
+  int on = 1;
+  if (setsockopt(soc, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+    throw_errno(errno, "failed to set SO_REUSEADDR on tcp socket");
+
+  int ret = bind(soc, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+  if (ret < 0)
+    throw_errno(errno, "failed to bind tcp socket to %s:%d", address, port);
+
+  ret = listen(soc, SOMAXCONN);
+  if (ret < 0)
+    throw_errno(errno, "failed to listen on tcp socket %s:%d", address, port);
+
+  XLOG_INFO("listening for rpc clients on tcp %s:%d", address, port);
+
+  return soc;
+}
+
+std::shared_ptr<SocketClient>
+TcpSocketServer::createClient(int fd)
+{
+  // responses are written in one go, don't let nagle hold back the tail
+  int on = 1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+    XLOG_WARN("failed to set TCP_NODELAY on fd:%d. %s", fd, strerror(errno));
+
+  return std::shared_ptr<SocketClient>(new SocketClient(this, fd, RecordFraming::Delimited));
+}
@@ -0,0 +1,153 @@
+//
+// Copyright [2019] [Comcast, Corp]
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef __SOCKET_SERVER_H__
+#define __SOCKET_SERVER_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+#include "../rpcserver.h"
+
+class SocketServer;
+
+class SocketClient : public RpcConnectedClient
+{
+public:
+  SocketClient(SocketServer* server, int fd, RecordFraming framing);
+  virtual ~SocketClient();
+
+  virtual void init(DeviceInfoProvider const& deviceInfoProvider, RdkDiagProvider const& rdkDiagProvider) override;
+  using RpcConnectedClient::enqueueForSend;
+  virtual void enqueueForSend(char const* buff, int n) override;
+  virtual void run() override;
+  virtual void setDataHandler(RpcDataHandler const& handler) override
+    { m_data_handler = handler; }
+  virtual void setInboundPaused(bool paused) override;
+  virtual bool supportsFraming(RecordFraming framing) const override;
+  virtual void enqueueWithFraming(std::shared_ptr<char const> const& buff, int n,
+    RecordFraming framing) override;
+
+  // these are only called from the SocketServer's epoll thread. returning
+  // false means the connection is done and should be closed
+  bool onReadable();
+  bool onWritable();
+  void close();
+
+private:
+  bool readPacket();
+  bool atRecordBoundary() const;
+  bool takeReframe();
+  void readDelimited(size_t& fresh);
+  bool readLengthPrefixed(size_t& fresh);
+  void sendRecord(char const* buff, int n);
+  void updateWatch();
+
+private:
+  SocketServer*                   m_server;
+  int                             m_fd;
+  RecordFraming                   m_framing;
+  std::atomic<RecordFraming>      m_inbound_framing;
+
+  // a switch of inbound framing from enqueueWithFraming(), made by the
+  // epoll thread at the next record boundary
+  std::atomic<bool>               m_reframe_pending;
+  std::atomic<RecordFraming>      m_reframe_framing;
+  std::mutex                      m_mutex;
+  std::deque< std::vector<char> > m_outgoing_queue;
+  size_t                          m_outgoing_offset;
+  std::vector<char>               m_incoming_buff;
+  size_t                          m_incoming_size;
+  bool                            m_discarding;
+  RecordScanner                   m_scanner;
+  uint32_t                        m_discard_remaining;
+  bool                            m_paused;
+  RpcDataHandler                  m_data_handler;
+};
+
+class SocketServer : public RpcListener
+{
+public:
+  SocketServer();
+  virtual ~SocketServer();
+
+  virtual void init(cJSON const* conf) override;
+  virtual std::shared_ptr<RpcConnectedClient>
+    accept(DeviceInfoProvider const& deviceInfoProvider, RdkDiagProvider const& rdkDiagProvider) override;
+
+  void watch(int fd, uint32_t events);
+
+  // wakes up anyone waiting in accept(), which returns null from then on
+  void stop();
+  int maxRecordSize() const
+    { return m_max_record_size; }
+
+protected:
+  virtual int createListenSocket(cJSON const* conf) = 0;
+  virtual std::shared_ptr<SocketClient> createClient(int fd);
+
+private:
+  void run();
+  void acceptConnections();
+  void closeClient(int fd);
+
+private:
+  int                                             m_max_record_size;
+  int                                             m_listen_fd;
+  int                                             m_epoll_fd;
+  int                                             m_wakeup_fd;
+  std::thread                                     m_epoll_thread;
+  std::mutex                                      m_mutex;
+  std::condition_variable                         m_cond;
+  std::map< int, std::shared_ptr<SocketClient> >  m_clients;
+  std::queue< std::shared_ptr<SocketClient> >     m_accepted;
+  bool                                            m_stopped;
+};
+
+class UnixSocketServer : public SocketServer
+{
+public:
+  UnixSocketServer();
+  virtual ~UnixSocketServer();
+
+protected:
+  virtual int createListenSocket(cJSON const* conf) override;
+
+private:
+  std::string m_path;
+};
+
+class TcpSocketServer : public SocketServer
+{
+public:
+  TcpSocketServer();
+  virtual ~TcpSocketServer();
+
+protected:
+  virtual int createListenSocket(cJSON const* conf) override;
+  virtual std::shared_ptr<SocketClient> createClient(int fd) override;
+};
+
+#endif
@@ -14,6 +14,15 @@
 // limitations under the License.
 //
 #include "util.h"
+#include "logger.h"
+#include "defs.h"
+
+#include <sstream>
+#include <stdexcept>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
 
 std::vector <std::string>
 split(std::string const& str, std::string const& delim)
@@ -44,4 +53,101 @@ std::string runCommand(char const* command)
   fgets(buffer, sizeof(buffer) - 1, fp);
   pclose(fp);
   return std::string(buffer);
-}
\ No newline at end of file
+}
+
+void
+throw_errno(int e, char const* fmt, ...)
+{
+  char buff[256] = {0};
+
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buff, sizeof(buff), fmt, args);
+  buff[sizeof(buff) - 1] = '\0';
+  va_end(args);
+
+  char err[256] = {0};
+  char* p = strerror_r(e, err, sizeof(err));
+
+  std::stringstream out;
+  if (strlen(buff) > 0)
+  {
+    out << buff;
+    out << ". ";
+  }
+  if (p && strlen(p) > 0)
+    out << p;
+
+  std::string message(out.str());
+  XLOG_ERROR("exception:%s", message.c_str());
+  throw std::runtime_error(message);
+}
+
+void
+escapeRecord(char marker, uint8_t const* buff, size_t n, std::vector<char>& out)
+{
+  out.clear();
+  out.reserve(n + n / 64 + 2);
+  out.push_back(marker);
+  for (size_t i = 0; i < n; ++i)
+  {
+    char c = static_cast<char>(buff[i]);
+    if (c == kRecordEscape || c == kRecordDelimiter)
+    {
+      out.push_back(kRecordEscape);
+      c ^= 0x20;
+    }
+    out.push_back(c);
+  }
+}
+
+bool
+unescapeRecord(char const* buff, size_t n, std::vector<uint8_t>& out)
+{
+  out.clear();
+  out.reserve(n);
+  for (size_t i = 1; i < n; ++i)
+  {
+    char c = buff[i];
+    if (c == kRecordEscape)
+    {
+      if (++i == n)
+        return false;
+      c = buff[i] ^ 0x20;
+    }
+    out.push_back(static_cast<uint8_t>(c));
+  }
+  return true;
+}
+
+int
+putVarint(uint32_t value, char* out)
+{
+  int n = 0;
+  while (value >= 0x80)
+  {
+    out[n++] = static_cast<char>((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out[n++] = static_cast<char>(value);
+  return n;
+}
+
+int
+getVarint(char const* buff, size_t n, uint32_t& value)
+{
+  value = 0;
+  for (size_t i = 0; i < n && i < kMaxVarintSize; ++i)
+  {
+    uint8_t b = static_cast<uint8_t>(buff[i]);
+
+    // the fifth byte only has room for the top four bits
+    if (i == kMaxVarintSize - 1 && b > 0x0f)
+      return -1;
+
+    value |= static_cast<uint32_t>(b & 0x7f) << (7 * i);
+    if ((b & 0x80) == 0)
+      return static_cast<int>(i + 1);
+  }
+  return n < kMaxVarintSize ? 0 : -1;
+}
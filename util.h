@@ -18,6 +18,8 @@
 
 #include <vector>
 #include <string>
+#include <stddef.h>
+#include <stdint.h>
 
 /**
  * split string
@@ -29,4 +31,35 @@ std::vector<std::string> split(std::string const& str, std::string const& delim)
  */
 std::string runCommand(char const* cmd);
 
+/**
+ * log and throw std::runtime_error with formatted message and strerror(err)
+ */
+void throw_errno(int err, char const* fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+
+/**
+ * frame binary data as a record: marker, then the data with every
+ * kRecordEscape and kRecordDelimiter byte sent as kRecordEscape followed by
+ * the byte xor 0x20
+ */
+void escapeRecord(char marker, uint8_t const* buff, size_t n, std::vector<char>& out);
+
+/**
+ * reverse escapeRecord, the marker byte is skipped. false if the record
+ * ends in the middle of an escape
+ */
+bool unescapeRecord(char const* buff, size_t n, std::vector<uint8_t>& out);
+
+/**
+ * write value as an unsigned LEB128 varint, out needs room for
+ * kMaxVarintSize bytes. returns the number of bytes written
+ */
+int putVarint(uint32_t value, char* out);
+
+/**
+ * read a varint from the start of buff. returns the number of bytes it
+ * took, 0 if buff ends before it does or -1 if it's too long to be one
+ */
+int getVarint(char const* buff, size_t n, uint32_t& value);
+
 #endif